@@ -21,46 +21,90 @@
 #ifndef MIC_ARR_H
 #define MIC_ARR_H
 
-// Array class for use in offload
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#ifndef __INTEL_COMPILER
+	// icc declares _mm_malloc itself
+	#include <mm_malloc.h>
+#endif
+
+// Default allocator, 64 byte aligned for vectorised loops on MIC. Any type
+// with the same two static functions can be given as the second template
+// argument of Array_T
+struct AlignedAllocator{
+	static void* allocate(size_t bytes) { return _mm_malloc(bytes, 64); }
+	static void deallocate(void* ptr) { _mm_free(ptr); }
+};
+
+// Element types that can be moved around and copied with memcpy
+template<typename T>
+struct ArrayTrivial{
+	static const bool value = __has_trivial_copy(T) && __has_trivial_assign(T) && __has_trivial_destructor(T);
+};
+
+// Element construction, relocation and destruction, one version for types
+// that need their constructors run and one that uses memcpy
+template<typename T, bool Trivial = ArrayTrivial<T>::value>
+struct ArrayOps{
+	static void copy(T* dst, T const* src, unsigned n) {
+		for(unsigned i = 0; i < n; i++)
+			new(dst+i) T(src[i]);
+	}
+	static void relocate(T* dst, T* src, unsigned n) {
+		for(unsigned i = 0; i < n; i++) {
+			new(dst+i) T(static_cast<T&&>(src[i]));
+			src[i].~T();
+		}
+	}
+	static void destroy(T* arr, unsigned n) {
+		for(unsigned i = 0; i < n; i++)
+			arr[i].~T();
+	}
+};
+
 template<typename T>
+struct ArrayOps<T, true>{
+	static void copy(T* dst, T const* src, unsigned n) { if(n) memcpy(dst, src, n*sizeof(T)); }
+	static void relocate(T* dst, T* src, unsigned n) { if(n) memcpy(dst, src, n*sizeof(T)); }
+	static void destroy(T*, unsigned) {}
+};
+
+// Array class for use in offload
+template<typename T, typename Alloc = AlignedAllocator>
 class Array_T{
 public:
 	Array_T() { arr_ = NULL; size_ = 0; capacity_ = 0; }
 
-	Array_T(int i) { 
-		allocator = &defaultAllocator;
-		if(i>0) {
-			arr_ = (T*)_mm_malloc(i*sizeof(T), 64);
-			if(arr_ == NULL){
-				printf("Error: malloc for array(%i) returned null\n", i);
-				fflush(0);
-				exit(1);
-			}
-			size_ = i; 
-			capacity_ = i;
-			for(unsigned i = 0; i < size_; i++)
-				arr_[i] = T();
-		}
-		else {
-			arr_ = NULL; 
-			size_ = 0;
-			capacity_ = 0;
-		} 
+	Array_T(int i) {
+		arr_ = NULL;
+		size_ = 0;
+		capacity_ = 0;
+		resize(i);
 	}
-	
-	~Array_T() { 
-		if(arr_ != NULL) {
-			for(unsigned i = 0; i < size_; i++)
-					arr_[i].~T();
-			_mm_free(arr_);
-			arr_ = NULL;
-			} 
+
+	Array_T(Array_T const& copyarr) {
+		arr_ = NULL;
 		size_ = 0;
 		capacity_ = 0;
+		*this = copyarr;
 	}
 
+	// Takes the buffer, the moved from array is left empty
+	Array_T(Array_T&& movearr) {
+		arr_ = movearr.arr_;
+		size_ = movearr.size_;
+		capacity_ = movearr.capacity_;
+		movearr.arr_ = NULL;
+		movearr.size_ = 0;
+		movearr.capacity_ = 0;
+	}
+
+	~Array_T() { release(); }
+
 	T& operator[] (int loc) {
-		if(loc >= size_){
+		if((unsigned)loc >= size_){
 			printf("Error: array element access out of range [accessed element: %d array size: %d]\n", loc, size_);
 			fflush(0);
 			exit(1);
@@ -70,7 +114,7 @@ public:
 	}
 
 	T const& operator[] (int loc)const {
-		if(loc >= size_){
+		if((unsigned)loc >= size_){
 			printf("Error: array element access out of range [accessed element: %d array size: %d]\n", loc, size_);
 			fflush(0);
 			exit(1);
@@ -79,137 +123,80 @@ public:
 			return arr_[loc];
 	}
 
-	void operator= (Array_T<T> const& copyarr) {
-		if(copyarr.capacity() > 0)
-		{
-			if(capacity_ != copyarr.capacity())
-			{
-				set_capacity(copyarr.capacity());
-			}
-		}
-		if(copyarr.size() > 0)
-		{
-			if(size_ != copyarr.size())
-				resize(copyarr.size());		
-			for(unsigned i = 0; i < size_; i++)
-				arr_[i] = copyarr[i];
-		}
-		else
-		{
-			arr_ = NULL;
-			size_ = 0;
-			capacity_ = 0;			
+	Array_T& operator= (Array_T const& copyarr) {
+		if(this == &copyarr)
+			return *this;
+		ArrayOps<T>::destroy(arr_, size_);
+		size_ = 0;
+		if(copyarr.size_ > capacity_)
+			reallocate(copyarr.size_, "operator=");
+		ArrayOps<T>::copy(arr_, copyarr.arr_, copyarr.size_);
+		size_ = copyarr.size_;
+		return *this;
+	}
+
+	Array_T& operator= (Array_T&& movearr) {
+		if(this != &movearr) {
+			release();
+			swap(movearr);
 		}
+		return *this;
 	}
 
+	// Growing past the capacity at least doubles it, so repeated resizes by
+	// small steps only reallocate a logarithmic number of times
 	void resize(int newSize) {
 		if(newSize>0)
 		{
-			if(arr_ != NULL && newSize <= capacity_)
-			{
-				for(unsigned i = size_; i < newSize; i++)
-				{
-					arr_[i] = T();
-				}
-				size_ = newSize;
-				return;
-			}
-			if(arr_ != NULL) 
-			{
-				T* temp = NULL;
-				temp = (T*)_mm_malloc(newSize*sizeof(T), 64);
-				if(temp == NULL)
-				{
-					printf("Error: malloc for resize(%i) returned null\n", newSize);
-					fflush(0);
-					exit(1);
-				}
-				memcpy(temp, arr_, (newSize > size_ ? size_ : newSize)*sizeof(T) );
-				_mm_free(arr_);
-				arr_ = temp;
-				size_ = newSize;
-				capacity_ = newSize;
-			}
-			else {
-				arr_ = (T*)_mm_malloc(newSize*sizeof(T), 64);
-				if(arr_ == NULL)
-				{
-					printf("Error: malloc for resize(%i) returned null\n", newSize);
-					fflush(0);
-					exit(1);					
-				}
-				size_ = newSize;
-				capacity_ = newSize;
-				for(unsigned i = 0; i < size_; i++)
-				{
-					arr_[i] = T();
-				}
-			}
+			unsigned n = newSize;
+			if(n > capacity_)
+				reallocate((capacity_ && 2*capacity_ > n) ? 2*capacity_ : n, "resize");
+			for(unsigned i = size_; i < n; i++)
+				new(arr_+i) T();
+			if(n < size_)
+				ArrayOps<T>::destroy(arr_+n, size_-n);
+			size_ = n;
 		}
 		else 
-		{
-			if(size_ > 0) {
-				for(unsigned i = 0; i < size_; i++)
-					arr_[i].~T();
-				_mm_free(arr_);
-			}
-			arr_ = NULL; 			
-			size_ = 0;
-			capacity_ = 0;
-		}
+			release();
 	}
 
 	void set_capacity(int newCapacity) {
-		if(arr_ != NULL) {
-			if(newCapacity != capacity_)
-			{
-				T* temp = NULL;
-				if(newCapacity > 0)
-				{
-					temp = (T*)_mm_malloc(newCapacity*sizeof(T), 64);
-					if(temp == NULL){
-						printf("Error: malloc for set_capacity(%i) returned null\n", newCapacity);
-						fflush(0);
-						exit(1);
-					}
-					memcpy(temp, arr_, ((newCapacity < size_) ? newCapacity : size_)*sizeof(T) );
-				}
-
-				_mm_free(arr_);
-				arr_ = temp;
-				size_ = (newCapacity < size_) ? newCapacity : size_;
-				capacity_ = newCapacity;
-			}
-			else return;
-
+		if(newCapacity <= 0) {
+			release();
+			return;
 		}
+		unsigned n = newCapacity;
+		if(n == capacity_)
+			return;
+		if(n < size_) {
+			ArrayOps<T>::destroy(arr_+n, size_-n);
+			size_ = n;
+		}
+		reallocate(n, "set_capacity");
+	}
+
+	void push_back(T const& element) {
+		if(size_ < capacity_)
+			new(arr_+size_) T(element);
 		else {
-			if(newCapacity > 0)
-			{
-				arr_ = (T*)_mm_malloc(newCapacity*sizeof(T), 64);
-				if(arr_ == NULL){
-					printf("Error: malloc for set_capacity(%i) returned null\n", newCapacity);
-					fflush(0);
-					exit(1);
-				}
-			}
-			capacity_ = newCapacity;
-		}		
-	}
-
-	void push_back(T& element) {
-		if(size_ < capacity_){
-			size_++;
-			arr_[size_-1] = T();
-			arr_[size_-1] = element;
+			// element may be in this array, copy it before reallocating
+			T temp(element);
+			reallocate(capacity_ ? 2*capacity_ : 2, "push_back");
+			new(arr_+size_) T(static_cast<T&&>(temp));
 		}
+		size_++;
+	}
+
+	void push_back(T&& element) {
+		if(size_ < capacity_)
+			new(arr_+size_) T(static_cast<T&&>(element));
 		else {
-			if(!capacity_) capacity_++;
-			set_capacity(capacity_*2);
-			++size_;
-			arr_[size_-1] = T();
-			arr_[size_-1] = element;
+			T temp(static_cast<T&&>(element));
+			reallocate(capacity_ ? 2*capacity_ : 2, "push_back");
+			new(arr_+size_) T(static_cast<T&&>(temp));
 		}
+		size_++;
 	}
 
 	T take_back() {
@@ -219,18 +206,25 @@ public:
 		}
 		else
 		{
-			T temp = arr_[size_-1];
+			T temp(static_cast<T&&>(arr_[size_-1]));
+			ArrayOps<T>::destroy(arr_+size_-1, 1);
 			size_ -= 1;
 			return temp;
 		}
 	}
 
-
 	void fill(T fillval) {
 		for(unsigned i = 0; i < size_; i++)
 			arr_[i] = fillval; 
 	}
 
+	// Exchange buffers without copying elements
+	void swap(Array_T& other) {
+		T* arr = arr_; arr_ = other.arr_; other.arr_ = arr;
+		unsigned size = size_; size_ = other.size_; other.size_ = size;
+		unsigned capacity = capacity_; capacity_ = other.capacity_; other.capacity_ = capacity;
+	}
+
 	T* ptr() { return arr_; }
 	T const* ptr() const{ return arr_; }
  	unsigned size() const{ return size_; }
@@ -241,10 +235,35 @@ public:
 	unsigned& capacity_ref() { return capacity_; }
 
 private:
+	// Move the elements to a new buffer of newCapacity >= size_
+	void reallocate(unsigned newCapacity, const char* caller) {
+		T* temp = (T*)Alloc::allocate(newCapacity*sizeof(T));
+		if(temp == NULL){
+			printf("Error: malloc for %s(%u) returned null\n", caller, newCapacity);
+			fflush(0);
+			exit(1);
+		}
+		if(arr_ != NULL) {
+			ArrayOps<T>::relocate(temp, arr_, size_);
+			Alloc::deallocate(arr_);
+		}
+		arr_ = temp;
+		capacity_ = newCapacity;
+	}
+
+	void release() {
+		if(arr_ != NULL) {
+			ArrayOps<T>::destroy(arr_, size_);
+			Alloc::deallocate(arr_);
+		}
+		arr_ = NULL;
+		size_ = 0;
+		capacity_ = 0;
+	}
+
 	T* arr_;
 	unsigned size_;
 	unsigned capacity_;
 };
 
 #endif
-
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//---------------------------------------------------------------
+// Per thread slot layout microbenchmark
+//
+// Mimics what every thread writes when a region starts and stops (a start
+// time, the elapsed time and a few counter deltas) into per thread slots
+// laid out the old way (packed, neighbouring threads share cache lines)
+// and the new way (each thread's slots padded to whole cache lines), and
+// reports the cost of one start/stop pair for each.
+//
+// Usage: ./bench_false_sharing [iterations] [events]
+//---------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "array_t.h"
+
+#define CACHE_LINE 64
+
+// Packed layout as used before padding: times[tid], counts[tid*nEvents + e]
+static double runPacked(int iters, int nThreads, int nEvents)
+{
+    Array_T<double> times;
+    Array_T<long long> counts;
+    times.resize(nThreads);
+    counts.resize(nThreads*nEvents);
+
+    double t = -omp_get_wtime();
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        for(int i = 0; i < iters; i++) {
+            times.ptr()[tid] = -omp_get_wtime();
+            times.ptr()[tid] += omp_get_wtime();
+            for(int e = 0; e < nEvents; e++)
+                counts.ptr()[tid*nEvents + e] = i + e;
+        }
+    }
+    t += omp_get_wtime();
+    return t;
+}
+
+// Padded layout: every thread's slots start on their own cache line
+static double runPadded(int iters, int nThreads, int nEvents)
+{
+    int timeStride = CACHE_LINE/sizeof(double);
+    int countStride = (nEvents*sizeof(long long) + CACHE_LINE - 1)/CACHE_LINE*CACHE_LINE/sizeof(long long);
+    Array_T<double> times;
+    Array_T<long long> counts;
+    times.resize(nThreads*timeStride);
+    counts.resize(nThreads*countStride);
+
+    double t = -omp_get_wtime();
+    #pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        for(int i = 0; i < iters; i++) {
+            times.ptr()[tid*timeStride] = -omp_get_wtime();
+            times.ptr()[tid*timeStride] += omp_get_wtime();
+            for(int e = 0; e < nEvents; e++)
+                counts.ptr()[tid*countStride + e] = i + e;
+        }
+    }
+    t += omp_get_wtime();
+    return t;
+}
+
+int main(int argc, char* argv[])
+{
+    int iters = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int nEvents = (argc > 2) ? atoi(argv[2]) : 2;
+    int nThreads = omp_get_max_threads();
+
+    printf("-----------Per thread slot layout benchmark-----------\n");
+    printf("Threads: %d\nEvents: %d\nIterations: %d\n", nThreads, nEvents, iters);
+
+    // Warm up the team before timing
+    runPadded(iters/10 + 1, nThreads, nEvents);
+
+    double packed = runPacked(iters, nThreads, nEvents);
+    double padded = runPadded(iters, nThreads, nEvents);
+
+    printf("Packed slots: %f s (%f ns per start/stop)\n", packed, 1e9*packed/iters);
+    printf("Padded slots: %f s (%f ns per start/stop)\n", padded, 1e9*padded/iters);
+    printf("Speedup: %fx\n", packed/padded);
+    fflush(0);
+    return 0;
+}
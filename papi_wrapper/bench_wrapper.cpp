@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//---------------------------------------------------------------
+// PapiWrapper microbenchmark
+//
+// Sweeps thread count, number of events, number of unique keys and number
+// of records, and for each combination measures:
+//   fork_ns     one startRecording/stopRecording pair (forks a team)
+//   thread_ns   one threadStartRecording/threadStopRecording pair, per
+//               thread, inside an existing parallel region
+//   records_s   in-region records closed per second
+//   bytes_rec   memoryUsed() after recording, per record
+//   report_s    multiRunPrintAverageRecords() with output discarded
+//   pack_s      packedSize() and packRecords()
+// and writes one CSV row per combination.
+//
+// Events are the first n names of PAPI_EVENTS (0 runs time only), and
+// PAPI_RECORDS is set to the record count so the arena never grows.
+//
+// Usage: ./bench_wrapper [-t threads] [-e events] [-k keys] [-r records] [-o results.csv]
+// where each list is comma separated, e.g. -t 1,60,120,240 -e 0,1,2
+//---------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+#include <omp.h>
+#include "papi_wrapper.h"
+
+static void parseList(const char* arg, Array_T<int>& list)
+{
+	list.resize(0);
+	char* temp = strdup(arg);
+	for(char* tok = strtok(temp, ","); tok != NULL; tok = strtok(NULL, ","))
+		list.push_back(atoi(tok));
+	free(temp);
+}
+
+// Reports and init() print to stdout, which is pointed at /dev/null while
+// they are timed
+static int savedStdout = -1;
+
+static void quiet()
+{
+	fflush(stdout);
+	savedStdout = dup(1);
+	int devNull = open("/dev/null", O_WRONLY);
+	dup2(devNull, 1);
+	close(devNull);
+}
+
+static void loud()
+{
+	fflush(stdout);
+	dup2(savedStdout, 1);
+	close(savedStdout);
+}
+
+static void setEvents(Array_T<std::string>& names, int n)
+{
+	if(n == 0) {
+		unsetenv("PAPI_EVENTS");
+		return;
+	}
+	std::string events = names[0];
+	for(int i = 1; i < n; i++)
+		events += "|" + names[i];
+	setenv("PAPI_EVENTS", events.c_str(), 1);
+}
+
+struct BenchResult{
+	int passes;
+	double forkNs;
+	double threadNs;
+	double recordsPerSec;
+	double bytesPerRecord;
+	double reportSec;
+	double packSec;
+};
+
+static BenchResult runConfig(int nKeys, int nRecords)
+{
+	BenchResult res;
+
+	// Forked regions, one team per start/stop
+	{
+		quiet();
+		PapiWrapper pw;
+		pw.init();
+		loud();
+		res.passes = pw.numPasses();
+		double t = -omp_get_wtime();
+		for(int r = 0; r < nRecords; r++) {
+			pw.startRecording(1000 + r%nKeys);
+			pw.stopRecording();
+		}
+		t += omp_get_wtime();
+		res.forkNs = 1e9*t/nRecords;
+	}
+
+	// In-region records, the way the STREAM demo records its kernels
+	quiet();
+	PapiWrapper pw;
+	pw.init();
+	loud();
+	double t = -omp_get_wtime();
+	#pragma omp parallel
+	{
+		for(int r = 0; r < nRecords; r++) {
+			pw.threadStartRecording(1000 + r%nKeys);
+			pw.threadStopRecording();
+		}
+	}
+	t += omp_get_wtime();
+	res.threadNs = 1e9*t/nRecords;
+	res.recordsPerSec = nRecords/t;
+	res.bytesPerRecord = (double)pw.memoryUsed()/nRecords;
+
+	quiet();
+	t = -omp_get_wtime();
+	pw.multiRunPrintAverageRecords();
+	t += omp_get_wtime();
+	loud();
+	res.reportSec = t;
+
+	t = -omp_get_wtime();
+	unsigned long long bytes = pw.packedSize();
+	char* buffer = (char*)malloc(bytes);
+	pw.packRecords(buffer);
+	t += omp_get_wtime();
+	free(buffer);
+	res.packSec = t;
+	return res;
+}
+
+int main(int argc, char* argv[])
+{
+	int maxThreads = omp_get_max_threads();
+	Array_T<int> threadList, eventList, keyList, recordList;
+	const char* outName = NULL;
+
+	// Available events come from PAPI_EVENTS, the sweep uses prefixes of it
+	Array_T<std::string> eventNames;
+	if(getenv("PAPI_EVENTS") != NULL) {
+		char* temp = strdup(getenv("PAPI_EVENTS"));
+		for(char* tok = strtok(temp, "|"); tok != NULL; tok = strtok(NULL, "|"))
+			eventNames.push_back(std::string(tok));
+		free(temp);
+	}
+
+	// Defaults: powers of two up to every thread, all event counts, a few
+	// key and record counts
+	for(int t = 1; t < maxThreads; t *= 2)
+		threadList.push_back(t);
+	threadList.push_back(maxThreads);
+	for(unsigned e = 0; e <= eventNames.size(); e++)
+		eventList.push_back(e);
+	parseList("1,16,256", keyList);
+	parseList("1000,10000", recordList);
+
+	for(int i = 1; i < argc; i++) {
+		if(i+1 < argc && !strcmp(argv[i], "-t"))
+			parseList(argv[++i], threadList);
+		else if(i+1 < argc && !strcmp(argv[i], "-e"))
+			parseList(argv[++i], eventList);
+		else if(i+1 < argc && !strcmp(argv[i], "-k"))
+			parseList(argv[++i], keyList);
+		else if(i+1 < argc && !strcmp(argv[i], "-r"))
+			parseList(argv[++i], recordList);
+		else if(i+1 < argc && !strcmp(argv[i], "-o"))
+			outName = argv[++i];
+		else {
+			printf("Usage: %s [-t threads] [-e events] [-k keys] [-r records] [-o results.csv]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	FILE* out = stdout;
+	if(outName != NULL) {
+		out = fopen(outName, "w");
+		if(out == NULL) {
+			printf("Could not open %s\n", outName);
+			exit(1);
+		}
+	}
+
+	printf("-----------PapiWrapper benchmark-----------\n");
+	printf("Max threads: %d\nEvents available: %u\n", maxThreads, eventNames.size());
+	fflush(0);
+
+	fprintf(out, "threads,events,passes,keys,records,fork_ns,thread_ns,records_s,bytes_rec,report_s,pack_s\n");
+	for(unsigned ti = 0; ti < threadList.size(); ti++) {
+		int nThreads = threadList[ti];
+		if(nThreads < 1 || nThreads > maxThreads) {
+			printf("Skipping %d threads, 1 to %d available\n", nThreads, maxThreads);
+			continue;
+		}
+		omp_set_num_threads(nThreads);
+		for(unsigned ei = 0; ei < eventList.size(); ei++) {
+			int nEvents = eventList[ei];
+			if(nEvents < 0 || nEvents > (int)eventNames.size()) {
+				printf("Skipping %d events, PAPI_EVENTS names %u\n", nEvents, eventNames.size());
+				continue;
+			}
+			setEvents(eventNames, nEvents);
+			for(unsigned ki = 0; ki < keyList.size(); ki++) {
+				for(unsigned ri = 0; ri < recordList.size(); ri++) {
+					int nKeys = keyList[ki];
+					int nRecords = recordList[ri];
+					if(nKeys < 1 || nRecords < 1)
+						continue;
+					char records[32];
+					snprintf(records, sizeof(records), "%d", nRecords);
+					setenv("PAPI_RECORDS", records, 1);
+
+					BenchResult res = runConfig(nKeys, nRecords);
+					fprintf(out, "%d,%d,%d,%d,%d,%.1f,%.1f,%.0f,%.1f,%.6f,%.6f\n", nThreads, nEvents, res.passes,
+						nKeys, nRecords, res.forkNs, res.threadNs, res.recordsPerSec, res.bytesPerRecord, res.reportSec, res.packSec);
+					fflush(out);
+				}
+			}
+		}
+	}
+
+	if(out != stdout)
+		fclose(out);
+	return 0;
+}
@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+	#include <linux/perf_event.h>
+#endif
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+#ifndef PW_NO_PAPI
+	#include <papi.h>
+#endif
+
+#include "array_t.h"
+#include "counter_backend.h"
+
+// Event sets of the perf and mock backends. Threads create their sets in
+// parallel, so handles index a fixed table and a set never moves once made
+#define PW_MAX_SETS 8192
+
+template<typename S>
+class SetTable{
+public:
+	SetTable() { next_ = 0; memset(sets_, 0, sizeof(sets_)); }
+	~SetTable() {
+		for(int i = 0; i < next_ && i < PW_MAX_SETS; i++)
+			delete sets_[i];
+	}
+
+	int create(int* set) {
+		int id = __sync_fetch_and_add(&next_, 1);
+		if(id >= PW_MAX_SETS)
+			return PW_ENOMEM;
+		sets_[id] = new S();
+		*set = id;
+		return PW_OK;
+	}
+
+	S* get(int set) { return (set >= 0 && set < PW_MAX_SETS) ? sets_[set] : NULL; }
+
+	void destroy(int* set) {
+		if(get(*set)) {
+			delete sets_[*set];
+			sets_[*set] = NULL;
+		}
+		*set = PW_NULL;
+	}
+
+private:
+	S* sets_[PW_MAX_SETS];
+	volatile int next_;
+};
+
+#ifndef PW_NO_PAPI
+//---------------------------------------------------------------
+// PAPI, a thin pass through
+//---------------------------------------------------------------
+// Most counters PAPI can report overflowing at once
+#define PW_MAX_OVERFLOW 64
+
+static PwOverflowHandler papiOverflowHandler = NULL;
+
+// PAPI passes a bit per overflowing counter, turned back into positions
+// in the set
+static void papiOverflow(int set, void* address, long_long overflowVector, void* context)
+{
+	int index[PW_MAX_OVERFLOW];
+	int n = PW_MAX_OVERFLOW;
+	if(papiOverflowHandler == NULL || PAPI_get_overflow_event_index(set, overflowVector, index, &n) != PAPI_OK)
+		return;
+	for(int i = 0; i < n; i++)
+		papiOverflowHandler(set, address, index[i]);
+}
+
+class PapiBackend : public CounterBackend{
+public:
+	const char* name() const { return "PAPI"; }
+
+	int init() {
+		int papi_error = PAPI_library_init(PAPI_VER_CURRENT);
+		if(papi_error != PAPI_VER_CURRENT)
+			return papi_error < 0 ? papi_error : PW_ESYS;
+#ifdef _OPENMP
+		// Assume fixed thread affinity, otherwise this approach fails
+		papi_error = PAPI_thread_init((long unsigned int (*)()) omp_get_thread_num);
+		if(papi_error != PAPI_OK)
+			return papi_error;
+#endif
+		return PW_OK;
+	}
+
+	int numCounters() { return PAPI_num_counters(); }
+	int eventCode(const char* name, int* code) { return PAPI_event_name_to_code((char*)name, code); }
+	int createSet(int* set) { *set = PAPI_NULL; return PAPI_create_eventset(set); }
+	int addEvent(int set, int code) { return PAPI_add_event(set, code); }
+	int addSampledEvent(int set, int code, long long threshold, PwOverflowHandler handler) {
+		int papi_error = PAPI_add_event(set, code);
+		if(papi_error != PAPI_OK)
+			return papi_error;
+		papiOverflowHandler = handler;
+		return PAPI_overflow(set, code, (int)threshold, 0, papiOverflow);
+	}
+	int destroySet(int* set) {
+		PAPI_cleanup_eventset(*set);
+		return PAPI_destroy_eventset(set);
+	}
+	int start(int set) { return PAPI_start(set); }
+	int stop(int set) { return PAPI_stop(set, NULL); }
+	int read(int set, long long* values) { return PAPI_read(set, values); }
+	const char* errorString(int err) { return PAPI_strerror(err); }
+};
+#endif
+
+#if defined(__linux__) && defined(SYS_perf_event_open)
+//---------------------------------------------------------------
+// Linux perf_event_open. Each set is one event group read with a single
+// read() call. Software events work without a PMU (or in a VM)
+//---------------------------------------------------------------
+struct PerfEventName{
+	const char* name;
+	unsigned type;
+	unsigned long long config;
+};
+
+static const PerfEventName perfEvents[] = {
+	{ "task-clock",         PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "cpu-clock",          PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+	{ "page-faults",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minor-faults",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "major-faults",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "context-switches",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations",     PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	{ "cycles",             PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses",      PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	// PAPI preset names for the same events, so PAPI_EVENTS can be reused
+	{ "PAPI_TOT_CYC",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "PAPI_TOT_INS",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "PAPI_BR_INS",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "PAPI_BR_MSP",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+#define PW_PERF_EVENTS ((int)(sizeof(perfEvents)/sizeof(perfEvents[0])))
+
+// Sampled events signal the thread that opened them with SIGIO on every
+// overflow, and the signal's si_fd leads back to the set and position.
+// perfSignalInstalled is 1 while the handler is being installed, 2 after
+#define PW_PERF_MAX_FD 16384
+
+struct PerfOverflow{
+	int sampled;
+	int set;
+	int index;
+};
+
+static PerfOverflow perfOverflow[PW_PERF_MAX_FD];
+static PwOverflowHandler perfOverflowHandler = NULL;
+static volatile int perfSignalInstalled = 0;
+
+static void perfSignal(int sig, siginfo_t* info, void* context)
+{
+	int fd = info->si_fd;
+	if(perfOverflowHandler == NULL || fd < 0 || fd >= PW_PERF_MAX_FD || !perfOverflow[fd].sampled)
+		return;
+	void* address = NULL;
+#if defined(__x86_64__)
+	address = (void*)((ucontext_t*)context)->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	address = (void*)((ucontext_t*)context)->uc_mcontext.gregs[REG_EIP];
+#endif
+	perfOverflowHandler(perfOverflow[fd].set, address, perfOverflow[fd].index);
+}
+
+struct PerfSet{
+	Array_T<int> fds;
+	// Group read buffer, the event count followed by one value per event
+	Array_T<unsigned long long> buf;
+};
+
+class PerfBackend : public CounterBackend{
+public:
+	~PerfBackend() {
+		for(int i = 0; i < PW_MAX_SETS; i++) {
+			int set = i;
+			if(sets_.get(set))
+				destroySet(&set);
+		}
+	}
+
+	const char* name() const { return "perf_event"; }
+	int init() { return PW_OK; }
+	int numCounters() { return 64; }
+
+	int eventCode(const char* name, int* code) {
+		for(int i = 0; i < PW_PERF_EVENTS; i++) {
+			if(!strcmp(name, perfEvents[i].name)) {
+				*code = i;
+				return PW_OK;
+			}
+		}
+		return PW_ENOEVNT;
+	}
+
+	int createSet(int* set) { return sets_.create(set); }
+
+	int addEvent(int set, int code) { return openEvent(set, code, 0, NULL); }
+
+	int addSampledEvent(int set, int code, long long threshold, PwOverflowHandler handler) {
+		if(threshold <= 0)
+			return PW_NOSUPP;
+		return openEvent(set, code, threshold, handler);
+	}
+
+	int destroySet(int* set) {
+		PerfSet* s = sets_.get(*set);
+		if(!s)
+			return PW_ENOEVNT;
+		for(int i = s->fds.size()-1; i >= 0; i--) {
+			if(s->fds[i] < PW_PERF_MAX_FD)
+				perfOverflow[s->fds[i]].sampled = 0;
+			close(s->fds[i]);
+		}
+		sets_.destroy(set);
+		return PW_OK;
+	}
+
+	int start(int set) {
+		PerfSet* s = sets_.get(set);
+		if(!s || !s->fds.size())
+			return PW_ENOEVNT;
+		if(ioctl(s->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) != 0 ||
+		   ioctl(s->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) != 0)
+			return perfError(errno);
+		return PW_OK;
+	}
+
+	int stop(int set) {
+		PerfSet* s = sets_.get(set);
+		if(!s || !s->fds.size())
+			return PW_ENOEVNT;
+		if(ioctl(s->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) != 0)
+			return perfError(errno);
+		return PW_OK;
+	}
+
+	int read(int set, long long* values) {
+		PerfSet* s = sets_.get(set);
+		if(!s || !s->fds.size())
+			return PW_ENOEVNT;
+		size_t bytes = s->buf.size()*sizeof(unsigned long long);
+		if(::read(s->fds[0], s->buf.ptr(), bytes) != (ssize_t)bytes)
+			return perfError(errno);
+		for(unsigned i = 0; i < s->fds.size(); i++)
+			values[i] = s->buf.ptr()[1+i];
+		return PW_OK;
+	}
+
+	// read(2) is async-signal-safe and the set table is fixed
+	bool readsInSignals() const { return true; }
+
+	const char* errorString(int err) {
+		if(err == PW_ECNFLCT)
+			return "Events cannot be counted together";
+		if(err == PW_ENOEVNT)
+			return "Event does not exist";
+		if(err == PW_ENOMEM)
+			return "Too many event sets";
+		if(err == PW_NOSUPP)
+			return "Sampling needs a positive threshold";
+		if(err < -1000)
+			return strerror(-1000 - err);
+		return "Unknown error";
+	}
+
+private:
+	// System errors are passed on as -1000 - errno
+	static int perfError(int e) { return -1000 - e; }
+
+	// threshold 0 counts only, otherwise the event is opened as a sampling
+	// event that raises SIGIO on the calling thread every threshold counts
+	int openEvent(int set, int code, long long threshold, PwOverflowHandler handler) {
+		PerfSet* s = sets_.get(set);
+		if(!s || code < 0 || code >= PW_PERF_EVENTS)
+			return PW_ENOEVNT;
+
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perfEvents[code].type;
+		attr.config = perfEvents[code].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.disabled = s->fds.size() ? 0 : 1;
+		if(threshold) {
+			attr.sample_period = threshold;
+			attr.sample_type = PERF_SAMPLE_IP;
+			attr.wakeup_events = 1;
+		}
+
+		// The calling thread on any CPU, the kernel refuses a group that
+		// cannot be scheduled on the counters together
+		int leader = s->fds.size() ? s->fds[0] : -1;
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		if(fd < 0)
+			return (errno == EINVAL || errno == ENOSPC) && leader >= 0 ? PW_ECNFLCT : perfError(errno);
+		if(threshold) {
+			int err = enableSignal(fd, set, s->fds.size(), handler);
+			if(err != PW_OK) {
+				close(fd);
+				return err;
+			}
+		}
+		s->fds.push_back(fd);
+		s->buf.resize(1 + s->fds.size());
+		return PW_OK;
+	}
+
+	int enableSignal(int fd, int set, int index, PwOverflowHandler handler) {
+		if(fd >= PW_PERF_MAX_FD)
+			return PW_ENOMEM;
+		perfOverflowHandler = handler;
+		// SIGIO kills by default, so no thread goes on until it is handled
+		if(__sync_bool_compare_and_swap(&perfSignalInstalled, 0, 1)) {
+			struct sigaction sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_sigaction = perfSignal;
+			sa.sa_flags = SA_SIGINFO | SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			int err = sigaction(SIGIO, &sa, NULL) != 0 ? errno : 0;
+			perfSignalInstalled = err ? 0 : 2;
+			if(err)
+				return perfError(err);
+		}
+		while(perfSignalInstalled == 1)
+			;
+		if(perfSignalInstalled != 2)
+			return PW_ESYS;
+		perfOverflow[fd].set = set;
+		perfOverflow[fd].index = index;
+		perfOverflow[fd].sampled = 1;
+
+		// Signal this thread rather than the process, with si_fd filled in
+		struct f_owner_ex owner;
+		owner.type = F_OWNER_TID;
+		owner.pid = syscall(SYS_gettid);
+		if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0 ||
+		   fcntl(fd, F_SETSIG, SIGIO) != 0 ||
+		   fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+			perfOverflow[fd].sampled = 0;
+			return perfError(errno);
+		}
+		return PW_OK;
+	}
+
+	SetTable<PerfSet> sets_;
+};
+#endif
+
+//---------------------------------------------------------------
+// Mock, every event name exists and each read of a set advances it by one
+// tick, event code c counting (c+1)*1000 per tick. The wrapper only reads
+// at region starts and stops, snapshots peek without a tick, so a region
+// with k nested regions counts exactly (2k+1)*(c+1)*1000, whatever it runs
+// and however often it is snapshotted. Sampled events overflow during the
+// read, at the caller's address.
+// Events named in PW_MOCK_FIXED="NAME|NAME" only fit the first counter,
+// like some MIC events, so no two of them share a set. PW_MOCK_SIGNAL_READS=0
+// leaves snapshots to region starts and stops, as with PAPI
+//---------------------------------------------------------------
+struct MockSet{
+	MockSet() { ticks = 0; running = false; }
+	Array_T<int> codes;
+	// Per event, 0 when not sampled
+	Array_T<long long> thresholds;
+	unsigned long long ticks;
+	bool running;
+};
+
+class MockBackend : public CounterBackend{
+public:
+	MockBackend() {
+		handler_ = NULL;
+		char* signalReads = getenv("PW_MOCK_SIGNAL_READS");
+		signalReads_ = signalReads == NULL || atoi(signalReads) != 0;
+	}
+	~MockBackend() {
+		for(unsigned i = 0; i < names_.size(); i++)
+			free(names_[i]);
+	}
+
+	const char* name() const { return "mock"; }
+	int init() { return PW_OK; }
+
+	// PW_MOCK_COUNTERS, 2 by default like a MIC hardware thread
+	int numCounters() {
+		char* counters = getenv("PW_MOCK_COUNTERS");
+		if(counters != NULL && atoi(counters) > 0)
+			return atoi(counters);
+		return 2;
+	}
+
+	// Codes are given out in the order names are first seen
+	int eventCode(const char* name, int* code) {
+		for(unsigned i = 0; i < names_.size(); i++) {
+			if(!strcmp(name, names_[i])) {
+				*code = i;
+				return PW_OK;
+			}
+		}
+		char* copy = strdup(name);
+		names_.push_back(copy);
+		*code = names_.size()-1;
+		return PW_OK;
+	}
+
+	int createSet(int* set) { return sets_.create(set); }
+
+	int addEvent(int set, int code) {
+		MockSet* s = sets_.get(set);
+		if(!s)
+			return PW_ENOEVNT;
+		if((int)s->codes.size() >= numCounters())
+			return PW_ECNFLCT;
+		for(unsigned i = 0; i < s->codes.size() && fixed(code); i++)
+			if(fixed(s->codes[i]))
+				return PW_ECNFLCT;
+		s->codes.push_back(code);
+		s->thresholds.push_back(0);
+		return PW_OK;
+	}
+
+	int addSampledEvent(int set, int code, long long threshold, PwOverflowHandler handler) {
+		if(threshold <= 0)
+			return PW_NOSUPP;
+		int err = addEvent(set, code);
+		if(err != PW_OK)
+			return err;
+		MockSet* s = sets_.get(set);
+		s->thresholds[s->thresholds.size()-1] = threshold;
+		handler_ = handler;
+		return PW_OK;
+	}
+
+	int destroySet(int* set) {
+		sets_.destroy(set);
+		return PW_OK;
+	}
+
+	int start(int set) {
+		MockSet* s = sets_.get(set);
+		if(!s)
+			return PW_ENOEVNT;
+		if(s->running)
+			return PW_EISRUN;
+		s->running = true;
+		s->ticks = 0;
+		return PW_OK;
+	}
+
+	int stop(int set) {
+		MockSet* s = sets_.get(set);
+		if(!s)
+			return PW_ENOEVNT;
+		if(!s->running)
+			return PW_ENOTRUN;
+		s->running = false;
+		return PW_OK;
+	}
+
+	int read(int set, long long* values) {
+		MockSet* s = sets_.get(set);
+		if(!s)
+			return PW_ENOEVNT;
+		if(!s->running)
+			return PW_ENOTRUN;
+		s->ticks++;
+		for(unsigned i = 0; i < s->codes.size(); i++) {
+			values[i] = s->ticks*(s->codes[i]+1)*1000;
+			long long threshold = s->thresholds[i];
+			if(threshold) {
+				long long overflows = values[i]/threshold - (values[i] - (s->codes[i]+1)*1000)/threshold;
+				for(long long o = 0; o < overflows; o++)
+					handler_(set, __builtin_return_address(0), i);
+			}
+		}
+		return PW_OK;
+	}
+
+	// Counts so far, without a tick or overflows. Safe in a signal handler
+	// as long as it does not interrupt a read of the same set
+	int peek(int set, long long* values) {
+		MockSet* s = sets_.get(set);
+		if(!s)
+			return PW_ENOEVNT;
+		if(!s->running)
+			return PW_ENOTRUN;
+		for(unsigned i = 0; i < s->codes.size(); i++)
+			values[i] = s->ticks*(s->codes[i]+1)*1000;
+		return PW_OK;
+	}
+	bool readsInSignals() const { return signalReads_; }
+
+	const char* errorString(int err) {
+		switch(err) {
+			case PW_ECNFLCT: return "Too many events for the mock counters";
+			case PW_ENOEVNT: return "No such event set";
+			case PW_ENOMEM: return "Too many event sets";
+			case PW_ENOTRUN: return "Event set not running";
+			case PW_EISRUN: return "Event set already running";
+			case PW_NOSUPP: return "Sampling needs a positive threshold";
+		}
+		return "Unknown error";
+	}
+
+private:
+	bool fixed(int code) {
+		char* list = getenv("PW_MOCK_FIXED");
+		if(list == NULL || code < 0 || code >= (int)names_.size())
+			return false;
+		size_t len = strlen(names_[code]);
+		for(char* p = strstr(list, names_[code]); p != NULL; p = strstr(p+1, names_[code]))
+			if((p == list || p[-1] == '|') && (p[len] == '|' || p[len] == 0))
+				return true;
+		return false;
+	}
+
+	Array_T<char*> names_;
+	SetTable<MockSet> sets_;
+	PwOverflowHandler handler_;
+	bool signalReads_;
+};
+
+CounterBackend* pwCreateBackend(const char* name)
+{
+	if(name == NULL || !name[0]) {
+#ifndef PW_NO_PAPI
+		return new PapiBackend();
+#elif defined(__linux__) && defined(SYS_perf_event_open)
+		return new PerfBackend();
+#else
+		return new MockBackend();
+#endif
+	}
+#ifndef PW_NO_PAPI
+	if(!strcmp(name, "papi"))
+		return new PapiBackend();
+#endif
+#if defined(__linux__) && defined(SYS_perf_event_open)
+	if(!strcmp(name, "perf"))
+		return new PerfBackend();
+#endif
+	if(!strcmp(name, "mock"))
+		return new MockBackend();
+	return NULL;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_COUNTER_BACKEND_H
+#define MIC_COUNTER_BACKEND_H
+
+// Return codes shared by every backend, 0 and negative like PAPI's
+#define PW_OK           0
+#define PW_ESYS        -3
+#define PW_ENOMEM      -2
+#define PW_ENOEVNT     -7
+#define PW_ECNFLCT     -8
+#define PW_ENOTRUN     -9
+#define PW_EISRUN     -10
+#define PW_NOSUPP     -18
+// Not an event set
+#define PW_NULL        -1
+
+// Called for a sampled event on the thread whose counter overflowed, from
+// its signal handler, with the interrupted instruction and the event's
+// position in the set
+typedef void (*PwOverflowHandler)(int set, void* address, int index);
+
+// Source of counter values behind PapiWrapper. Event sets are handles
+// created, started and read by the thread that owns them, counting only
+// that thread. Calls return PW_OK or a negative error code that
+// errorString() describes
+class CounterBackend{
+public:
+	virtual ~CounterBackend() {}
+	virtual const char* name() const = 0;
+	// Once from init(), before any other call
+	virtual int init() = 0;
+	// Upper bound on events counted together, the real limit shows up as
+	// addEvent() failing
+	virtual int numCounters() = 0;
+	virtual int eventCode(const char* name, int* code) = 0;
+	virtual int createSet(int* set) = 0;
+	// PW_ECNFLCT (or another error) when the event cannot join the set
+	virtual int addEvent(int set, int code) = 0;
+	// Add an event that also calls handler every threshold counts while the
+	// set runs, PW_NOSUPP when the backend cannot sample
+	virtual int addSampledEvent(int set, int code, long long threshold, PwOverflowHandler handler) { return PW_NOSUPP; }
+	virtual int destroySet(int* set) = 0;
+	virtual int start(int set) = 0;
+	virtual int stop(int set) = 0;
+	// Current values of a running set, in the order events were added
+	virtual int read(int set, long long* values) = 0;
+	// Values for a snapshot inside a region, only the mock tells this apart
+	// from read(): its counts come from the region start and stop reads
+	virtual int peek(int set, long long* values) { return read(set, values); }
+	// Whether read() may be called from a signal handler on the set's
+	// thread, interrupting anything other than a read of the same set
+	virtual bool readsInSignals() const { return false; }
+	virtual const char* errorString(int err) = 0;
+};
+
+// "papi" (the default when built with PAPI), "perf" for Linux
+// perf_event_open, or "mock" for deterministic counts. NULL or an empty
+// name gives the default, an unknown name returns NULL
+CounterBackend* pwCreateBackend(const char* name);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_DERIVED_METRIC_H
+#define MIC_DERIVED_METRIC_H
+
+// Derived metrics, named arithmetic expressions over event counts such as
+// VI=VPU_ELEMENTS_ACTIVE/VPU_INSTRUCTIONS_EXECUTED. compile() turns the
+// expression into a postfix program once, eval() runs it over one set of
+// values: the event counts in event order, then the region time as TIME.
+//
+// Expressions use + - * / unary minus, parentheses, numbers, event names
+// and TIME. Event names are matched longest first, so perf names such as
+// task-clock work as long as they are not followed by more name characters.
+// Pass NAN for events that were not counted, a metric using one is NAN, as
+// is a metric dividing by zero.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "array_t.h"
+
+#define PW_METRIC_NAME_LEN  64
+#define PW_METRIC_EXPR_LEN  256
+// Deepest evaluation stack a metric may need
+#define PW_METRIC_STACK     32
+
+enum PwMetricOp{
+	PW_OP_VALUE,
+	PW_OP_CONST,
+	PW_OP_ADD,
+	PW_OP_SUB,
+	PW_OP_MUL,
+	PW_OP_DIV,
+	PW_OP_NEG
+};
+
+struct PwMetricStep{
+	int op;
+	// Value index for PW_OP_VALUE, numEvents is TIME
+	int index;
+	double constant;
+};
+
+class DerivedMetric{
+public:
+	DerivedMetric() { name_[0] = 0; expr_[0] = 0; }
+
+	// spec is "NAME=expression", prints the problem and returns false if it
+	// does not parse
+	bool compile(const char* spec, const char* const* eventNames, unsigned numEvents) {
+		const char* eq = strchr(spec, '=');
+		if(eq == NULL || eq == spec || eq - spec >= PW_METRIC_NAME_LEN || strlen(eq+1) >= PW_METRIC_EXPR_LEN) {
+			printf("Metric %s: expected NAME=expression (name under %d, expression under %d characters)\n",
+				spec, PW_METRIC_NAME_LEN, PW_METRIC_EXPR_LEN);
+			return false;
+		}
+		memset(name_, 0, sizeof(name_));
+		memcpy(name_, spec, eq - spec);
+		strcpy(expr_, eq+1);
+		return compileExpr(eventNames, numEvents);
+	}
+
+	// Compile an already split name and expression
+	bool compile(const char* name, const char* expr, const char* const* eventNames, unsigned numEvents) {
+		if(strlen(name) >= PW_METRIC_NAME_LEN || strlen(expr) >= PW_METRIC_EXPR_LEN) {
+			printf("Metric %s: name or expression too long\n", name);
+			return false;
+		}
+		strcpy(name_, name);
+		strcpy(expr_, expr);
+		return compileExpr(eventNames, numEvents);
+	}
+
+	double eval(const double* values) const {
+		double stack[PW_METRIC_STACK];
+		int top = 0;
+		for(unsigned i = 0; i < program_.size(); i++) {
+			const PwMetricStep& s = program_[i];
+			switch(s.op) {
+				case PW_OP_VALUE: stack[top++] = values[s.index]; break;
+				case PW_OP_CONST: stack[top++] = s.constant; break;
+				case PW_OP_NEG: stack[top-1] = -stack[top-1]; break;
+				case PW_OP_ADD: top--; stack[top-1] += stack[top]; break;
+				case PW_OP_SUB: top--; stack[top-1] -= stack[top]; break;
+				case PW_OP_MUL: top--; stack[top-1] *= stack[top]; break;
+				case PW_OP_DIV:
+					top--;
+					stack[top-1] = (stack[top] == 0) ? NAN : stack[top-1]/stack[top];
+					break;
+			}
+		}
+		return stack[0];
+	}
+
+	const char* name() const { return name_; }
+	const char* expr() const { return expr_; }
+
+private:
+	bool compileExpr(const char* const* eventNames, unsigned numEvents) {
+		program_.resize(0);
+		names_ = eventNames;
+		numNames_ = numEvents;
+		pos_ = expr_;
+		depth_ = maxDepth_ = 0;
+		bool ok = parseSum();
+		skipSpace();
+		if(ok && *pos_) {
+			printf("Metric %s: unexpected '%s'\n", name_, pos_);
+			ok = false;
+		}
+		if(ok && maxDepth_ > PW_METRIC_STACK) {
+			printf("Metric %s: expression nests too deeply\n", name_);
+			ok = false;
+		}
+		names_ = NULL;
+		return ok;
+	}
+
+	void skipSpace() {
+		while(isspace((unsigned char)*pos_))
+			pos_++;
+	}
+
+	static bool isNameChar(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+	void emit(int op, int index, double constant) {
+		PwMetricStep s;
+		s.op = op;
+		s.index = index;
+		s.constant = constant;
+		program_.push_back(s);
+		if(op == PW_OP_VALUE || op == PW_OP_CONST) {
+			if(++depth_ > maxDepth_)
+				maxDepth_ = depth_;
+		}
+		else if(op != PW_OP_NEG)
+			depth_--;
+	}
+
+	bool parseSum() {
+		if(!parseProduct())
+			return false;
+		for(;;) {
+			skipSpace();
+			char c = *pos_;
+			if(c != '+' && c != '-')
+				return true;
+			pos_++;
+			if(!parseProduct())
+				return false;
+			emit(c == '+' ? PW_OP_ADD : PW_OP_SUB, 0, 0);
+		}
+	}
+
+	bool parseProduct() {
+		if(!parseUnary())
+			return false;
+		for(;;) {
+			skipSpace();
+			char c = *pos_;
+			if(c != '*' && c != '/')
+				return true;
+			pos_++;
+			if(!parseUnary())
+				return false;
+			emit(c == '*' ? PW_OP_MUL : PW_OP_DIV, 0, 0);
+		}
+	}
+
+	bool parseUnary() {
+		skipSpace();
+		if(*pos_ == '-') {
+			pos_++;
+			if(!parseUnary())
+				return false;
+			emit(PW_OP_NEG, 0, 0);
+			return true;
+		}
+		return parsePrimary();
+	}
+
+	bool parsePrimary() {
+		skipSpace();
+		if(*pos_ == '(') {
+			pos_++;
+			if(!parseSum())
+				return false;
+			skipSpace();
+			if(*pos_ != ')') {
+				printf("Metric %s: missing ')' in %s\n", name_, expr_);
+				return false;
+			}
+			pos_++;
+			return true;
+		}
+		if(isdigit((unsigned char)*pos_) || *pos_ == '.') {
+			char* end;
+			double constant = strtod(pos_, &end);
+			pos_ = end;
+			emit(PW_OP_CONST, 0, constant);
+			return true;
+		}
+
+		// Longest event name starting here
+		int best = -1;
+		size_t bestLen = 0;
+		for(unsigned i = 0; i < numNames_; i++) {
+			size_t len = strlen(names_[i]);
+			if(len > bestLen && !strncmp(pos_, names_[i], len) && !isNameChar(pos_[len])) {
+				best = i;
+				bestLen = len;
+			}
+		}
+		if(best >= 0) {
+			pos_ += bestLen;
+			emit(PW_OP_VALUE, best, 0);
+			return true;
+		}
+		if(!strncmp(pos_, "TIME", 4) && !isNameChar(pos_[4])) {
+			pos_ += 4;
+			emit(PW_OP_VALUE, numNames_, 0);
+			return true;
+		}
+
+		if(*pos_)
+			printf("Metric %s: unknown event at '%s', metrics can only use events in PAPI_EVENTS and TIME\n", name_, pos_);
+		else
+			printf("Metric %s: expression ends early\n", name_);
+		return false;
+	}
+
+	char name_[PW_METRIC_NAME_LEN];
+	char expr_[PW_METRIC_EXPR_LEN];
+	Array_T<PwMetricStep> program_;
+	// Only used while compiling
+	const char* const* names_;
+	unsigned numNames_;
+	const char* pos_;
+	int depth_;
+	int maxDepth_;
+};
+
+#endif
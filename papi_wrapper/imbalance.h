@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_IMBALANCE_H
+#define MIC_IMBALANCE_H
+
+// Load imbalance across the threads of a team for one key. A parallel
+// region ends when its slowest thread does, so every other thread's
+// shortfall on the slowest is time a core spent idle at the barrier.
+//
+// Inputs are each thread's mean over the key's runs: times[thread], and
+// counts[thread*numEvents + event] with NAN for events never counted.
+
+#include <stdio.h>
+#include <math.h>
+
+#include "array_t.h"
+
+// Threads this far over the mean time are listed as stragglers
+#define PW_STRAGGLER_FRACTION   0.05
+// Most straggler thread IDs listed
+#define PW_MAX_STRAGGLERS       32
+#define PW_HISTOGRAM_BINS       10
+#define PW_HISTOGRAM_WIDTH      50
+
+// Slowest, fastest and mean of n values, NAN values are skipped. Returns
+// the number of values used
+inline unsigned pwSpread(const double* v, unsigned n, unsigned stride, double& mean, double& max, unsigned& maxIdx,
+                         double& min, unsigned& minIdx)
+{
+	unsigned used = 0;
+	double sum = 0;
+	mean = max = min = 0;
+	maxIdx = minIdx = 0;
+	for(unsigned i = 0; i < n; i++) {
+		double x = v[i*stride];
+		if(isnan(x))
+			continue;
+		if(!used || x > max) { max = x; maxIdx = i; }
+		if(!used || x < min) { min = x; minIdx = i; }
+		sum += x;
+		used++;
+	}
+	if(used)
+		mean = sum/used;
+	return used;
+}
+
+// wasted is the total over runs of (slowest thread - each thread) time,
+// estimated tells the reader it came from means rather than per run times
+inline void pwPrintImbalance(unsigned numThreads, const double* times, double wasted, unsigned runs, bool estimated,
+                             unsigned numEvents, const char* const* eventNames, const double* counts)
+{
+	double mean, max, min;
+	unsigned maxIdx, minIdx;
+	if(!pwSpread(times, numThreads, 1, mean, max, maxIdx, min, minIdx) || runs == 0) {
+		printf("No runs\n");
+		return;
+	}
+
+	printf("Time per thread: mean %.9f, max %.9f (thread %u), min %.9f (thread %u), max/mean %.3f\n",
+		mean, max, maxIdx, min, minIdx, mean > 0 ? max/mean : 0.0);
+	double available = max*numThreads*runs;
+	printf("Wasted thread-seconds%s: %.9f over %u runs, %.9f per run (%.1f%% of the team's time)\n",
+		estimated ? " (from thread means)" : "", wasted, runs, wasted/runs, available > 0 ? 100*wasted/available : 0.0);
+
+	// Threads well over the mean set the wall time
+	unsigned nStragglers = 0;
+	printf("Stragglers, over %.0f%% above the mean time:", 100*PW_STRAGGLER_FRACTION);
+	for(unsigned t = 0; t < numThreads; t++) {
+		if(times[t] > (1 + PW_STRAGGLER_FRACTION)*mean) {
+			if(nStragglers < PW_MAX_STRAGGLERS)
+				printf(" %u", t);
+			nStragglers++;
+		}
+	}
+	if(nStragglers > PW_MAX_STRAGGLERS)
+		printf(" ...");
+	printf(" (%u threads)\n", nStragglers);
+
+	// Histogram of thread times between the fastest and slowest thread
+	unsigned bins[PW_HISTOGRAM_BINS] = {0};
+	double width = (max - min)/PW_HISTOGRAM_BINS;
+	unsigned most = 0;
+	for(unsigned t = 0; t < numThreads; t++) {
+		unsigned b = width > 0 ? (unsigned)((times[t] - min)/width) : 0;
+		if(b >= PW_HISTOGRAM_BINS)
+			b = PW_HISTOGRAM_BINS-1;
+		if(++bins[b] > most)
+			most = bins[b];
+	}
+	printf("Thread times:\n");
+	for(unsigned b = 0; b < PW_HISTOGRAM_BINS; b++) {
+		if(width <= 0 && b)
+			break;
+		printf("  %.9f - %.9f %5u ", min + b*width, min + (b+1)*width, bins[b]);
+		unsigned bar = (bins[b]*PW_HISTOGRAM_WIDTH + most - 1)/most;
+		for(unsigned i = 0; i < bar; i++)
+			printf("#");
+		printf("\n");
+	}
+
+	// Uneven counts say whether threads got uneven work or ran it slower
+	for(unsigned e = 0; e < numEvents; e++) {
+		if(!pwSpread(counts + e, numThreads, numEvents, mean, max, maxIdx, min, minIdx)) {
+			printf("%-32s n/a\n", eventNames[e]);
+			continue;
+		}
+		printf("%-32s max/mean %.3f, max %.0f (thread %u), min %.0f (thread %u)\n",
+			eventNames[e], mean > 0 ? max/mean : 0.0, max, maxIdx, min, minIdx);
+	}
+}
+
+#endif
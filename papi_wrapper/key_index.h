@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_KEY_INDEX_H
+#define MIC_KEY_INDEX_H
+
+#include "array_t.h"
+
+// FNV-1a hash of a region name, evaluated by the compiler for literals
+constexpr unsigned pwHashName(const char* s, unsigned h = 2166136261u)
+{
+	return *s ? pwHashName(s+1, (h ^ (unsigned char)*s) * 16777619u) : h;
+}
+
+// Forces the hash to be a compile time constant
+template<unsigned ID>
+struct PwRegionId{
+	static const unsigned value = ID;
+};
+
+// Stable integer key for a named region, e.g. PW_REGION("stream_triad")
+#define PW_REGION(name) (PwRegionId<pwHashName(name)>::value)
+// Key and label together, e.g. pw.startRecording(PW_NAMED("stream_triad"))
+#define PW_NAMED(name) PW_REGION(name), name
+
+// Open addressing (linear probing) index from region keys to the dense
+// index of the key in insertion order
+class KeyIndex{
+public:
+	KeyIndex() { count_ = 0; }
+
+	int find(unsigned key) const {
+		if(!slots_.size())
+			return -1;
+		unsigned mask = slots_.size()-1;
+		for(unsigned i = hash(key) & mask; ; i = (i+1) & mask) {
+			int slot = slots_.ptr()[i];
+			if(slot < 0)
+				return -1;
+			if(keys_.ptr()[i] == key)
+				return slot;
+		}
+	}
+
+	// Key must not already be in the index
+	void insert(unsigned key, int idx) {
+		if(2*(count_+1) > slots_.size())
+			rehash(slots_.size() ? 2*slots_.size() : 16);
+		place(key, idx);
+		count_++;
+	}
+
+	unsigned size() const { return count_; }
+	unsigned long long bytes() const { return keys_.capacity()*sizeof(unsigned) + slots_.capacity()*sizeof(int); }
+
+private:
+	static unsigned hash(unsigned key) {
+		key *= 2654435761u;
+		return key ^ (key >> 16);
+	}
+
+	void place(unsigned key, int idx) {
+		unsigned mask = slots_.size()-1;
+		unsigned i = hash(key) & mask;
+		while(slots_[i] >= 0)
+			i = (i+1) & mask;
+		keys_[i] = key;
+		slots_[i] = idx;
+	}
+
+	void rehash(unsigned newSize) {
+		Array_T<unsigned> oldKeys;
+		Array_T<int> oldSlots;
+		oldKeys.swap(keys_);
+		oldSlots.swap(slots_);
+		keys_.resize(newSize);
+		slots_.resize(newSize);
+		slots_.fill(-1);
+		for(unsigned i = 0; i < oldSlots.size(); i++) {
+			if(oldSlots[i] >= 0)
+				place(oldKeys[i], oldSlots[i]);
+		}
+	}
+
+	Array_T<unsigned> keys_;
+	Array_T<int> slots_;
+	unsigned count_;
+};
+
+#endif
@@ -30,15 +30,25 @@
 #include "mic_utils.h"
 
 
+#pragma offload_attribute(push, target(mic))
+#include "pool_allocator.h"
+#include "array_t.h"
 #ifdef USE_PAPI_WRAP
-    #pragma offload_attribute(push, target(mic))
     #include "papi_wrapper.h"
-    #pragma offload_attribute(pop)
 #endif
+#pragma offload_attribute(pop)
+
+// Allocate the device arrays from the huge page pool (pool_allocator.h)
+// rather than through the offload runtime, to compare DATA_PAGE_WALK and
+// LONG_DATA_PAGE_WALK with and without it
+//#define STREAM_POOL
 
 
 #define MULTIRUN
 
+// Copy the records back as one flat buffer and report on the host
+#define HOST_REPORT
+
 #ifdef MULTIRUN
     #define NTIMES          10
 #else
@@ -49,15 +59,51 @@
 #define STREAM_TYPE     float
 
 #ifdef USE_PAPI_WRAP
-    #define STR_COPY        0
-    #define STR_SCALE       1
-    #define STR_ADD         2
-    #define STR_TRIAD       3
+    #define STR_COPY        PW_NAMED("stream_copy")
+    #define STR_SCALE       PW_NAMED("stream_scale")
+    #define STR_ADD         PW_NAMED("stream_add")
+    #define STR_TRIAD       PW_NAMED("stream_triad")
+    #define STR_ITER        PW_NAMED("stream_iteration")
+    #define STR_CHUNK       PW_NAMED("stream_chunk")
 #endif
 
+// Chunks each kernel is recorded in when snapshots need nested regions
+#define STREAM_CHUNKS   32
+
 double getTime();
 void reportTime(std::string);
 std::vector<double> timer;
+
+#ifdef STREAM_POOL
+    typedef PoolAllocator<> StreamAllocator;
+
+    // Device arrays, allocated and filled on the device
+    EVT_TARGET_MIC STREAM_TYPE* x = NULL;
+    EVT_TARGET_MIC STREAM_TYPE* y = NULL;
+    EVT_TARGET_MIC STREAM_TYPE* z = NULL;
+#endif
+
+template<typename Alloc>
+EVT_TARGET_MIC STREAM_TYPE* allocStream(size_t n)
+{
+    STREAM_TYPE* arr = (STREAM_TYPE*)Alloc::allocate(n*sizeof(STREAM_TYPE));
+    if(arr == NULL)
+    {
+        printf("Could not allocate %lu stream elements\n", (unsigned long)n);
+        exit(1);
+    }
+    return arr;
+}
+
+// First element of chunk c of n
+EVT_TARGET_MIC inline int chunkBegin(int c, int n)
+{
+    return (int)((long long)SIZE*c/n);
+}
+
+// Packed record buffer left on the device for the host to collect
+EVT_TARGET_MIC char* devRecords = NULL;
+EVT_TARGET_MIC unsigned long long recordBytes = 0;
  
 int main(int argc, char* argv[])
 {
@@ -75,10 +121,28 @@ int main(int argc, char* argv[])
     printf("Total memory require: %f MB (%f GB).\n",totalMemReq,totalMemReq/1024);
     printf("Running bench %d times, using average (discarding first run).\n", NTIMES);
  
+#ifdef STREAM_POOL
+    // Alloc memory on device from the pool and fill with the same data
+    #pragma offload target(mic:0) nocopy(x) nocopy(y) nocopy(z)
+    {
+        x = allocStream<StreamAllocator>(SIZE);
+        y = allocStream<StreamAllocator>(SIZE);
+        z = allocStream<StreamAllocator>(SIZE);
+        #pragma omp parallel for
+        for(unsigned i = 0; i < SIZE; i++)
+        {
+            x[i] = 1.0;
+            y[i] = 2.0;
+            z[i] = 0.0;
+        }
+        StreamAllocator::printStats();
+    }
+    reportTime("Device pool alloc & data generation");
+#else
     // Alloc memory on host and fill with some data
-    STREAM_TYPE* x = (STREAM_TYPE*)_mm_malloc(SIZE*sizeof(STREAM_TYPE), 64);
-    STREAM_TYPE* y = (STREAM_TYPE*)_mm_malloc(SIZE*sizeof(STREAM_TYPE), 64);
-    STREAM_TYPE* z = (STREAM_TYPE*)_mm_malloc(SIZE*sizeof(STREAM_TYPE), 64);
+    STREAM_TYPE* x = allocStream<AlignedAllocator>(SIZE);
+    STREAM_TYPE* y = allocStream<AlignedAllocator>(SIZE);
+    STREAM_TYPE* z = allocStream<AlignedAllocator>(SIZE);
     for(unsigned i = 0; i < SIZE; i++)
     {
         x[i] = 1.0;
@@ -100,12 +164,14 @@ int main(int argc, char* argv[])
                                             in(z : length(SIZE) REUSE) 
     
     reportTime("Data transfer");
+#endif
     fflush(0);
 
     // Offload stream bench
     #pragma offload target(mic:0) nocopy(x) \
                                   nocopy(y) \
-                                  nocopy(z)
+                                  nocopy(z) \
+                                  out(recordBytes)
     {
         // Init omp and check threads/procs
         #pragma omp parallel
@@ -127,92 +193,264 @@ int main(int argc, char* argv[])
 
         STREAM_TYPE scalar = 3.0;
 
-        // Run bench (if(i) is used to skip first runthrough)
-        for(int i = 0; i < NTIMES; i++)
+        // Bytes in one array, for the GB/s the kernels are annotated with
+        double arrayBytes = (double)SIZE*sizeof(STREAM_TYPE);
+
+        // Each repeat of a key counts one pass of events, so repeat the bench
+        // until every pass has been recorded NTIMES-1 times
+        int nRuns = NTIMES;
+        #ifdef __MIC__
+            #ifdef USE_PAPI_WRAP
+                nRuns = 1 + (NTIMES-1)*pw.numPasses();
+            #endif
+        #endif
+
+        // PAPI is only read for snapshots at region starts and stops, so for
+        // a timeline inside each kernel the kernel runs as STREAM_CHUNKS omp
+        // for loops without their barriers, each recorded as a nested region
+        int nChunks = 1;
+        #ifdef __MIC__
+            #ifdef USE_PAPI_WRAP
+                if(pw.snapshotsNeedRegions())
+                {
+                    nChunks = STREAM_CHUNKS;
+                    // In-region records cannot grow the arena
+                    pw.reserveRecords(nRuns*(1 + 4*(1 + nChunks)));
+                }
+            #endif
+        #endif
+
+        // Run bench (if(i) is used to skip first runthrough). Each kernel is
+        // recorded from inside its own parallel region so the wrapper adds
+        // no extra fork/join
+        for(int i = 0; i < nRuns; i++)
         {
+            // Whole iteration, the four kernels are recorded as its children
             #ifdef __MIC__
                 #ifdef USE_PAPI_WRAP
-                    if(i) pw.startRecording(STR_COPY);
+                    if(i) pw.startRecording(STR_ITER);
                 #endif
             #endif
 
-            // Stream copy 
-            #pragma omp parallel for
-            #pragma ivdep
-            for (int j = 0; j < SIZE; j++)
+            // Stream copy
+            #pragma omp parallel
             {
-                __assume_aligned(x, 64);
-                __assume_aligned(z, 64);
-                z[j] = x[j];
-            }  
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStartRecording(STR_COPY);
+                        // Reads x, writes z
+                        #pragma omp master
+                        if(i) pw.setWork(arrayBytes, arrayBytes, 0);
+                    #endif
+                #endif
 
-            #ifdef __MIC__
-                #ifdef USE_PAPI_WRAP
-                    if(i) pw.stopRecording();
-                    if(i) pw.startRecording(STR_SCALE);
-                #endif                   
-            #endif
+                for(int c = 0; c < nChunks; c++)
+                {
+                    int begin = chunkBegin(c, nChunks), end = chunkBegin(c+1, nChunks);
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStartRecording(STR_CHUNK);
+                        #endif
+                    #endif
+
+                    #pragma omp for nowait
+                    #pragma ivdep
+                    for (int j = begin; j < end; j++)
+                    {
+                        __assume_aligned(x, 64);
+                        __assume_aligned(z, 64);
+                        z[j] = x[j];
+                    }
+
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStopRecording();
+                        #endif
+                    #endif
+                }
+                #pragma omp barrier
+
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStopRecording();
+                    #endif
+                #endif
+            }
 
             // Stream Scale
-            #pragma omp parallel for 
-            #pragma ivdep
-            for (int j = 0; j < SIZE; j++)
+            #pragma omp parallel
             {
-                __assume_aligned(y, 64);
-                __assume_aligned(z, 64);
-                y[j] = scalar*z[j];
-            }   
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStartRecording(STR_SCALE);
+                        // Reads z, writes y, one multiply per element
+                        #pragma omp master
+                        if(i) pw.setWork(arrayBytes, arrayBytes, SIZE);
+                    #endif
+                #endif
 
-            #ifdef __MIC__
-                #ifdef USE_PAPI_WRAP
-                    if(i) pw.stopRecording();
-                    if(i) pw.startRecording(STR_ADD);    
-                #endif               
-            #endif
+                for(int c = 0; c < nChunks; c++)
+                {
+                    int begin = chunkBegin(c, nChunks), end = chunkBegin(c+1, nChunks);
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStartRecording(STR_CHUNK);
+                        #endif
+                    #endif
+
+                    #pragma omp for nowait
+                    #pragma ivdep
+                    for (int j = begin; j < end; j++)
+                    {
+                        __assume_aligned(y, 64);
+                        __assume_aligned(z, 64);
+                        y[j] = scalar*z[j];
+                    }
+
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStopRecording();
+                        #endif
+                    #endif
+                }
+                #pragma omp barrier
+
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStopRecording();
+                    #endif
+                #endif
+            }
 
             // Stream add
-            #pragma omp parallel for
-            #pragma ivdep
-            for (int j = 0; j < SIZE; j++)
+            #pragma omp parallel
             {
-                __assume_aligned(x, 64);
-                __assume_aligned(y, 64);
-                __assume_aligned(z, 64);    
-                z[j] = x[j]+y[j];
-            }
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStartRecording(STR_ADD);
+                        // Reads x and y, writes z, one add per element
+                        #pragma omp master
+                        if(i) pw.setWork(2*arrayBytes, arrayBytes, SIZE);
+                    #endif
+                #endif
 
-            #ifdef __MIC__
-                #ifdef USE_PAPI_WRAP
-                    if(i) pw.stopRecording();
-                    if(i) pw.startRecording(STR_TRIAD);    
-                #endif               
-            #endif
+                for(int c = 0; c < nChunks; c++)
+                {
+                    int begin = chunkBegin(c, nChunks), end = chunkBegin(c+1, nChunks);
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStartRecording(STR_CHUNK);
+                        #endif
+                    #endif
+
+                    #pragma omp for nowait
+                    #pragma ivdep
+                    for (int j = begin; j < end; j++)
+                    {
+                        __assume_aligned(x, 64);
+                        __assume_aligned(y, 64);
+                        __assume_aligned(z, 64);
+                        z[j] = x[j]+y[j];
+                    }
+
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStopRecording();
+                        #endif
+                    #endif
+                }
+                #pragma omp barrier
 
-            // Stream triad      
-            #pragma omp parallel for
-            #pragma ivdep
-            for (int j = 0; j < SIZE; j++)
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStopRecording();
+                    #endif
+                #endif
+            }
+
+            // Stream triad
+            #pragma omp parallel
             {
-                __assume_aligned(x, 64);
-                __assume_aligned(y, 64);
-                __assume_aligned(z, 64);   
-                x[j] = y[j]+scalar*z[j];
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStartRecording(STR_TRIAD);
+                        // Reads y and z, writes x, a multiply and an add per element
+                        #pragma omp master
+                        if(i) pw.setWork(2*arrayBytes, arrayBytes, 2.0*SIZE);
+                    #endif
+                #endif
+
+                for(int c = 0; c < nChunks; c++)
+                {
+                    int begin = chunkBegin(c, nChunks), end = chunkBegin(c+1, nChunks);
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStartRecording(STR_CHUNK);
+                        #endif
+                    #endif
+
+                    #pragma omp for nowait
+                    #pragma ivdep
+                    for (int j = begin; j < end; j++)
+                    {
+                        __assume_aligned(x, 64);
+                        __assume_aligned(y, 64);
+                        __assume_aligned(z, 64);
+                        x[j] = y[j]+scalar*z[j];
+                    }
+
+                    #ifdef __MIC__
+                        #ifdef USE_PAPI_WRAP
+                            if(i && nChunks > 1) pw.threadStopRecording();
+                        #endif
+                    #endif
+                }
+                #pragma omp barrier
+
+                #ifdef __MIC__
+                    #ifdef USE_PAPI_WRAP
+                        if(i) pw.threadStopRecording();
+                    #endif
+                #endif
             }
 
             #ifdef __MIC__
                 #ifdef USE_PAPI_WRAP
                     if(i) pw.stopRecording();
                 #endif
-            #endif   
+            #endif
         }
 
         #ifdef __MIC__
             #ifdef USE_PAPI_WRAP
-                #ifdef MULTIRUN
+                #ifdef HOST_REPORT
+                    // Pack the records for the host to decode
+                    recordBytes = pw.packedSize();
+                    devRecords = (char*)_mm_malloc(recordBytes, 64);
+                    if(devRecords == NULL)
+                    {
+                        // No buffer, the host then has nothing to report
+                        printf("Could not allocate %llu bytes for the record buffer\n", recordBytes);
+                        recordBytes = 0;
+                    }
+                    else
+                        pw.packRecords(devRecords);
+                #elif defined(MULTIRUN)
                     pw.multiRunPrintAverageRecords();
+                    pw.printImbalance();
+                    pw.printTopology();
                 #else
                     pw.printAllRecords();
                 #endif
+                // Samples stay on the device, PAPI_SAMPLE_FILE names a file
+                // for pw_symbolize.sh
+                if(pw.samplingEnabled())
+                {
+                    pw.printSamples();
+                    pw.writeSamples();
+                }
+                if(pw.snapshotsEnabled())
+                    pw.printTimeline();
             #endif
         #endif
 
@@ -220,6 +458,35 @@ int main(int argc, char* argv[])
         fflush(0);
     }
 
+    #ifdef USE_PAPI_WRAP
+        #ifdef HOST_REPORT
+            // One out() transfer brings every record back
+            if(recordBytes)
+            {
+                char* hostRecords = (char*)_mm_malloc(recordBytes, 64);
+                if(hostRecords == NULL)
+                {
+                    printf("Could not allocate %llu bytes for the record buffer\n", recordBytes);
+                    exit(1);
+                }
+                #pragma offload target(mic:0) out(hostRecords : length(recordBytes))
+                {
+                    memcpy(hostRecords, devRecords, recordBytes);
+                    _mm_free(devRecords);
+                }
+                reportTime("Record transfer");
+
+                if(pwBufferCheck(hostRecords, recordBytes))
+                {
+                    pwBufferPrintAverages(hostRecords, PW_MAD_THRESHOLD);
+                    pwBufferPrintImbalance(hostRecords);
+                    pwBufferPrintTopology(hostRecords);
+                }
+                _mm_free(hostRecords);
+            }
+        #endif
+    #endif
+
     double t = getTime() - timer.front();
     printf("Overall time: %f\n", t);
     return 0;
@@ -1,4 +1,98 @@
 #include "papi_wrapper.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <limits.h>
+
+// Older glibc only has the kernel's name for it
+#ifndef sigev_notify_thread_id
+    #define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static size_t padToLine(size_t n, size_t elemSize)
+{
+    // Round n elements up to a whole number of cache lines
+    size_t perLine = PW_CACHE_LINE/elemSize;
+    return (n + perLine - 1)/perLine*perLine;
+}
+
+static void setOption(char*& option, const char* value)
+{
+    // Option strings are strdup'd like the event names, NULL when unset
+    free(option);
+    option = value && value[0] ? strdup(value) : NULL;
+}
+
+static unsigned long long stepSignature(unsigned long long sig, unsigned key, unsigned depth, int team)
+{
+    // FNV-1a style mix of one more record into a thread's sequence of
+    // records, each of which is a key opened at a depth by a team size
+    sig = (sig ^ key)*0x100000001b3ULL;
+    return (sig ^ ((unsigned long long)depth << 32 | (unsigned)team))*0x100000001b3ULL;
+}
+
+static unsigned initialRecords()
+{
+    // Records to preallocate, PAPI_RECORDS can be set for long runs
+    char* nRecords = getenv("PAPI_RECORDS");
+    if(nRecords != NULL && atoi(nRecords) > 0)
+        return atoi(nRecords);
+    return 1024;
+}
+
+// Trace files are sized for the record arena, and grow by at least this
+// much if they ever fill
+#define PW_TRACE_CHUNK (4ull << 20)
+
+static unsigned streamBufferBytes()
+{
+    // Size of each of a thread's two streaming buffers, PAPI_STREAM_BUFFER
+    char* bytes = getenv("PAPI_STREAM_BUFFER");
+    if(bytes != NULL && atoi(bytes) > 0)
+        return atoi(bytes);
+    return 64 << 10;
+}
+
+static unsigned sampleRingSize()
+{
+    // Samples each thread's ring holds between regions, PAPI_SAMPLE_BUFFER
+    char* samples = getenv("PAPI_SAMPLE_BUFFER");
+    if(samples != NULL && atoi(samples) > 0)
+        return atoi(samples);
+    return PW_SAMPLE_RING;
+}
+
+static unsigned snapshotBufferSize()
+{
+    // Snapshots each thread keeps, PAPI_SNAPSHOT_BUFFER
+    char* snapshots = getenv("PAPI_SNAPSHOT_BUFFER");
+    if(snapshots != NULL && atoi(snapshots) > 0)
+        return atoi(snapshots);
+    return PW_SNAPSHOT_BUFFER;
+}
+
+// Signal handlers are plain functions, they find the sampling and
+// snapshotting wrappers here and the thread they interrupted from its
+// thread local id
+static PapiWrapper* pwSampler = NULL;
+static PapiWrapper* pwSnapshotter = NULL;
+static __thread int pwThreadId = -1;
+
+static bool writeAll(int fd, const char* data, size_t bytes)
+{
+    while(bytes) {
+        ssize_t n = write(fd, data, bytes);
+        if(n < 0)
+            return false;
+        data += n;
+        bytes -= n;
+    }
+    return true;
+}
 
 void PapiWrapper::init()
 {  
@@ -9,29 +103,54 @@ void PapiWrapper::init()
     
     int papi_error;
     
-    // Init library
-    papi_error = PAPI_library_init(PAPI_VER_CURRENT);
-    if (papi_error != PAPI_VER_CURRENT) {
-        printf("PAPI library init error!\n");
-        papiPrintError(papi_error);
+    // Calibrate the region timer before anything is recorded
+    timer_.init();
+    if(debug_) {
+        printTimerInfo();
+        fflush(0);
+    }
+
+    // Pick the counter backend, PAPI unless PAPI_BACKEND or setBackend()
+    // asks for another
+    if(!backendName_)
+        setOption(backendName_, getenv("PAPI_BACKEND"));
+    backend_ = pwCreateBackend(backendName_);
+    if(backend_ == NULL) {
+        printf("Unknown counter backend: %s\n", backendName_);
         exit(1);
     }
 
-#ifdef _OPENMP
-    // Assume fixed thread affinity, otherwise this approach fails
-    papi_error = PAPI_thread_init((long unsigned int (*)()) omp_get_thread_num);
-    if ( papi_error != PAPI_OK ) {
-        printf("Could not initialize the library with openmp.\n");
+    // Init library
+    papi_error = backend_->init();
+    if (papi_error != PW_OK) {
+        printf("%s library init error!\n", backend_->name());
         papiPrintError(papi_error);
         exit(1);
     }
+
+#ifdef _OPENMP
     numThreads_ = omp_get_max_threads();
 #endif
+    threads_.resize(numThreads_);
+    for(unsigned i = 0; i < threads_.size(); i++){
+        threads_[i].stack.resize(PW_MAX_DEPTH);
+        threads_[i].stackKeys.resize(PW_MAX_DEPTH);
+        threads_[i].startTimes.resize(PW_MAX_DEPTH);
+        threads_[i].work.resize(PW_MAX_DEPTH);
+        threads_[i].work.fill(PwWork());
+        threads_[i].serials.resize(PW_MAX_DEPTH);
+    }
+
+    // Aggregation can also be switched on with setAggregate() before init()
+    if(getenv("PAPI_AGGREGATE") != NULL)
+        aggregate_ = true;
+    if(getenv("PAPI_STREAM") != NULL)
+        streaming_ = true;
 
     // Determine the number of hardware counters
-    int num_hwcntrs, i;
-    papi_error = num_hwcntrs = PAPI_num_counters();
-    if (papi_error <= PAPI_OK) {
+    int num_hwcntrs;
+    papi_error = num_hwcntrs = backend_->numCounters();
+    if (papi_error <= PW_OK) {
         printf("Unable to determine number of hardware counters\n");
         papiPrintError(papi_error);
         exit(1);
@@ -43,6 +162,7 @@ void PapiWrapper::init()
     if(papi_counters == NULL) {
         printf("PAPI_EVENTS environment variable not set, PAPI not initialised, running in time only mode\n");
         timeOnly_ = true;
+        setupRecording();
         fflush(0);
         return;        
     }
@@ -62,20 +182,25 @@ void PapiWrapper::init()
         printf("No PAPI events set, PAPI not initialised, running in time only mode\n");
         fflush(0);
         timeOnly_ = true;
+        setupRecording();
         return;
     }
 
     eventNames_.resize(numEvents_);
     eventIds_.resize(numEvents_);
+    // Tokenise a fresh copy, the environment string must stay intact for
+    // later wrappers, and the event names point into this one
+    free(temp);
+    temp = strdup(papi_counters);
     result = NULL;
-    result = strtok( papi_counters, delim );
+    result = strtok( temp, delim );
     int ctr = 0;
     
     while( result != NULL ) {
         int eventID;
-        papi_error = PAPI_event_name_to_code(result, &eventID);
+        papi_error = backend_->eventCode(result, &eventID);
 
-        if(papi_error==PAPI_OK) {
+        if(papi_error==PW_OK) {
 
            eventNames_[ctr] = result;
            eventIds_[ctr] = eventID;
@@ -92,380 +217,2177 @@ void PapiWrapper::init()
 
     if(debug_) {
         printf("Hardware Counters: %d\nThreads: %d\nEvents: %d\n", num_hwcntrs, numThreads_, numEvents_);
-        for(unsigned i = 0; i < numEvents_; i++)
+        for(int i = 0; i < numEvents_; i++)
             printf("Event %d out of %d: %s\n",i,numEvents_,eventNames_[i]);
         fflush(0);
     }
 
-    if(numEvents_ > num_hwcntrs)
+    // More events than counters are split into passes, one pass is counted
+    // per repeat of each key
+    buildPasses(num_hwcntrs);
+    setupSampling();
+
+    if(debug_ && numPasses_ > 1) {
+        printf("%d events requested with %d hardware counters available, using %d passes\n", numEvents_, num_hwcntrs, numPasses_);
+        for(int i = 0; i < numPasses_; i++) {
+            printf("Pass %d:", i);
+            for(unsigned j = 0; j < passEvents_[i].size(); j++)
+                printf(" %s", eventNames_[passEvents_[i][j]]);
+            printf("\n");
+        }
+        fflush(0);
+    }
+
+    // Event sets belong to the thread that creates them, so each thread
+    // builds its own once here and regions only read the running counters
+    #pragma omp parallel
     {
-        printf("%d events requested but only %d hardware counters available.\nExiting.", numEvents_, num_hwcntrs);
-        exit(1);
-    } 
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        createThreadEventSets(tid);
+    }
 
-    // Create PAPI event set
-    eventSet_ = PAPI_NULL;
-    papi_error = PAPI_create_eventset(&eventSet_);
+	setup_ = true;
 
-    if(papi_error != PAPI_OK) {
-        printf("Could not create event set\n");
-        papiPrintError(papi_error);
-        exit(-1);
-    }
+    setupRecording();
+}
 
-    // Allocate memory for counters, nthread elements each containing nevent elements
-    counters_.resize(numThreads_);
-    for(unsigned i = 0; i < counters_.size(); i++)
-        counters_[i].resize(numEvents_);
+void PapiWrapper::buildPasses(int num_hwcntrs)
+{
+    // Pack the events into as few passes as the backend allows (see
+    // pass_schedule.h). Some events are tied to one particular counter, so
+    // a pass may hold fewer than num_hwcntrs events. Probing takes a while
+    // with many events, so schedules are cached per machine
+    if(!scheduleCache_) {
+        if(getenv("PAPI_SCHEDULE_CACHE") != NULL)
+            setOption(scheduleCache_, getenv("PAPI_SCHEDULE_CACHE"));
+        else if(getenv("HOME") != NULL) {
+            const char* file = "/.papi_wrapper_passes";
+            scheduleCache_ = (char*)malloc(strlen(getenv("HOME")) + strlen(file) + 1);
+            strcpy(scheduleCache_, getenv("HOME"));
+            strcat(scheduleCache_, file);
+        }
+    }
+    bool useCache = scheduleCache_ && strcmp(scheduleCache_, "off");
+
+    std::string events = eventNames_[0];
+    for(int i = 1; i < numEvents_; i++)
+        events += std::string("|") + eventNames_[i];
+    char signature[PW_SIGNATURE_LEN];
+    pwScheduleSignature(backend_->name(), num_hwcntrs, signature, sizeof(signature));
+
+    numPasses_ = -1;
+    scheduleCached_ = false;
+    if(useCache) {
+        numPasses_ = pwLoadSchedule(scheduleCache_, signature, events.c_str(), numEvents_, eventPass_);
+        scheduleCached_ = numPasses_ > 0;
+        if(debug_ && scheduleCached_) {
+            printf("Pass schedule read from %s\n", scheduleCache_);
+            fflush(0);
+        }
+    }
 
+    if(!scheduleCached_) {
+        PassScheduler scheduler(backend_, eventIds_.ptr(), numEvents_, num_hwcntrs);
+        int failed;
+        numPasses_ = scheduler.schedule(eventPass_, failed);
+        if(numPasses_ < 0) {
+            printf("Event %s cannot be counted on this hardware\n", eventNames_[failed]);
+            papiPrintError(scheduler.error());
+            exit(1);
+        }
+        if(debug_) {
+            printf("Pass schedule: %d passes, at least %u needed, %u event sets probed\n",
+                numPasses_, scheduler.lowerBound(), scheduler.probes());
+            fflush(0);
+        }
+        if(useCache && !pwSaveSchedule(scheduleCache_, signature, events.c_str(), eventPass_) && debug_) {
+            printf("Could not save the pass schedule to %s\n", scheduleCache_);
+            fflush(0);
+        }
+    }
 
-	setup_ = true;
+    passEvents_.resize(numPasses_);
+    passIds_.resize(numPasses_);
+    for(int i = 0; i < numEvents_; i++) {
+        passEvents_[eventPass_[i]].push_back(i);
+        passIds_[eventPass_[i]].push_back(eventIds_[i]);
+    }
 }
 
-void PapiWrapper::setDebug(bool onoff)
+void PapiWrapper::setupRecording()
 {
-    debug_ = onoff;
+    // Last step of init(), the trace needs the event passes to be known.
+    // Time only mode has a single pass with no events in it
+    if(!passEvents_.size()){
+        passEvents_.resize(1);
+        passIds_.resize(1);
+    }
+    // Time only mode has no event sets to sample, this only checks PAPI_SAMPLE
+    if(timeOnly_)
+        setupSampling();
+    if(aggregate_)
+        streaming_ = false;
+    if(streaming_)
+        openStream();
+    else{
+        if(!aggregate_)
+            openTrace();
+        reserveRecords(initialRecords());
+    }
+
+    if(getenv("PAPI_SUBTRACT_OVERHEAD") != NULL)
+        subtractOverhead_ = true;
+    char* outliers = getenv("PAPI_OUTLIER_MAD");
+    if(outliers != NULL)
+        outlierThreshold_ = atof(outliers) > 0 ? atof(outliers) : PW_MAD_THRESHOLD;
+    calibrateOverhead();
+    compileMetrics();
+    recordThreadCpus();
+    setupSnapshots();
 }
 
-void PapiWrapper::setVerboseDebug(bool onoff)
+void PapiWrapper::recordThreadCpus()
 {
-    verbose_debug_ = onoff;
+    // Assumes threads stay where they are, printTopology() checks again
+    #pragma omp parallel num_threads(numThreads_)
+    {
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        pwCpuTopology(sched_getcpu(), threads_[tid].cpu);
+    }
+    if(verbose_debug_){
+        for(int t = 0; t < numThreads_; t++)
+            printf("Thread %u: cpu %d core %d L2 %d node %d\n", t, threads_[t].cpu.cpu, threads_[t].cpu.core, threads_[t].cpu.cache, threads_[t].cpu.node);
+        fflush(0);
+    }
 }
 
-void PapiWrapper::startRecording(unsigned key)
+void PapiWrapper::compileMetrics()
 {
-    bool unique = true;
-    for(int i = 0; i < uniqueKeys_.size(); i++){
-        if(key == uniqueKeys_[i])
-            unique = false;
-    }
-    if(unique)
-        uniqueKeys_.push_back(key);
-  
-    Record newRecord __attribute__((aligned(64)));
-    newRecord.Init(key, numThreads_, numEvents_);
-    records_.push_back(newRecord);
-    sTime_.resize(numThreads_);
-    currentRecord_++;
+    // Metrics are compiled once against the event list, a bad expression
+    // stops the run rather than printing nonsense at the end
+    if(!metricsSpec_)
+        setOption(metricsSpec_, getenv("PAPI_METRICS"));
+    metrics_.resize(0);
+    if(!metricsSpec_)
+        return;
 
-#ifdef _OPENMP
-        #pragma omp parallel
-        {
-            int tid = omp_get_thread_num();
-            //records_[currentRecord_].time()[tid] = -(omp_get_wtime());
-            sTime_[tid]= -(omp_get_wtime());
+    char* temp = strdup(metricsSpec_);
+    for(char* spec = strtok(temp, "|"); spec != NULL; spec = strtok(NULL, "|")) {
+        DerivedMetric metric;
+        if(!metric.compile(spec, eventNames_.ptr(), numEvents_)) {
+            printf("Could not compile PAPI_METRICS entry %s\n", spec);
+            fflush(0);
+            exit(1);
         }
-#else
-        struct timeval t;
-        gettimeofday(&t, NULL);
-        //records_[currentRecord_].time()[0] =  -(t.tv_sec + 1e-6*t.tv_usec);
-        sTime_[0] =  -(t.tv_sec + 1e-6*t.tv_usec);
-#endif
+        metrics_.push_back(metric);
+        if(debug_)
+            printf("Metric %s = %s\n", metric.name(), metric.expr());
+    }
+    free(temp);
+    fflush(0);
+}
 
-    if(!timeOnly_)
-        startCounters();
-    else
-        counting_ = true;
+void PapiWrapper::metricValues(const long long* counts, int pass, double time, double* values)
+{
+    // Events outside the pass were not counted, metrics using them are NAN
+    for(int j = 0; j < numEvents_; j++)
+        values[j] = (pass < 0 || eventPass_[j] == pass) ? (double)counts[j] : NAN;
+    values[numEvents_] = time;
 }
 
-void PapiWrapper::stopRecording()
+void PapiWrapper::setMetrics(const char* spec)
 {
-    if(!counting_) {
-        printf("Cannot stop counter/timer when not counting/timing...\n");
+    if(setup_) {
+        printf("Cannot set derived metrics after init\n");
         fflush(0);
         exit(1);
     }
+    setOption(metricsSpec_, spec);
+}
 
-    if(!timeOnly_)
-        stopCounters();
+void PapiWrapper::setScheduleCache(const char* path)
+{
+    if(setup_) {
+        printf("Cannot set the schedule cache after init\n");
+        fflush(0);
+        exit(1);
+    }
+    setOption(scheduleCache_, path);
+}
 
-#ifdef _OPENMP
-        #pragma omp parallel
-        {
-            int tid = omp_get_thread_num();
-            //records_[currentRecord_].time()[tid] += omp_get_wtime();
-            sTime_[tid] += omp_get_wtime();
+void PapiWrapper::setupSampling()
+{
+    // Before the event sets are made, sampled events join them with their
+    // threshold and the rest are only counted
+    if(!sampleSpec_)
+        setOption(sampleSpec_, getenv("PAPI_SAMPLE"));
+    sampleThresholds_.resize(numEvents_);
+    sampleThresholds_.fill(0);
+    if(!sampleSpec_)
+        return;
+    if(timeOnly_) {
+        printf("PAPI_SAMPLE needs its events in PAPI_EVENTS\n");
+        fflush(0);
+        exit(1);
+    }
+    if(pwSampler != NULL && pwSampler != this) {
+        printf("Only one PapiWrapper can sample at a time\n");
+        fflush(0);
+        exit(1);
+    }
+
+    char* temp = strdup(sampleSpec_);
+    for(char* spec = strtok(temp, "|"); spec != NULL; spec = strtok(NULL, "|")) {
+        char* at = strrchr(spec, '@');
+        long long threshold = at ? atoll(at+1) : 0;
+        int e = 0;
+        if(at != NULL) {
+            *at = 0;
+            while(e < numEvents_ && strcmp(eventNames_[e], spec))
+                e++;
         }
-#else
-        struct timeval t;
-        gettimeofday(&t, NULL);
-       // records_[currentRecord_].time()[0] =  (t.tv_sec + 1e-6*t.tv_usec);
-        sTime_[0] =  (t.tv_sec + 1e-6*t.tv_usec);
-#endif
+        if(at == NULL || threshold <= 0 || e == numEvents_) {
+            printf("Could not use PAPI_SAMPLE entry %s, expected EVENT@threshold with EVENT in PAPI_EVENTS\n", spec);
+            fflush(0);
+            exit(1);
+        }
+        sampleThresholds_[e] = threshold;
+        if(debug_)
+            printf("Sampling %s every %lld counts\n", eventNames_[e], threshold);
+    }
+    free(temp);
+    fflush(0);
 
-    for(unsigned i = 0; i < numThreads_; i++){
-        if(!timeOnly_){
-            for(unsigned j = 0; j < numEvents_; j++)
-               records_[currentRecord_][i][j] = counters_[i][j];  
-        } 
-        records_[currentRecord_].time()[i] = sTime_[i];
+    unsigned ring = sampleRingSize();
+    for(unsigned t = 0; t < threads_.size(); t++)
+        threads_[t].sampleRing.init(ring);
+    sampling_ = true;
+    pwSampler = this;
+}
+
+void PapiWrapper::setSampling(const char* spec)
+{
+    if(setup_) {
+        printf("Cannot set sampling after init\n");
+        fflush(0);
+        exit(1);
     }
+    setOption(sampleSpec_, spec);
 }
 
+void PapiWrapper::sampleOverflow(int set, void* address, int index)
+{
+    // Runs in the signal handler of the thread whose counter overflowed, so
+    // it takes no locks, allocates nothing and never exits
+    PapiWrapper* pw = pwSampler;
+    int tid = pwThreadId;
+    if(pw == NULL || tid < 0 || tid >= pw->numThreads_)
+        return;
+    ThreadState& ts = pw->threads_.ptr()[tid];
+    int pass = 0;
+    while(pass < pw->numPasses_ && ts.eventSets.ptr()[pass] != set)
+        pass++;
+    if(pass == pw->numPasses_)
+        return;
 
+    PwSample s;
+    s.address = (unsigned long long)address;
+    s.event = pw->passEvents_.ptr()[pass].ptr()[index];
+    int depth = ts.depth;
+    s.key = depth > 0 ? ts.stackKeys.ptr()[depth-1] : PW_SAMPLE_OUTSIDE;
+    ts.sampleRing.push(s);
+}
 
-void PapiWrapper::printRecord(unsigned key)
+void PapiWrapper::setupSnapshots()
 {
-    if(records_.size() == 0){
-        printf("Cannot print record when no recordings have been made");
+    // A timer per thread that signals only that thread, so counters are
+    // read by the thread that owns them
+    char* interval = getenv("PAPI_SNAPSHOT");
+    if(snapshotInterval_ <= 0 && interval != NULL)
+        snapshotInterval_ = atof(interval)/1000;
+    if(snapshotInterval_ <= 0)
+        return;
+    if(timeOnly_) {
+        printf("PAPI_SNAPSHOT needs events in PAPI_EVENTS\n");
+        fflush(0);
+        exit(1);
+    }
+    if(pwSnapshotter != NULL && pwSnapshotter != this) {
+        printf("Only one PapiWrapper can take snapshots at a time\n");
         fflush(0);
         exit(1);
     }
 
-    bool found = false;
-    for(unsigned i = 0; i < records_.size(); i++) {
-        if(records_[i].rID() == key){
-            printf("------------------------\nFor KEY ID %d\n------------------------\n", key);
-            for(unsigned j = 0; j < numEvents_; j++) {
-                // Print event name
-                // unsigned strSize = eventNames_[i].length();
-                // std::string format;
-                // for(unsigned k = 0; k < strSize+4; k++)
-                //     format += "-";
-                printf("Event: %s: \n",eventNames_[j]);
-
-                // Print thread IDs
-                for(unsigned k = 0; k < numThreads_; k++)
-                    printf("Thread ID: %10d | ",k);
-                printf("\n");
-
-                // Print counts   
-                for(unsigned k = 0; k < numThreads_; k++)
-                    printf("Count: %14lld | ", records_[i][k][j]);
-                printf("\n");
-
-                // For multiple openmp threads print cumulative total
-                if(numThreads_>1){
-                    long long total = 0;
-                    for(unsigned k = 0; k < numThreads_; k++)
-                        total += records_[i][k][j];
-                    printf("Accumulative total from %d threads: %lld\n", numThreads_, total);
-                }
-            }
-        // Print time
-        for(unsigned k = 0; k < numThreads_; k++)           
-            printf("------------------------");
-        printf("\n");
-        for(unsigned k = 0; k < numThreads_; k++)
-            printf("Time: %15f | ", records_[i].time()[k]);
-        printf("\n");    
+    unsigned capacity = snapshotBufferSize();
+    for(unsigned t = 0; t < threads_.size(); t++){
+        ThreadState& ts = threads_[t];
+        ts.snapshots.resize(capacity);
+        ts.snapshotCounts.resize(capacity*numEvents_);
+        ts.snapshotRead.resize(numEvents_);
+        ts.nSnapshots = 0;
+    }
 
-        // For multiple openmp threads print average time
-        if(numThreads_>1){
-            double total = 0;
-            for(unsigned k = 0; k < numThreads_; k++)
-                total += records_[i].time()[k];
-            printf("Average time from %d threads: %f\n", numThreads_, total/(double)numThreads_);
-        }   
-        
-        found = true;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = snapshotSignal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(PW_SNAPSHOT_SIGNAL, &sa, NULL) != 0) {
+        printf("Could not install the snapshot signal handler\n");
+        fflush(0);
+        exit(1);
+    }
+    pwSnapshotter = this;
+    snapshots_ = true;
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = (time_t)snapshotInterval_;
+    its.it_interval.tv_nsec = (long)((snapshotInterval_ - its.it_interval.tv_sec)*1e9);
+    its.it_value = its.it_interval;
+    int failed = 0;
+    #pragma omp parallel num_threads(numThreads_)
+    {
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        ThreadState& ts = threads_[tid];
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = PW_SNAPSHOT_SIGNAL;
+        sev.sigev_notify_thread_id = syscall(SYS_gettid);
+        if(timer_create(CLOCK_MONOTONIC, &sev, &ts.snapshotTimer) == 0) {
+            ts.hasSnapshotTimer = true;
+            if(timer_settime(ts.snapshotTimer, 0, &its, NULL) != 0)
+                __sync_fetch_and_add(&failed, 1);
         }
+        else
+            __sync_fetch_and_add(&failed, 1);
     }
-
-    if(!found){
-        printf("Record with key: %u not found in records list.\n", key);
+    if(failed) {
+        printf("Could not start the snapshot timer on %d threads\n", failed);
+        fflush(0);
+        exit(1);
+    }
+    if(debug_) {
+        printf("Snapshots every %.3f ms, %u per thread\n", 1000*snapshotInterval_, capacity);
         fflush(0);
     }
 }
 
-void PapiWrapper::printAllRecords()
+void PapiWrapper::setSnapshots(double interval)
 {
-    if(records_.size() == 0){
-        printf("printAllRecords(): No records made \n");
+    if(setup_) {
+        printf("Cannot set snapshots after init\n");
         fflush(0);
+        exit(1);
     }
+    snapshotInterval_ = interval;
+}
 
-    for(unsigned i = 0; i < records_.size(); i++) {
-        printf("------------------------\nFor KEY ID %d\n------------------------\n", records_[i].rID());
-        for(unsigned j = 0; j < numEvents_; j++) {
-            // Print event name
-            // unsigned strSize = eventNames_[i].length();
-            // std::string format;
-            // for(unsigned k = 0; k < strSize+4; k++)
-            //     format += "-";
-            printf("Event: %s: \n",eventNames_[j]);
-
-            // Print thread IDs
-            for(unsigned k = 0; k < numThreads_; k++)
-                printf("Thread ID: %10d | ",k);
-            printf("\n");
-
-            // Print counts   
-            for(unsigned k = 0; k < numThreads_; k++)
-                printf("Count: %14lld | ", records_[i][k][j]);
-            printf("\n");
-
-            // For multiple openmp threads print cumulative total
-            if(numThreads_>1){
-                long long total = 0;
-                for(unsigned k = 0; k < numThreads_; k++)
-                    total += records_[i][k][j];
-                printf("Accumulative total from %d threads: %lld\n", numThreads_, total);
-            }
-        }
-        // Print time
-        for(unsigned k = 0; k < numThreads_; k++)           
-            printf("------------------------");
-        printf("\n");
-        for(unsigned k = 0; k < numThreads_; k++)
-            printf("Time: %15f | ", records_[i].time()[k]);
-        printf("\n");    
+void PapiWrapper::snapshotSignal(int, siginfo_t*, void*)
+{
+    // The thread's own timer fired. Regions opening or closing are left
+    // alone, their stack and counters are only half updated
+    PapiWrapper* pw = pwSnapshotter;
+    int tid = pwThreadId;
+    if(pw == NULL || tid < 0 || tid >= pw->numThreads_)
+        return;
+    ThreadState& ts = pw->threads_.ptr()[tid];
+    int depth = ts.depth;
+    if(depth <= 0)
+        return;
+    // PAPI_read is not async-signal-safe, the interrupted code may be in
+    // PAPI itself. Those backends are read at the next region start or stop
+    if(!pw->backend_->readsInSignals()) {
+        ts.snapshotDue = 1;
+        return;
+    }
+    if(ts.busy)
+        return;
 
-        // For multiple openmp threads print average time
-        if(numThreads_>1){
-            double total = 0;
-            for(unsigned k = 0; k < numThreads_; k++)
-                total += records_[i].time()[k];
-            printf("Average time from %d threads: %f\n", numThreads_, total/(double)numThreads_);
-        }   
+    int savedErrno = errno;
+    double now = pw->timer_.now();
+    long long* values = ts.snapshotRead.ptr();
+    if(pw->backend_->peek(ts.eventSets.ptr()[ts.pass], values) == PW_OK) {
+        long long* start = ts.startCounts.ptr() + (depth-1)*pw->numEvents_;
+        unsigned n = pw->passIds_.ptr()[ts.pass].size();
+        for(unsigned j = 0; j < n; j++)
+            values[j] -= start[j];
+        pw->takeSnapshot(ts, depth-1, now - ts.startTimes.ptr()[depth-1], values);
     }
+    errno = savedErrno;
 }
 
-void PapiWrapper::multiRunPrintAverageRecords()
+void PapiWrapper::takeSnapshot(ThreadState& ts, int depth, double time, const long long* passCounts)
 {
-    if(records_.size() == 0){
-        printf("multiRunPrintFastestRecords(): No records made \n");
-        fflush(0);
+    // Also runs in the signal handler, so only preallocated memory is used
+    unsigned n = ts.nSnapshots;
+    if(n >= ts.snapshots.size()) {
+        ts.snapshotsDropped++;
+        return;
     }
-    // Loop through each unique key, work out counts and totals as usual
-    // but then provide averaged count and store in order to easily print
-    // for excel
-    Array_T< double > keyTimes;
-    keyTimes.resize(uniqueKeys_.size());
-    keyTimes.fill(0.0);
-
-    Array_T< Array_T< long long > > keyEvents;
-    keyEvents.resize(uniqueKeys_.size());
+    PwSnapshot& s = ts.snapshots.ptr()[n];
+    s.time = time;
+    s.key = ts.stackKeys.ptr()[depth];
+    s.serial = ts.serials.ptr()[depth];
+    s.pass = ts.pass;
+    s.thread = 0;
+    s.index = n;
+    Array_T<int>& passEvents = passEvents_.ptr()[ts.pass];
+    long long* counts = ts.snapshotCounts.ptr() + (size_t)n*numEvents_;
+    for(unsigned j = 0; j < passEvents.size(); j++)
+        counts[passEvents.ptr()[j]] = passCounts[j];
+    ts.nSnapshots = n+1;
+}
 
-    for(unsigned i = 0; i < uniqueKeys_.size(); i++){
-        keyEvents[i].resize(numEvents_);
-        keyEvents[i].fill(0);
-    }
-    
-    for(unsigned i = 0; i < uniqueKeys_.size(); i++){
+void PapiWrapper::calibrateOverhead()
+{
+    // Every thread records empty regions in each pass, with the same timer
+    // and counter reads as threadStartRecording/threadStopRecording, so the
+    // result is what a region with nothing in it reports
+    char* runsEnv = getenv("PAPI_CALIBRATION_RUNS");
+    int runs = (runsEnv != NULL && atoi(runsEnv) > 0) ? atoi(runsEnv) : 100;
+    overhead_.resize(numThreads_*(numEvents_+1));
+    for(unsigned i = 0; i < overhead_.size(); i++)
+        overhead_[i] = RunningStat();
 
-        // Go through all records and extract times
-        for(unsigned j = 0; j < records_.size(); j++) {
-            // If record matches unique key
-            if(records_[j].rID() == uniqueKeys_[i]){
-                // Get its events
-                for(unsigned k = 0; k < numEvents_; k++){
-                    // Get cumulative total for all threads
-                    for(unsigned l = 0; l < numThreads_; l++)
-                         keyEvents[i][k] += records_[j][l][k];
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        ThreadState& ts = threads_[tid];
+        RunningStat* stats = overhead_.ptr() + tid*(numEvents_+1);
+        for(int p = 0; p < numPasses_; p++) {
+            Array_T<int>& passEvents = passEvents_[p];
+            for(int r = 0; r < runs; r++) {
+                double start = timer_.now();
+                if(!timeOnly_) {
+                    startThreadCounters(tid, p, 0);
+                    stopThreadCounters(tid, p, 0);
                 }
-                for(unsigned k = 0; k < numThreads_; k++)
-                    keyTimes[i] += records_[i].time()[k];
+                double time = timer_.now() - start;
+                if(!timeOnly_) {
+                    for(unsigned j = 0; j < passEvents.size(); j++)
+                        stats[passEvents[j]].add(ts.counters[j]);
+                }
+                stats[numEvents_].add(time);
             }
         }
+        if(!timeOnly_ && numPasses_ > 1)
+            switchThreadPass(tid, 0);
+
+        // Rounded per thread means, ready to subtract when a region stops
+        ts.overheadCounts.resize(numEvents_);
+        for(int j = 0; j < numEvents_; j++)
+            ts.overheadCounts[j] = (long long)(stats[j].mean + 0.5);
+        ts.overheadTime = stats[numEvents_].mean;
+
+        // Samples so far are of the calibration itself
+        if(sampling_)
+            ts.sampleRing.discard();
+    }
 
-        // Average
-        int nRuns = (records_.size()/uniqueKeys_.size());
-        for(unsigned j = 0; j < numEvents_; j++)
-            keyEvents[i][j] /= nRuns;
+    // startRecording/stopRecording also fork a team each, which is outside
+    // the region but still costs the caller
+    double start = timer_.now();
+    for(int r = 0; r < runs; r++) {
+        #pragma omp parallel
+        {
+            __asm__ __volatile__("" ::: "memory");
+        }
+    }
+    forkOverhead_ = 2*(timer_.now() - start)/runs;
 
-        printf("numThreads_ %d nRuns %d\n", numThreads_, nRuns);
-        keyTimes[i] /= (numThreads_ * nRuns);
+    if(debug_) {
+        printOverhead();
+        fflush(0);
     }
+}
 
-    // Print results
-    printf("-----------Events-----------\nTime\n");
-    for(unsigned i = 0; i < numEvents_; i++)
-        printf("%s\n",eventNames_[i]);
-    printf("\n");
+double PapiWrapper::overheadMean(unsigned j)
+{
+    // Per thread mean of the empty region value j (time is numEvents_)
+    RunningStat all;
+    for(int t = 0; t < numThreads_; t++)
+        all.merge(overhead_[t*(numEvents_+1) + j]);
+    return all.mean;
+}
 
-    printf("-----------Counts-----------\n");
-    for(unsigned i = 0; i < uniqueKeys_.size(); i++){
-            printf("%f\t",keyTimes[i]);
-    }
-    printf("\n");
+void PapiWrapper::printOverhead()
+{
+    if(!overhead_.size())
+        return;
+    printf("-----------Overhead-----------\n");
+    printf("Empty region, time per thread and counts summed over %d threads (%s)\n", numThreads_,
+        subtractOverhead_ ? "subtracted from every region" : "not subtracted, set PAPI_SUBTRACT_OVERHEAD to subtract");
+    printf("%.9f\n", overheadMean(numEvents_));
+    for(int j = 0; j < numEvents_; j++)
+        printf("%.0f\n", overheadMean(j)*numThreads_);
+    printf("startRecording/stopRecording fork and join: %.9f s per region\n\n", forkOverhead_);
+}
 
-    for(unsigned i = 0; i < numEvents_; i++){
-        for(unsigned j = 0; j < uniqueKeys_.size(); j++){
-            printf("%lld\t",keyEvents[j][i]);
-        }
-        printf("\n");
-    }
-    printf("\n");
-    fflush(0);
+void PapiWrapper::setOutlierRejection(double threshold)
+{
+    outlierThreshold_ = threshold;
 }
 
-void PapiWrapper::papiPrintError(int err)
+void PapiWrapper::setSubtractOverhead(bool onoff)
 {
-	char* errName = PAPI_strerror(err);
-	printf("PAPI error code: %s (%d)\n", errName, err);
-	fflush(0);
+    subtractOverhead_ = onoff;
 }
 
-void PapiWrapper::startCounters()
+void PapiWrapper::reserveRecords(unsigned nRecords)
 {
-    if(!setup_){
-        printf("Must initialise PAPI before starting counters.\n");
+    // Grow the record arena to hold nRecords, existing records are kept.
+    // Called from init() and when the arena fills, never while counting
+    if(aggregate_ || nRecords <= records_.capacity())
+        return;
+
+    // Each thread gets its own slab of counts and of times, padded to whole
+    // cache lines so threads closing regions never write to a shared line
+    size_t countStride = padToLine((size_t)nRecords*numEvents_, sizeof(long long));
+    size_t timeStride = padToLine(nRecords, sizeof(double));
+
+    // Array_T counts elements in an int, refuse an arena that would wrap it
+    // rather than silently allocate a smaller one
+    size_t countElems = (size_t)numThreads_*countStride;
+    size_t timeElems = (size_t)numThreads_*timeStride;
+    if(nRecords > INT_MAX || countElems > INT_MAX || timeElems > INT_MAX) {
+        printf("Error: record arena of %u records for %d threads and %d events is too large, lower PAPI_RECORDS\n",
+            nRecords, numThreads_, numEvents_);
         fflush(0);
         exit(1);
     }
 
-    if(counting_) {
-        printf("Cannot start counters when already counting.\n");
-        fflush(0);
-        exit(1);
+    Array_T<long long> counts;
+    Array_T<double> times;
+    counts.resize((int)countElems);
+    times.resize((int)timeElems);
+
+    unsigned used = records_.capacity();
+    for(int t = 0; t < numThreads_ && used; t++) {
+        memcpy(counts.ptr() + t*countStride, counts_.ptr() + t*countStride_, (size_t)used*numEvents_*sizeof(long long));
+        memcpy(times.ptr() + t*timeStride, times_.ptr() + t*timeStride_, used*sizeof(double));
     }
 
+    counts_.swap(counts);
+    times_.swap(times);
+    countStride_ = countStride;
+    timeStride_ = timeStride;
+    records_.set_capacity(nRecords);
+
+    closed_.resize(nRecords);
+    teams_.resize(nRecords);
+    steps_.resize(nRecords);
+    work_.resize(nRecords);
+    for(unsigned i = used; i < nRecords; i++){
+        closed_[i] = 0;
+        teams_[i] = 0;
+        steps_[i] = 0;
+        work_[i] = PwWork();
+    }
 
-    #pragma omp parallel
-    {
-        if(numEvents_){
-                #ifdef _OPENMP
-                        int tid = omp_get_thread_num();
-                #else
-                        int tid = 0;
-                #endif
-            int papi_error = PAPI_start_counters(&eventIds_[0], eventIds_.size());
-            if (papi_error != PAPI_OK){
-                printf("Thread %d: Could not start counters\n", tid);
-                if(verbose_debug_){
-                    for(unsigned i = 0; i < eventIds_.size(); i++)
-                        printf("EventID %d out of %d: 0x%X\n",i, eventIds_.size(), eventIds_[i]);
-                    fflush(0);
-                }
-                papiPrintError(papi_error);
-                exit(-1);
-            }
+    // Room in the trace for every record the arena holds, each of which may
+    // bring a new key, so closing regions never has to grow the file
+    if(trace_){
+        unsigned long long recordBytes = 0;
+        for(unsigned p = 0; p < passEvents_.size(); p++){
+            unsigned long long bytes = pwTraceRecordBytes(timeOnly_ ? 0 : passEvents_[p].size(), numThreads_);
+            if(bytes > recordBytes)
+                recordBytes = bytes;
         }
+        recordBytes += sizeof(PwTraceBlock) + sizeof(PwBufferKey);
+        growTrace(((PwTraceHeader*)trace_)->dataOffset + nRecords*recordBytes);
     }
 
-    counting_ = true;
-
+    if(debug_) {
+        printf("Record arena holds %u records (%lu bytes)\n", nRecords,
+            (unsigned long)(nRecords*sizeof(Record) + countElems*sizeof(long long) + timeElems*sizeof(double)));
+        fflush(0);
+    }
 }
 
-void PapiWrapper::stopCounters()
+void PapiWrapper::setAggregate(bool onoff)
 {
-    if(!counting_) {
-        printf("Cannot stop counters when not counting.\n");
+    if(setup_) {
+        printf("Cannot change aggregation mode after init\n");
         fflush(0);
         exit(1);
     }
+    aggregate_ = onoff;
+}
 
-    #pragma omp parallel
-    {
-#ifdef _OPENMP
+void PapiWrapper::setTraceFile(const char* path)
+{
+    if(setup_) {
+        printf("Cannot set the trace file after init\n");
+        fflush(0);
+        exit(1);
+    }
+    setOption(traceName_, path);
+}
+
+void PapiWrapper::setStreaming(bool onoff)
+{
+    if(setup_) {
+        printf("Cannot change streaming mode after init\n");
+        fflush(0);
+        exit(1);
+    }
+    streaming_ = onoff;
+}
+
+void PapiWrapper::setBackend(const char* name)
+{
+    if(setup_) {
+        printf("Cannot change the counter backend after init\n");
+        fflush(0);
+        exit(1);
+    }
+    setOption(backendName_, name);
+}
+
+void PapiWrapper::setDebug(bool onoff)
+{
+    debug_ = onoff;
+}
+
+void PapiWrapper::setVerboseDebug(bool onoff)
+{
+    verbose_debug_ = onoff;
+}
+
+void PapiWrapper::startRecording(unsigned key, const char* name)
+{
+    // Make room before forking, the in-region calls cannot grow the arena
+    if(!aggregate_ && !streaming_ && records_.size() == records_.capacity())
+        reserveRecords(records_.capacity() ? records_.capacity()*2 : initialRecords());
+
+    #pragma omp parallel
+    threadStartRecording(key, name);
+
+    depth_++;
+}
+
+void PapiWrapper::stopRecording()
+{
+    if(!depth_) {
+        printf("Cannot stop counter/timer when not counting/timing...\n");
+        fflush(0);
+        exit(1);
+    }
+
+    #pragma omp parallel
+    threadStopRecording();
+
+    depth_--;
+}
+
+void PapiWrapper::threadStartRecording(unsigned key, const char* name)
+{
+#ifdef _OPENMP
+    int tid = omp_get_thread_num();
+    // Inner teams would share thread numbers, and so thread state, with
+    // the outer team
+    if(omp_get_active_level() > 1) {
+        printf("Thread %d: Regions cannot be recorded from nested parallel regions\n", tid);
+        fflush(0);
+        exit(1);
+    }
+#else
+    int tid = 0;
+#endif
+    if(tid >= numThreads_) {
+        printf("Thread %d: PapiWrapper was initialised for %d threads\n", tid, numThreads_);
+        fflush(0);
+        exit(1);
+    }
+
+    ThreadState& ts = threads_[tid];
+    if(ts.depth >= PW_MAX_DEPTH) {
+        printf("Thread %d: Cannot nest more than %d regions.\n", tid, PW_MAX_DEPTH);
+        fflush(0);
+        exit(1);
+    }
+    // The snapshot handler runs on this thread, so only the compiler can
+    // reorder the region updates past busy
+    ts.busy = 1;
+    __asm__ __volatile__("" ::: "memory");
+
+    int keyIdx = ts.keyIndex.find(key);
+    if(keyIdx < 0){
+        // First time this thread sees the key. Whichever thread gets there
+        // first registers it, and every thread uses the registered index so
+        // per thread tables line up across threads
+        #pragma omp critical(pw_keys)
+        {
+            keyIdx = keyIndex_.find(key);
+            if(keyIdx < 0){
+                keyIdx = uniqueKeys_.size();
+                uniqueKeys_.push_back(key);
+                keyNames_.push_back(name);
+                keyIndex_.insert(key, keyIdx);
+                if(trace_ || streaming_)
+                    appendTraceKey(ts, keyIdx);
+            }
+            for(unsigned i = ts.keys.size(); i <= (unsigned)keyIdx; i++){
+                ts.keys.push_back(uniqueKeys_[i]);
+                ts.keyRuns.push_back(0);
+            }
+        }
+        ts.keyIndex.insert(key, keyIdx);
+        if(aggregate_)
+            addThreadKeyStats(ts);
+    }
+
+    // Rotate through the event passes on each repeat of this key. Counters
+    // cannot change under an open region, so nested regions use its pass
+    if(!ts.depth){
+        ts.pass = ts.keyRuns[keyIdx] % numPasses_;
+        ts.keyRuns[keyIdx]++;
+    }
+
+    ts.stackKeys[ts.depth] = keyIdx;
+    ts.serials[ts.depth] = ts.nRegions++;
+    if(aggregate_){
+        // Nothing is stored per region, the stack only needs the key
+        ts.stack[ts.depth] = keyIdx;
+    }
+    else if(!streaming_ && ts.nRecords >= records_.capacity()){
+        // The arena cannot grow inside a parallel region. Threads in step
+        // all reach the same record here, so the team drops it together
+        ts.recordsDropped++;
+        ts.stack[ts.depth] = -1;
+    }
+    else{
+        // Every thread of the team opens the same sequence of records, so the
+        // thread's own count is the record index
+        unsigned rec = ts.nRecords++;
+        int parent = ts.depth ? ts.stack[ts.depth-1] : -1;
+        ts.stack[ts.depth] = rec;
+
+        // Thread 0 describes the record and the others only write their own
+        // state, so no thread waits for another. Each thread's sequence is
+        // signed so recordsInStep() can check them against thread 0's later
+        if(!streaming_){
+#ifdef _OPENMP
+            int team = omp_get_num_threads();
+#else
+            int team = 1;
+#endif
+            ts.steps = stepSignature(ts.steps, key, ts.depth, team);
+            if(tid == 0){
+                records_.ptr()[rec].Init(key, ts.pass, parent, ts.depth);
+                teams_.ptr()[rec] = team;
+                steps_.ptr()[rec] = ts.steps;
+                records_.size_ref() = rec+1;
+            }
+        }
+    }
+
+    int depth = ts.depth++;
+    ts.startTimes[depth] = timer_.now();
+
+    if(!timeOnly_)
+        startThreadCounters(tid, ts.pass, depth);
+
+    // A snapshot the timer left for here is of the enclosing region, from
+    // the counters just read
+    if(ts.snapshotDue){
+        ts.snapshotDue = 0;
+        if(depth > 0){
+            long long* values = ts.snapshotRead.ptr();
+            long long* start = ts.startCounts.ptr() + depth*numEvents_;
+            long long* outer = start - numEvents_;
+            for(unsigned j = 0; j < passIds_[ts.pass].size(); j++)
+                values[j] = start[j] - outer[j];
+            takeSnapshot(ts, depth-1, ts.startTimes[depth] - ts.startTimes[depth-1], values);
+        }
+    }
+    __asm__ __volatile__("" ::: "memory");
+    ts.busy = 0;
+}
+
+void PapiWrapper::threadStopRecording()
+{
+#ifdef _OPENMP
+    int tid = omp_get_thread_num();
+#else
+    int tid = 0;
+#endif
+    ThreadState& ts = threads_[tid];
+    if(!ts.depth) {
+        printf("Thread %d: Cannot stop counter/timer when not counting/timing...\n", tid);
+        fflush(0);
+        exit(1);
+    }
+
+    ts.busy = 1;
+    __asm__ __volatile__("" ::: "memory");
+    int depth = --ts.depth;
+
+    if(!timeOnly_)
+        stopThreadCounters(tid, ts.pass, depth);
+
+    double time = timer_.now() - ts.startTimes[depth];
+    Array_T<int>& passEvents = passEvents_[ts.pass];
+    long long* counters = ts.counters.ptr();
+
+    // Regions long enough for a timeline end with one more snapshot, as do
+    // regions a snapshot was left for
+    if(snapshots_ && (time >= snapshotInterval_ || ts.snapshotDue)){
+        bool due = ts.snapshotDue;
+        ts.snapshotDue = 0;
+        takeSnapshot(ts, depth, time, counters);
+        // Left by the timer, so the enclosing region only gets snapshots
+        // at its children's starts and stops
+        if(due && depth > 0){
+            long long* values = ts.snapshotRead.ptr();
+            long long* start = ts.startCounts.ptr() + depth*numEvents_;
+            long long* outer = start - numEvents_;
+            for(unsigned j = 0; j < passEvents.size(); j++)
+                values[j] = counters[j] + start[j] - outer[j];
+            takeSnapshot(ts, depth-1, ts.startTimes[depth] + time - ts.startTimes[depth-1], values);
+        }
+    }
+
+    if(subtractOverhead_){
+        // Take off what an empty region reports, never going below zero
+        time = time > ts.overheadTime ? time - ts.overheadTime : 0;
+        if(!timeOnly_){
+            for(unsigned j = 0; j < passEvents.size(); j++){
+                long long overhead = ts.overheadCounts.ptr()[passEvents[j]];
+                counters[j] = counters[j] > overhead ? counters[j] - overhead : 0;
+            }
+        }
+    }
+
+    // Only the thread that called setWork() has work to hand on
+    PwWork& work = ts.work[depth];
+    bool hasWork = pwHasWork(work);
+
+    if(aggregate_){
+        // Fold this region into the thread's running statistics for its key
+        RunningStat* stats = ts.keyStats.ptr() + ts.stack[depth]*(numEvents_+1);
+        if(!timeOnly_){
+            for(unsigned j = 0; j < passEvents.size(); j++)
+                stats[passEvents[j]].add(counters[j]);
+        }
+        stats[numEvents_].add(time);
+        if(hasWork)
+            ts.keyWork[ts.stack[depth]].add(work, time);
+    }
+    else if(streaming_){
+        streamRecord(tid, depth, time);
+    }
+    else if(ts.stack[depth] >= 0){
+        int rec = ts.stack[depth];
+        if(!timeOnly_){
+            long long* counts = recordCounts(rec, tid);
+            for(unsigned j = 0; j < passEvents.size(); j++)
+               counts[passEvents[j]] = counters[j];
+        }
+        recordTime(rec, tid) = time;
+        if(hasWork)
+            work_.ptr()[rec] = work;
+
+        // The last thread of the team to close the record writes it out,
+        // after thread 0 has described it
+#ifdef _OPENMP
+        if(trace_ && __sync_add_and_fetch(&closed_.ptr()[rec], 1) == omp_get_num_threads())
+#else
+        if(trace_ && __sync_add_and_fetch(&closed_.ptr()[rec], 1) == 1)
+#endif
+            appendTraceRecord(rec);
+    }
+    if(hasWork)
+        work = PwWork();
+
+    // Samples leave the ring between outermost regions, where copying them
+    // is not timed
+    if(sampling_ && !depth)
+        ts.sampleRing.drain(ts.samples);
+    __asm__ __volatile__("" ::: "memory");
+    ts.busy = 0;
+}
+
+unsigned PapiWrapper::outOfStepThreads()
+{
+    // Records are matched up by each thread's own count of them, so a
+    // thread that opened regions the others did not (inside omp single,
+    // sections or master, or from teams of different sizes) wrote its counts
+    // into the wrong records. A thread is in step if its signature matches
+    // thread 0's after as many records, threads left out of a smaller team
+    // just have fewer
+    unsigned n = 0;
+    if(aggregate_ || streaming_)
+        return 0;
+    for(int t = 1; t < numThreads_; t++){
+        ThreadState& ts = threads_[t];
+        if(ts.nRecords && (ts.nRecords > records_.size() || steps_[ts.nRecords-1] != ts.steps))
+            n++;
+    }
+    return n;
+}
+
+bool PapiWrapper::recordsInStep()
+{
+    return outOfStepThreads() == 0;
+}
+
+unsigned long long PapiWrapper::droppedRecords() const
+{
+    // Every thread of a team drops the same records
+    unsigned long long dropped = 0;
+    for(unsigned t = 0; t < threads_.size(); t++)
+        if(threads_[t].recordsDropped > dropped)
+            dropped = threads_[t].recordsDropped;
+    return dropped;
+}
+
+void PapiWrapper::printRecordWarnings()
+{
+    unsigned long long dropped = droppedRecords();
+    if(dropped)
+        printf("Warning: %llu records dropped, the record arena was full inside a parallel region (call reserveRecords() before it)\n", dropped);
+    unsigned outOfStep = outOfStepThreads();
+    if(outOfStep)
+        printf("Warning: %u threads opened regions out of step with thread 0, so their counts are in the wrong records. "
+            "Every thread must open the same regions in the same order from teams of one size, "
+            "so regions cannot be recorded inside omp single, sections or master\n", outOfStep);
+    fflush(0);
+}
+
+void PapiWrapper::setWork(double bytesRead, double bytesWritten, double flops)
+{
+#ifdef _OPENMP
+    int tid = omp_get_thread_num();
+#else
+    int tid = 0;
+#endif
+    ThreadState& ts = threads_[tid];
+    if(!ts.depth) {
+        printf("Thread %d: Cannot set work when no region is open\n", tid);
+        fflush(0);
+        exit(1);
+    }
+    PwWork& work = ts.work[ts.depth-1];
+    work.bytesRead = bytesRead;
+    work.bytesWritten = bytesWritten;
+    work.flops = flops;
+}
+
+void PapiWrapper::addThreadKeyStats(ThreadState& ts)
+{
+    // Only runs the first time a thread sees a key, one statistic per event
+    // plus one for time
+    unsigned old = ts.keyStats.size();
+    ts.keyStats.resize(ts.keys.size()*(numEvents_+1));
+    for(unsigned i = old; i < ts.keyStats.size(); i++)
+        ts.keyStats[i] = RunningStat();
+    ts.keyWork.resize(ts.keys.size());
+}
+
+bool PapiWrapper::hasChildren(unsigned rec)
+{
+    // Children are always recorded straight after their parent
+    return rec+1 < records_.size() && records_[rec+1].parent() == (int)rec;
+}
+
+void PapiWrapper::exclusiveCounts(unsigned rec, unsigned tid, long long* counts, double& time)
+{
+    // Inclusive values less those of the direct children. Descendants follow
+    // their parent in the arena, so stop at the first record not nested in rec
+    Array_T<int>& passEvents = passEvents_[records_[rec].pass()];
+    for(unsigned j = 0; j < passEvents.size(); j++)
+        counts[passEvents[j]] = recordCounts(rec, tid)[passEvents[j]];
+    time = recordTime(rec, tid);
+
+    for(unsigned i = rec+1; i < records_.size() && records_[i].depth() > records_[rec].depth(); i++) {
+        if(records_[i].parent() != (int)rec)
+            continue;
+        for(unsigned j = 0; j < passEvents.size(); j++)
+            counts[passEvents[j]] -= recordCounts(i, tid)[passEvents[j]];
+        time -= recordTime(i, tid);
+    }
+}
+
+void PapiWrapper::printRecord(unsigned key)
+{
+    if(streaming_){
+        printf("Records were streamed to %s, decode them with pw_convert\n", traceName_);
+        fflush(0);
+        return;
+    }
+    if(records_.size() == 0){
+        printf("Cannot print record when no recordings have been made");
+        fflush(0);
+        exit(1);
+    }
+
+    bool found = false;
+    for(unsigned i = 0; keyIndex_.find(key) >= 0 && i < records_.size(); i++) {
+        if(records_[i].rID() == key){
+            printRecordAt(i);
+            found = true;
+        }
+    }
+
+    if(!found){
+        printf("Record with key: %u not found in records list.\n", key);
+        fflush(0);
+    }
+}
+
+void PapiWrapper::printAllRecords()
+{
+    if(records_.size() == 0){
+        printf("printAllRecords(): No records made \n");
+        fflush(0);
+    }
+
+    printTimerInfo();
+    printRecordWarnings();
+    printOverhead();
+    for(unsigned i = 0; i < records_.size(); i++)
+        printRecordAt(i);
+}
+
+void PapiWrapper::printRecordAt(unsigned i)
+{
+    printf("------------------------\nFor ");
+    printKeyLabel(records_[i].rID());
+    printf("\n");
+    if(records_[i].parent() >= 0){
+        printf("Nested at depth %u inside ", records_[i].depth());
+        printKeyLabel(records_[records_[i].parent()].rID());
+        printf("\n");
+    }
+    printf("------------------------\n");
+
+    // Regions with nested regions also get exclusive values per thread
+    bool children = hasChildren(i);
+    Array_T<long long> exclCounts;
+    Array_T<double> exclTimes;
+    if(children){
+        exclCounts.resize(numThreads_*numEvents_);
+        exclTimes.resize(numThreads_);
+        for(int k = 0; k < numThreads_; k++)
+            exclusiveCounts(i, k, exclCounts.ptr() + k*numEvents_, exclTimes[k]);
+    }
+
+    for(int j = 0; j < numEvents_; j++) {
+        if((unsigned)eventPass_[j] != records_[i].pass()){
+            printf("Event: %s: not counted in pass %d\n", eventNames_[j], records_[i].pass());
+            continue;
+        }
+        printf("Event: %s: \n",eventNames_[j]);
+
+        // Print thread IDs
+        for(int k = 0; k < numThreads_; k++)
+            printf("Thread ID: %10d | ",k);
+        printf("\n");
+
+        // Print counts   
+        for(int k = 0; k < numThreads_; k++)
+            printf("Count: %14lld | ", recordCounts(i, k)[j]);
+        printf("\n");
+
+        // For multiple openmp threads print cumulative total
+        if(numThreads_>1){
+            long long total = 0;
+            for(int k = 0; k < numThreads_; k++)
+                total += recordCounts(i, k)[j];
+            printf("Accumulative total from %d threads: %lld\n", numThreads_, total);
+        }
+
+        if(children){
+            long long total = 0;
+            for(int k = 0; k < numThreads_; k++){
+                printf("Excl:  %14lld | ", exclCounts[k*numEvents_ + j]);
+                total += exclCounts[k*numEvents_ + j];
+            }
+            printf("\n");
+            printf("Exclusive total from %d threads: %lld\n", numThreads_, total);
+        }
+    }
+
+    // Print time
+    for(int k = 0; k < numThreads_; k++)           
+        printf("------------------------");
+    printf("\n");
+    for(int k = 0; k < numThreads_; k++)
+        printf("Time: %15.9f | ", recordTime(i, k));
+    printf("\n");    
+
+    // For multiple openmp threads print average time
+    if(numThreads_>1){
+        double total = 0;
+        for(int k = 0; k < numThreads_; k++)
+            total += recordTime(i, k);
+        printf("Average time from %d threads: %.9f\n", numThreads_, total/(double)numThreads_);
+    }   
+
+    if(children){
+        double total = 0;
+        for(int k = 0; k < numThreads_; k++){
+            printf("Excl: %15.9f | ", exclTimes[k]);
+            total += exclTimes[k];
+        }
+        printf("\n");
+        printf("Average exclusive time from %d threads: %.9f\n", numThreads_, total/(double)numThreads_);
+    }
+
+    // Work rates from the slowest thread's time, when the team finished
+    const PwWork& work = work_[i];
+    if(pwHasWork(work)){
+        double maxTime = 0;
+        for(int k = 0; k < numThreads_; k++)
+            if(recordTime(i, k) > maxTime)
+                maxTime = recordTime(i, k);
+        PwWorkRates rates;
+        rates.add(work, maxTime);
+        printf("Work: %.0f bytes read, %.0f bytes written, %.0f flops: %.3f GB/s, %.3f GFLOP/s\n",
+            work.bytesRead, work.bytesWritten, work.flops, rates.bwMax, rates.flopMax);
+    }
+
+    // Derived metrics per thread, then over the team from the summed
+    // counts and average time
+    if(metrics_.size()){
+        Array_T<double> values;
+        values.resize(numEvents_+1);
+        Array_T<long long> totals;
+        totals.resize(numEvents_);
+        totals.fill(0);
+        double totalTime = 0;
+        for(int k = 0; k < numThreads_; k++){
+            for(int j = 0; j < numEvents_; j++)
+                totals[j] += recordCounts(i, k)[j];
+            totalTime += recordTime(i, k);
+        }
+        for(int k = 0; k < numThreads_; k++)
+            printf("------------------------");
+        printf("\n");
+        for(unsigned m = 0; m < metrics_.size(); m++){
+            printf("Metric: %s = %s\n", metrics_[m].name(), metrics_[m].expr());
+            for(int k = 0; k < numThreads_; k++){
+                metricValues(recordCounts(i, k), records_[i].pass(), recordTime(i, k), values.ptr());
+                double v = metrics_[m].eval(values.ptr());
+                if(isnan(v))
+                    printf("Value: %14s | ", "n/a");
+                else
+                    printf("Value: %14.6g | ", v);
+            }
+            printf("\n");
+            if(numThreads_>1){
+                metricValues(totals.ptr(), records_[i].pass(), totalTime/numThreads_, values.ptr());
+                double v = metrics_[m].eval(values.ptr());
+                if(isnan(v))
+                    printf("From totals of %d threads: n/a\n", numThreads_);
+                else
+                    printf("From totals of %d threads: %g\n", numThreads_, v);
+            }
+        }
+    }
+}
+
+void PapiWrapper::multiRunPrintAverageRecords()
+{
+    if(aggregate_){
+        printAggregates();
+        return;
+    }
+    if(streaming_){
+        printf("Records were streamed to %s, decode them with pw_convert\n", traceName_);
+        fflush(0);
+        return;
+    }
+
+    if(records_.size() == 0){
+        printf("multiRunPrintFastestRecords(): No records made \n");
+        fflush(0);
+    }
+    // Loop through each unique key, gather its runs' times and counts,
+    // then print averages in a layout that pastes easily into excel
+    unsigned nKeys = uniqueKeys_.size();
+    PwKeyAverages averages;
+    averages.init(nKeys, numEvents_, numThreads_);
+    PwRunValues run;
+    run.init(numEvents_, numThreads_);
+
+    // One pass through the records, finding each record's key in the index
+    for(unsigned j = 0; j < records_.size(); j++) {
+        runValues(j, run);
+        averages.addRun(keyIndex_.find(records_[j].rID()), eventPass_.ptr(), run);
+    }
+    averages.finish();
+
+    printTimerInfo();
+    printRecordWarnings();
+    pwPrintAverages(averages, uniqueKeys_.ptr(), keyNames_.ptr(), eventNames_.ptr(), metrics_.ptr(), metrics_.size(),
+        outlierThreshold_);
+    printOverhead();
+    pwPrintTrustWarnings(averages, uniqueKeys_.ptr(), keyNames_.ptr(), overheadMean(numEvents_));
+    fflush(0);
+}
+
+void PapiWrapper::printAggregates()
+{
+    if(!aggregate_){
+        printf("printAggregates(): Aggregation mode not enabled\n");
+        fflush(0);
+        return;
+    }
+
+    // Samples are per thread per region, merge every thread's statistics
+    // for each key then print mean, standard deviation, min and max
+    Array_T<RunningStat> keyStats;
+    keyStats.resize(numEvents_+1);
+    Array_T<PwWorkRates> keyWork;
+    keyWork.resize(uniqueKeys_.size());
+    bool anyWork = false;
+    printTimerInfo();
+    printOverhead();
+
+    for(unsigned i = 0; i < uniqueKeys_.size(); i++){
+        for(unsigned j = 0; j < keyStats.size(); j++)
+            keyStats[j] = RunningStat();
+        for(int t = 0; t < numThreads_; t++){
+            ThreadState& ts = threads_[t];
+            if(i >= ts.keys.size())
+                continue;
+            for(unsigned j = 0; j < keyStats.size(); j++)
+                keyStats[j].merge(ts.keyStats[i*(numEvents_+1) + j]);
+            keyWork[i].merge(ts.keyWork[i]);
+        }
+        if(keyWork[i].n)
+            anyWork = true;
+
+        RunningStat& time = keyStats[numEvents_];
+        printf("------------------------\nFor ");
+        printKeyLabel(uniqueKeys_[i]);
+        printf(" (%llu thread samples)\n------------------------\n", time.n);
+        printf("%-32s %16s %16s %16s %16s %18s\n", "Event", "Mean", "Std dev", "Min", "Max", "Mean x threads");
+        printf("%-32s %16g %16g %16g %16g %18s\n", "Time", time.mean, time.stddev(), time.min, time.max, "-");
+        for(int j = 0; j < numEvents_; j++){
+            RunningStat& st = keyStats[j];
+            if(!st.n){
+                printf("%-32s %16s\n", eventNames_[j], "n/a");
+                continue;
+            }
+            printf("%-32s %16.1f %16.1f %16.0f %16.0f %18.0f\n", eventNames_[j], st.mean, st.stddev(), st.min, st.max, st.mean*numThreads_);
+        }
+
+        // Metrics of the means, a ratio of counts is the same per thread
+        // or over the team
+        Array_T<double> values;
+        values.resize(numEvents_+1);
+        for(int j = 0; j <= numEvents_; j++)
+            values[j] = keyStats[j].n ? keyStats[j].mean : NAN;
+        for(unsigned m = 0; m < metrics_.size(); m++){
+            double v = metrics_[m].eval(values.ptr());
+            if(isnan(v))
+                printf("%-32s %16s\n", metrics_[m].name(), "n/a");
+            else
+                printf("%-32s %16g %16s %16s %16s %18s\n", metrics_[m].name(), v, "-", "-", "-", "-");
+        }
+    }
+    printf("\n");
+
+    // Rates use the time of the thread that set the work
+    if(anyWork){
+        pwPrintWorkHeader();
+        for(unsigned i = 0; i < uniqueKeys_.size(); i++)
+            pwPrintWorkRow(keyNames_[i], uniqueKeys_[i], keyWork[i]);
+        printf("\n");
+    }
+    fflush(0);
+}
+
+void PapiWrapper::runValues(unsigned rec, PwRunValues& run)
+{
+    // Only the events of the record's pass, exclusive values equal to
+    // inclusive for leaf regions
+    Array_T<int>& passEvents = passEvents_[records_[rec].pass()];
+    for(int t = 0; t < numThreads_; t++){
+        run.times[t] = recordTime(rec, t);
+        for(unsigned k = 0; k < passEvents.size(); k++)
+            run.counts[t*numEvents_ + passEvents[k]] = recordCounts(rec, t)[passEvents[k]];
+        exclusiveCounts(rec, t, run.exclCounts.ptr() + t*numEvents_, run.exclTimes[t]);
+    }
+    run.pass = records_[rec].pass();
+    run.hasParent = records_[rec].parent() >= 0;
+    run.work = work_[rec];
+}
+
+void PapiWrapper::keyThreadMeans(PwThreadMeans& means)
+{
+    unsigned nKeys = uniqueKeys_.size();
+    means.init(nKeys, numEvents_, numThreads_);
+
+    if(aggregate_){
+        // Only the means survive, so time lost is estimated from them
+        means.estimated = true;
+        for(unsigned i = 0; i < nKeys; i++){
+            double max = 0;
+            for(int t = 0; t < numThreads_; t++){
+                ThreadState& ts = threads_[t];
+                if(i >= ts.keys.size())
+                    continue;
+                RunningStat* stats = ts.keyStats.ptr() + i*(numEvents_+1);
+                means.times[i*numThreads_ + t] = stats[numEvents_].mean;
+                if(stats[numEvents_].mean > max)
+                    max = stats[numEvents_].mean;
+                if(stats[numEvents_].n > means.runs[i])
+                    means.runs[i] = stats[numEvents_].n;
+                for(int j = 0; j < numEvents_; j++)
+                    means.counts[(i*numThreads_ + t)*numEvents_ + j] = stats[j].n ? stats[j].mean : NAN;
+            }
+            for(int t = 0; t < numThreads_; t++)
+                means.wasted[i] += (max - means.times[i*numThreads_ + t])*means.runs[i];
+        }
+        return;
+    }
+
+    PwRunValues run;
+    run.init(numEvents_, numThreads_);
+    for(unsigned j = 0; j < records_.size(); j++){
+        runValues(j, run);
+        means.addRun(keyIndex_.find(records_[j].rID()), eventPass_.ptr(), run);
+    }
+    means.finish();
+}
+
+void PapiWrapper::printImbalance()
+{
+    if(streaming_){
+        printf("Records were streamed to %s, decode them with pw_convert\n", traceName_);
+        fflush(0);
+        return;
+    }
+
+    PwThreadMeans means;
+    keyThreadMeans(means);
+    printRecordWarnings();
+    pwPrintImbalanceReport(means, uniqueKeys_.ptr(), keyNames_.ptr(), eventNames_.ptr());
+}
+
+void PapiWrapper::printTopology()
+{
+    if(streaming_){
+        printf("Records were streamed to %s, decode them with pw_convert\n", traceName_);
+        fflush(0);
+        return;
+    }
+
+    // Groups are only right if threads stayed on their CPUs, which needs
+    // an affinity setting such as KMP_AFFINITY
+    Array_T<int> moved;
+    moved.resize(numThreads_);
+    moved.fill(0);
+    #pragma omp parallel num_threads(numThreads_)
+    {
+#ifdef _OPENMP
         int tid = omp_get_thread_num();
 #else
         int tid = 0;
 #endif
-        if(numEvents_){
-            int papi_error = PAPI_stop_counters(&counters_[tid][0], eventIds_.size());
-            if (papi_error != PAPI_OK){
-                printf("Could not stop counters\n");
+        moved[tid] = sched_getcpu() != threads_[tid].cpu.cpu;
+    }
+
+    Array_T<PwCpuInfo> cpus;
+    cpus.resize(numThreads_);
+    unsigned nMoved = 0;
+    for(int t = 0; t < numThreads_; t++){
+        cpus[t] = threads_[t].cpu;
+        nMoved += moved[t];
+    }
+
+    PwThreadMeans means;
+    keyThreadMeans(means);
+
+    printRecordWarnings();
+    if(nMoved)
+        printf("Warning: %u threads are no longer on the CPU they had at init, pin threads (e.g. KMP_AFFINITY) for this report\n", nMoved);
+    pwPrintTopologyReport(means, uniqueKeys_.ptr(), keyNames_.ptr(), cpus.ptr(), eventNames_.ptr());
+}
+
+void PapiWrapper::collectSamples(Array_T<PwSample>& samples, unsigned long long& dropped)
+{
+    // Recording must be over, overflows between regions can still land in
+    // the rings while they are drained here
+    samples.resize(0);
+    dropped = 0;
+    for(unsigned t = 0; t < threads_.size(); t++){
+        ThreadState& ts = threads_[t];
+        ts.sampleRing.drain(ts.samples);
+        for(unsigned i = 0; i < ts.samples.size(); i++)
+            samples.push_back(ts.samples[i]);
+        dropped += ts.sampleRing.dropped();
+    }
+    qsort(samples.ptr(), samples.size(), sizeof(PwSample), pwCompareSample);
+}
+
+void PapiWrapper::printSamples()
+{
+    printf("-----------Samples-----------\n");
+    if(!sampling_){
+        printf("Sampling not enabled, set PAPI_SAMPLE\n");
+        fflush(0);
+        return;
+    }
+
+    Array_T<PwSample> samples;
+    unsigned long long dropped;
+    collectSamples(samples, dropped);
+
+    for(int e = 0; e < numEvents_; e++){
+        if(!sampleThresholds_[e])
+            continue;
+        unsigned long long n = 0;
+        for(unsigned i = 0; i < samples.size(); i++)
+            n += samples[i].event == e;
+        printf("%s sampled every %lld counts: %llu samples", eventNames_[e], sampleThresholds_[e], n);
+        if(numPasses_ > 1)
+            printf(", only while pass %d of %d was counted", eventPass_[e], numPasses_);
+        printf("\n");
+    }
+    if(dropped)
+        printf("Warning: %llu samples dropped, a thread's ring filled inside one region (raise PAPI_SAMPLE_BUFFER)\n", dropped);
+
+    // One block per key and event, in key order with samples taken outside
+    // every region first
+    unsigned i = 0;
+    while(i < samples.size()){
+        unsigned j = i;
+        while(j < samples.size() && samples[j].key == samples[i].key && samples[j].event == samples[i].event)
+            j++;
+        if(!i || samples[i-1].key != samples[i].key){
+            printf("------------------------\n");
+            if(samples[i].key >= 0 && samples[i].key < (int)uniqueKeys_.size())
+                printKeyLabel(uniqueKeys_[samples[i].key]);
+            else
+                printf("Outside regions");
+            printf("\n------------------------\n");
+        }
+        int e = samples[i].event;
+        printf("  %s: %u samples\n", eventNames_[e], j-i);
+        pwPrintSampleHistogram(samples.ptr() + i, j-i, sampleThresholds_[e]);
+        i = j;
+    }
+    printf("\n");
+    fflush(0);
+}
+
+void PapiWrapper::writeSamples(const char* path)
+{
+    if(path == NULL)
+        path = getenv("PAPI_SAMPLE_FILE");
+    if(path == NULL || !sampling_)
+        return;
+    FILE* f = fopen(path, "w");
+    if(f == NULL){
+        printf("Could not open sample file %s\n", path);
+        fflush(0);
+        return;
+    }
+
+    Array_T<PwSample> samples;
+    unsigned long long dropped;
+    collectSamples(samples, dropped);
+
+    fprintf(f, "# PapiWrapper samples, %llu dropped\n", dropped);
+    fprintf(f, "# event <event> <name> <threshold>\n");
+    for(int e = 0; e < numEvents_; e++)
+        if(sampleThresholds_[e])
+            fprintf(f, "event %d %s %lld\n", e, eventNames_[e], sampleThresholds_[e]);
+    fprintf(f, "# key <key index> <key> <name>\n");
+    for(unsigned k = 0; k < uniqueKeys_.size(); k++)
+        fprintf(f, "key %u %u %s\n", k, uniqueKeys_[k], keyNames_[k] ? keyNames_[k] : "-");
+    fprintf(f, "# sample <key index, -1 outside regions> <event> <samples> <address> <offset in module> <module>\n");
+    char module[PW_SYMBOL_LEN];
+    unsigned i = 0;
+    while(i < samples.size()){
+        unsigned j = i;
+        while(j < samples.size() && !pwCompareSample(&samples[i], &samples[j]))
+            j++;
+        unsigned long long offset;
+        pwSampleModule(samples[i].address, module, sizeof(module), offset);
+        fprintf(f, "sample %d %d %u 0x%llx 0x%llx %s\n", samples[i].key, samples[i].event, j-i,
+            samples[i].address, offset, module);
+        i = j;
+    }
+    fclose(f);
+}
+
+void PapiWrapper::printTimeline()
+{
+    printf("-----------Timeline-----------\n");
+    if(!snapshots_){
+        printf("Snapshots not enabled, set PAPI_SNAPSHOT\n");
+        fflush(0);
+        return;
+    }
+
+    // Every thread's snapshots in one list, sorted by key, thread, region
+    // and time
+    Array_T<PwSnapshot> snaps;
+    Array_T<long long> counts;
+    unsigned long long dropped = 0;
+    for(unsigned t = 0; t < threads_.size(); t++){
+        ThreadState& ts = threads_[t];
+        for(unsigned i = 0; i < ts.nSnapshots; i++){
+            PwSnapshot s = ts.snapshots[i];
+            s.thread = t;
+            s.index = snaps.size();
+            snaps.push_back(s);
+            for(int e = 0; e < numEvents_; e++)
+                counts.push_back(ts.snapshotCounts[i*numEvents_ + e]);
+        }
+        dropped += ts.snapshotsDropped;
+    }
+    qsort(snaps.ptr(), snaps.size(), sizeof(PwSnapshot), pwCompareSnapshot);
+
+    printf("Snapshots every %.3f ms, %u taken\n", 1000*snapshotInterval_, snaps.size());
+    if(dropped)
+        printf("Warning: %llu snapshots dropped, a thread's buffer filled (raise PAPI_SNAPSHOT_BUFFER)\n", dropped);
+
+    unsigned i = 0;
+    while(i < snaps.size()){
+        unsigned j = i, nThreads = 0, nRegions = 0;
+        double longest = 0;
+        while(j < snaps.size() && snaps[j].key == snaps[i].key){
+            if(j == i || snaps[j].thread != snaps[j-1].thread)
+                nThreads++;
+            if(j == i || snaps[j].thread != snaps[j-1].thread || snaps[j].serial != snaps[j-1].serial)
+                nRegions++;
+            if(snaps[j].time > longest)
+                longest = snaps[j].time;
+            j++;
+        }
+
+        // Bins of one interval, or whole numbers of intervals for long regions
+        double binWidth = snapshotInterval_;
+        unsigned nBins = (unsigned)ceil(longest/binWidth);
+        if(nBins > PW_TIMELINE_ROWS){
+            binWidth *= ceil((double)nBins/PW_TIMELINE_ROWS);
+            nBins = (unsigned)ceil(longest/binWidth);
+        }
+        if(!nBins)
+            nBins = 1;
+
+        printf("------------------------\nFor ");
+        if(snaps[i].key >= 0 && snaps[i].key < (int)uniqueKeys_.size())
+            printKeyLabel(uniqueKeys_[snaps[i].key]);
+        printf(" (%u threads, %.1f regions each)\n------------------------\n", nThreads, (double)nRegions/nThreads);
+        Array_T<double> delta, dt;
+        Array_T<unsigned> binSnapshots;
+        pwTimelineBins(snaps.ptr() + i, j-i, counts.ptr(), numEvents_, eventPass_.ptr(), binWidth, nBins, delta, dt, binSnapshots);
+        pwPrintTimeline(nBins, binWidth, nThreads, numEvents_, eventNames_.ptr(), delta.ptr(), dt.ptr(), binSnapshots.ptr(),
+            metrics_.ptr(), metrics_.size());
+        i = j;
+    }
+    printf("\n");
+    fflush(0);
+}
+
+unsigned long long PapiWrapper::packedSize()
+{
+    PwBufferHeader h;
+    return pwBufferLayout(h, numThreads_, numEvents_, records_.size(), uniqueKeys_.size(), numPasses_, metrics_.size());
+}
+
+void PapiWrapper::packRecords(void* buffer)
+{
+    // Call outside of any recording, all sections are written in full. The
+    // buffer cannot say records were dropped or out of step, so say it here
+    printRecordWarnings();
+    unsigned nRecords = records_.size();
+    PwBufferHeader* h = pwBufferHeader(buffer);
+    pwBufferLayout(*h, numThreads_, numEvents_, nRecords, uniqueKeys_.size(), numPasses_, metrics_.size());
+    h->timerResolution = timer_.resolution();
+    pwCopyName(h->timerName, timer_.name());
+    h->overheadSubtracted = subtractOverhead_;
+    double* overhead = pwBufferOverhead(buffer);
+    for(int j = 0; j <= numEvents_; j++)
+        overhead[j] = overhead_.size() ? overheadMean(j) : 0;
+
+    PwBufferEvent* events = pwBufferEvents(buffer);
+    for(int i = 0; i < numEvents_; i++){
+        pwCopyName(events[i].name, eventNames_[i]);
+        events[i].pass = eventPass_[i];
+        events[i].reserved = 0;
+    }
+
+    if(nRecords)
+        memcpy(pwBufferWork(buffer), work_.ptr(), (size_t)nRecords*sizeof(PwWork));
+    PwCpuInfo* cpus = pwBufferCpus(buffer);
+    for(int t = 0; t < numThreads_; t++)
+        cpus[t] = threads_[t].cpu;
+
+    PwBufferMetric* metrics = pwBufferMetrics(buffer);
+    for(unsigned i = 0; i < metrics_.size(); i++){
+        memset(&metrics[i], 0, sizeof(PwBufferMetric));
+        strcpy(metrics[i].name, metrics_[i].name());
+        strcpy(metrics[i].expr, metrics_[i].expr());
+    }
+
+    PwBufferKey* keys = pwBufferKeys(buffer);
+    for(unsigned i = 0; i < uniqueKeys_.size(); i++){
+        keys[i].key = uniqueKeys_[i];
+        keys[i].reserved = 0;
+        pwCopyName(keys[i].name, keyNames_[i]);
+    }
+
+    PwBufferRecord* records = pwBufferRecords(buffer);
+    for(unsigned i = 0; i < nRecords; i++){
+        records[i].rID = records_[i].rID();
+        records[i].pass = records_[i].pass();
+        records[i].parent = records_[i].parent();
+        records[i].depth = records_[i].depth();
+    }
+
+    // Each thread's slab is already record-major, drop the line padding
+    for(int t = 0; t < numThreads_ && nRecords; t++){
+        memcpy(pwBufferCounts(buffer, t), recordCounts(0, t), (size_t)nRecords*numEvents_*sizeof(long long));
+        memcpy(pwBufferTimes(buffer, t), &recordTime(0, t), (size_t)nRecords*sizeof(double));
+    }
+}
+
+void PapiWrapper::openTrace()
+{
+    if(!traceName_)
+        setOption(traceName_, getenv("PAPI_TRACE_FILE"));
+    if(!traceName_)
+        return;
+
+    traceFd_ = open(traceName_, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(traceFd_ < 0) {
+        printf("Could not open trace file %s\n", traceName_);
+        fflush(0);
+        exit(1);
+    }
+
+    // Header and event table, blocks are appended after them
+    unsigned long long eventsOffset = pwAlign8(sizeof(PwTraceHeader));
+    unsigned long long dataOffset = pwAlign8(eventsOffset + numEvents_*sizeof(PwBufferEvent));
+    writeTraceHeader(traceAppend(0, dataOffset), eventsOffset, dataOffset);
+
+    if(debug_) {
+        printf("Tracing records to %s\n", traceName_);
+        fflush(0);
+    }
+}
+
+void PapiWrapper::writeTraceHeader(char* start, unsigned long long eventsOffset, unsigned long long dataOffset)
+{
+    PwTraceHeader* h = (PwTraceHeader*)start;
+    h->magic = PW_TRACE_MAGIC;
+    h->version = PW_TRACE_VERSION;
+    h->numThreads = numThreads_;
+    h->numEvents = numEvents_;
+    h->numPasses = numPasses_;
+    h->reserved = 0;
+    h->eventsOffset = eventsOffset;
+    h->dataOffset = dataOffset;
+
+    PwBufferEvent* events = (PwBufferEvent*)(start + eventsOffset);
+    for(int i = 0; i < numEvents_; i++){
+        pwCopyName(events[i].name, eventNames_[i]);
+        events[i].pass = eventPass_[i];
+        events[i].reserved = 0;
+    }
+    h->bytesUsed = dataOffset;
+}
+
+void PapiWrapper::openStream()
+{
+    if(!traceName_)
+        setOption(traceName_, getenv("PAPI_TRACE_FILE"));
+    if(!traceName_) {
+        printf("Streaming needs a trace file, set PAPI_TRACE_FILE or call setTraceFile()\n");
+        fflush(0);
+        exit(1);
+    }
+
+    traceFd_ = open(traceName_, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(traceFd_ < 0) {
+        printf("Could not open trace file %s\n", traceName_);
+        fflush(0);
+        exit(1);
+    }
+
+    unsigned long long eventsOffset = pwAlign8(sizeof(PwTraceHeader));
+    unsigned long long dataOffset = pwAlign8(eventsOffset + numEvents_*sizeof(PwBufferEvent));
+    Array_T<char> head;
+    head.resize(dataOffset);
+    head.fill(0);
+    writeTraceHeader(head.ptr(), eventsOffset, dataOffset);
+    if(!writeAll(traceFd_, head.ptr(), dataOffset)) {
+        printf("Could not write trace file %s\n", traceName_);
+        fflush(0);
+        exit(1);
+    }
+    traceUsed_ = dataOffset;
+
+    // Memory is fixed at two buffers per thread, each big enough for the
+    // largest block
+    unsigned largest = pwTraceThreadRecordBytes(numEvents_);
+    if(sizeof(PwTraceBlock) + sizeof(PwBufferKey) > largest)
+        largest = sizeof(PwTraceBlock) + sizeof(PwBufferKey);
+    streamBufferSize_ = streamBufferBytes();
+    if(streamBufferSize_ < largest)
+        streamBufferSize_ = largest;
+    for(unsigned i = 0; i < threads_.size(); i++){
+        ThreadState& ts = threads_[i];
+        for(int b = 0; b < 2; b++){
+            ts.streamBuf[b].resize(streamBufferSize_);
+            ts.streamUsed[b] = 0;
+            ts.streamFull[b] = 0;
+        }
+        ts.streamActive = 0;
+        ts.streamDropped = 0;
+    }
+
+    streamStop_ = 0;
+    if(sem_init(&streamSem_, 0, 0) != 0 || pthread_create(&streamThread_, NULL, streamWriter, this) != 0) {
+        printf("Could not start the trace writer thread\n");
+        fflush(0);
+        exit(1);
+    }
+
+    if(debug_) {
+        printf("Streaming records to %s (2 x %u bytes per thread)\n", traceName_, streamBufferSize_);
+        fflush(0);
+    }
+}
+
+char* PapiWrapper::streamReserve(ThreadState& ts, unsigned bytes)
+{
+    // Space in the thread's active buffer. When it is full it is handed to
+    // the writer and the other buffer takes over; if the writer has not
+    // drained that one yet the block is dropped rather than waiting on I/O
+    int a = ts.streamActive;
+    if(ts.streamUsed[a] + bytes > streamBufferSize_) {
+        int b = 1 - a;
+        if(ts.streamFull[b]) {
+            ts.streamDropped++;
+            return NULL;
+        }
+        __sync_synchronize();
+        ts.streamFull[a] = 1;
+        sem_post(&streamSem_);
+        a = ts.streamActive = b;
+        ts.streamUsed[a] = 0;
+    }
+    char* block = ts.streamBuf[a].ptr() + ts.streamUsed[a];
+    ts.streamUsed[a] += bytes;
+    return block;
+}
+
+void PapiWrapper::streamRecord(int tid, int depth, double time)
+{
+    ThreadState& ts = threads_[tid];
+    unsigned nCounts = timeOnly_ ? 0 : passEvents_[ts.pass].size();
+    unsigned bytes = pwTraceThreadRecordBytes(nCounts);
+    char* block = streamReserve(ts, bytes);
+    if(!block)
+        return;
+
+    ((PwTraceBlock*)block)->type = PW_TRACE_THREAD_RECORD;
+    ((PwTraceBlock*)block)->bytes = bytes;
+    PwTraceThreadRecord* tr = (PwTraceThreadRecord*)(block + sizeof(PwTraceBlock));
+    tr->index = ts.stack[depth];
+    tr->rID = ts.keys[ts.stackKeys[depth]];
+    tr->pass = ts.pass;
+    tr->parent = depth ? ts.stack[depth-1] : -1;
+    tr->depth = depth;
+    tr->nCounts = nCounts;
+    tr->thread = tid;
+    tr->reserved = 0;
+    tr->time = time;
+    if(nCounts)
+        memcpy(tr+1, ts.counters.ptr(), nCounts*sizeof(long long));
+}
+
+void* PapiWrapper::streamWriter(void* arg)
+{
+    // Sleeps until a thread hands over a full buffer or closeTrace() asks
+    // it to stop
+    PapiWrapper* pw = (PapiWrapper*)arg;
+    while(true) {
+        while(sem_wait(&pw->streamSem_) != 0)
+            ;
+        bool stop = pw->streamStop_;
+        pw->drainStreams(false);
+        if(stop)
+            break;
+    }
+    return NULL;
+}
+
+void PapiWrapper::drainStreams(bool all)
+{
+    // Write out every full buffer, and with all set (once recording is over)
+    // the partly filled active buffers too, then move bytesUsed on
+    bool wrote = false;
+    for(unsigned t = 0; t < threads_.size(); t++){
+        ThreadState& ts = threads_[t];
+        for(int b = 0; b < 2; b++){
+            if(!ts.streamFull[b])
+                continue;
+            __sync_synchronize();
+            if(!writeAll(traceFd_, ts.streamBuf[b].ptr(), ts.streamUsed[b]))
+                printf("Could not write trace file %s\n", traceName_);
+            traceUsed_ += ts.streamUsed[b];
+            wrote = true;
+            __sync_synchronize();
+            ts.streamFull[b] = 0;
+        }
+        if(all && ts.streamUsed[ts.streamActive]){
+            int a = ts.streamActive;
+            if(!writeAll(traceFd_, ts.streamBuf[a].ptr(), ts.streamUsed[a]))
+                printf("Could not write trace file %s\n", traceName_);
+            traceUsed_ += ts.streamUsed[a];
+            ts.streamUsed[a] = 0;
+            wrote = true;
+        }
+    }
+
+    if(wrote && pwrite(traceFd_, &traceUsed_, sizeof(traceUsed_), offsetof(PwTraceHeader, bytesUsed)) < 0)
+        printf("Could not update trace file header %s\n", traceName_);
+}
+
+char* PapiWrapper::traceAppend(unsigned type, unsigned bytes)
+{
+    // Space for one block at the end of the trace. Callers hold the
+    // pw_trace critical section. reserveRecords() sizes the file for the
+    // whole arena, so remapping here is only a fallback
+    unsigned long long used = trace_ ? ((PwTraceHeader*)trace_)->bytesUsed : 0;
+    if(used + bytes > traceSize_) {
+        unsigned long long size = traceSize_ + PW_TRACE_CHUNK;
+        while(used + bytes > size)
+            size += PW_TRACE_CHUNK;
+        growTrace(size);
+    }
+
+    char* block = trace_ + used;
+    if(type) {
+        ((PwTraceBlock*)block)->type = type;
+        ((PwTraceBlock*)block)->bytes = bytes;
+    }
+    return block;
+}
+
+void PapiWrapper::growTrace(unsigned long long size)
+{
+    // Remap the trace at size bytes, never shrinking it
+    if(size <= traceSize_)
+        return;
+    if(trace_)
+        munmap(trace_, traceSize_);
+    if(ftruncate(traceFd_, size) != 0 ||
+       (trace_ = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, traceFd_, 0)) == MAP_FAILED) {
+        printf("Could not grow trace file %s to %llu bytes\n", traceName_, size);
+        fflush(0);
+        exit(1);
+    }
+    traceSize_ = size;
+}
+
+void PapiWrapper::appendTraceKey(ThreadState& ts, unsigned idx)
+{
+    if(streaming_){
+        // Into the stream of the thread that registered the key, ahead of
+        // its records of it
+        unsigned bytes = sizeof(PwTraceBlock) + sizeof(PwBufferKey);
+        char* block = streamReserve(ts, bytes);
+        if(!block)
+            return;
+        ((PwTraceBlock*)block)->type = PW_TRACE_KEY;
+        ((PwTraceBlock*)block)->bytes = bytes;
+        PwBufferKey* k = (PwBufferKey*)(block + sizeof(PwTraceBlock));
+        k->key = uniqueKeys_[idx];
+        k->reserved = 0;
+        pwCopyName(k->name, keyNames_[idx]);
+        return;
+    }
+
+    #pragma omp critical(pw_trace)
+    {
+        unsigned bytes = sizeof(PwTraceBlock) + sizeof(PwBufferKey);
+        PwBufferKey* k = (PwBufferKey*)(traceAppend(PW_TRACE_KEY, bytes) + sizeof(PwTraceBlock));
+        k->key = uniqueKeys_[idx];
+        k->reserved = 0;
+        pwCopyName(k->name, keyNames_[idx]);
+        ((PwTraceHeader*)trace_)->bytesUsed += bytes;
+    }
+}
+
+void PapiWrapper::appendTraceRecord(unsigned rec)
+{
+    // Copies the record's pass events and times for every thread out of the
+    // arena, the thread slabs are left as they are for the usual reports
+    Record const& r = records_.ptr()[rec];
+    unsigned nCounts = timeOnly_ ? 0 : passEvents_[r.pass()].size();
+    unsigned bytes = pwTraceRecordBytes(nCounts, numThreads_);
+
+    #pragma omp critical(pw_trace)
+    {
+        char* block = traceAppend(PW_TRACE_RECORD, bytes);
+        PwTraceRecord* tr = (PwTraceRecord*)(block + sizeof(PwTraceBlock));
+        tr->index = rec;
+        tr->rID = r.rID();
+        tr->pass = r.pass();
+        tr->parent = r.parent();
+        tr->depth = r.depth();
+        tr->nCounts = nCounts;
+
+        long long* counts = (long long*)(tr+1);
+        for(unsigned j = 0; j < nCounts; j++){
+            int event = passEvents_[r.pass()][j];
+            for(int t = 0; t < numThreads_; t++)
+                *counts++ = recordCounts(rec, t)[event];
+        }
+        double* times = (double*)counts;
+        for(int t = 0; t < numThreads_; t++)
+            times[t] = recordTime(rec, t);
+        ((PwTraceHeader*)trace_)->bytesUsed += bytes;
+    }
+}
+
+void PapiWrapper::closeTrace()
+{
+    if(traceFd_ < 0)
+        return;
+
+    if(streaming_){
+        // Recording must be over, the writer finishes what it was handed and
+        // the rest is written from here
+        streamStop_ = 1;
+        sem_post(&streamSem_);
+        pthread_join(streamThread_, NULL);
+        sem_destroy(&streamSem_);
+        drainStreams(true);
+
+        unsigned long long dropped = 0;
+        for(unsigned t = 0; t < threads_.size(); t++)
+            dropped += threads_[t].streamDropped;
+        if(dropped)
+            printf("Warning: %llu records dropped from %s, the writer fell behind (raise PAPI_STREAM_BUFFER)\n", dropped, traceName_);
+        fflush(0);
+        close(traceFd_);
+        traceFd_ = -1;
+        return;
+    }
+
+    // Records some thread of their team never closed, e.g. regions still
+    // open, are written as they stand
+    if(trace_){
+        for(unsigned rec = 0; rec < records_.size(); rec++){
+            if(closed_[rec] < teams_[rec]){
+                closed_[rec] = teams_[rec];
+                appendTraceRecord(rec);
+            }
+        }
+    }
+
+    unsigned long long used = trace_ ? ((PwTraceHeader*)trace_)->bytesUsed : 0;
+    if(trace_)
+        munmap(trace_, traceSize_);
+    if(ftruncate(traceFd_, used) != 0) {
+        printf("Could not truncate trace file %s\n", traceName_);
+        fflush(0);
+    }
+    close(traceFd_);
+    traceFd_ = -1;
+    trace_ = NULL;
+    traceSize_ = 0;
+}
+
+void PapiWrapper::printTimerInfo()
+{
+    printf("Timer: %s, resolution %.1f ns\n", timer_.name(), 1e9*timer_.resolution());
+}
+
+void PapiWrapper::printKeyLabel(unsigned key)
+{
+    int idx = keyIndex_.find(key);
+    pwPrintKeyLabel(key, idx >= 0 ? keyNames_[idx] : NULL);
+}
+
+unsigned long long PapiWrapper::memoryUsed() const
+{
+    unsigned long long bytes = records_.capacity()*sizeof(Record) + counts_.capacity()*sizeof(long long)
+        + times_.capacity()*sizeof(double) + closed_.capacity()*sizeof(int) + teams_.capacity()*sizeof(int) + steps_.capacity()*sizeof(unsigned long long) + work_.capacity()*sizeof(PwWork)
+        + uniqueKeys_.capacity()*sizeof(unsigned) + keyNames_.capacity()*sizeof(const char*) + keyIndex_.bytes();
+    for(unsigned i = 0; i < threads_.size(); i++) {
+        const ThreadState& ts = threads_[i];
+        bytes += sizeof(ThreadState) + ts.keys.capacity()*sizeof(unsigned) + ts.keyRuns.capacity()*sizeof(unsigned)
+            + ts.keyIndex.bytes() + ts.keyStats.capacity()*sizeof(RunningStat) + ts.keyWork.capacity()*sizeof(PwWorkRates)
+            + ts.streamBuf[0].capacity() + ts.streamBuf[1].capacity() + ts.sampleRing.bytes()
+            + ts.samples.capacity()*sizeof(PwSample) + ts.snapshots.capacity()*sizeof(PwSnapshot)
+            + ts.snapshotCounts.capacity()*sizeof(long long);
+    }
+    return bytes;
+}
+
+void PapiWrapper::papiPrintError(int err)
+{
+	const char* errName = backend_ ? backend_->errorString(err) : "no backend";
+	printf("%s error code: %s (%d)\n", backend_ ? backend_->name() : "Counter", errName, err);
+	fflush(0);
+}
+
+void PapiWrapper::createThreadEventSets(int tid)
+{
+    // One event set per pass, the first pass is left running
+    ThreadState& ts = threads_[tid];
+    ts.eventSets.resize(numPasses_);
+    ts.counters.resize(numEvents_);
+    pwThreadId = tid;
+    ts.startCounts.resize(PW_MAX_DEPTH*numEvents_);
+
+    for(int i = 0; i < numPasses_; i++) {
+        Array_T<int>& passIds = passIds_[i];
+        ts.eventSets[i] = PW_NULL;
+        int papi_error = backend_->createSet(&ts.eventSets[i]);
+        if(papi_error != PW_OK) {
+            printf("Thread %d: Could not create event set\n", tid);
+            papiPrintError(papi_error);
+            exit(-1);
+        }
+
+        for(unsigned j = 0; j < passIds.size(); j++) {
+            long long threshold = sampleThresholds_[passEvents_[i][j]];
+            if(threshold)
+                papi_error = backend_->addSampledEvent(ts.eventSets[i], passIds[j], threshold, sampleOverflow);
+            else
+                papi_error = backend_->addEvent(ts.eventSets[i], passIds[j]);
+            if(papi_error != PW_OK) {
+                printf("Thread %d: Could not add event %s to event set%s\n", tid, eventNames_[passEvents_[i][j]],
+                    threshold ? " for sampling" : "");
+                if(verbose_debug_){
+                    printf("EventID 0x%X\n", passIds[j]);
+                    fflush(0);
+                }
+                if(scheduleCached_)
+                    printf("The pass schedule came from %s, remove its line if the machine or events changed\n",
+                        scheduleCache_);
                 papiPrintError(papi_error);
                 exit(-1);
             }
         }
     }
 
-    counting_ = false;
+    ts.runningPass = -1;
+    if(numPasses_)
+        switchThreadPass(tid, 0);
 }
 
+void PapiWrapper::releaseEventSets()
+{
+    // Sets belong to the threads that made them, so each thread stops and
+    // destroys its own, letting another wrapper be set up afterwards
+    if(!backend_ || !setup_ || !numPasses_)
+        return;
+    if(pwSnapshotter == this)
+        pwSnapshotter = NULL;
+    #pragma omp parallel num_threads(numThreads_)
+    {
+#ifdef _OPENMP
+        int tid = omp_get_thread_num();
+#else
+        int tid = 0;
+#endif
+        ThreadState& ts = threads_[tid];
+        if(ts.hasSnapshotTimer)
+            timer_delete(ts.snapshotTimer);
+        ts.hasSnapshotTimer = false;
+        if(ts.runningPass >= 0)
+            backend_->stop(ts.eventSets[ts.runningPass]);
+        ts.runningPass = -1;
+        for(unsigned i = 0; i < ts.eventSets.size(); i++)
+            if(ts.eventSets[i] != PW_NULL)
+                backend_->destroySet(&ts.eventSets[i]);
+    }
+    if(pwSampler == this)
+        pwSampler = NULL;
+}
 
+void PapiWrapper::switchThreadPass(int tid, int pass)
+{
+    // Only happens when a key's pass differs from the last one counted
+    ThreadState& ts = threads_[tid];
+    int papi_error;
+    if(ts.runningPass >= 0) {
+        papi_error = backend_->stop(ts.eventSets[ts.runningPass]);
+        if (papi_error != PW_OK){
+            printf("Thread %d: Could not stop counters\n", tid);
+            papiPrintError(papi_error);
+            exit(-1);
+        }
+    }
 
+    papi_error = backend_->start(ts.eventSets[pass]);
+    if (papi_error != PW_OK){
+        printf("Thread %d: Could not start counters\n", tid);
+        papiPrintError(papi_error);
+        exit(-1);
+    }
+    ts.runningPass = pass;
+}
 
+void PapiWrapper::startThreadCounters(int tid, int pass, int depth)
+{
+    if(!setup_){
+        printf("Must initialise PAPI before starting counters.\n");
+        fflush(0);
+        exit(1);
+    }
+
+    if(numEvents_){
+        ThreadState& ts = threads_[tid];
+        if(ts.runningPass != pass)
+            switchThreadPass(tid, pass);
+
+        int papi_error = backend_->read(ts.eventSets[pass], ts.startCounts.ptr() + depth*numEvents_);
+        if (papi_error != PW_OK){
+            printf("Thread %d: Could not read counters\n", tid);
+            papiPrintError(papi_error);
+            exit(-1);
+        }
+    }
+}
+
+void PapiWrapper::stopThreadCounters(int tid, int pass, int depth)
+{
+    if(numEvents_){
+        ThreadState& ts = threads_[tid];
+        long long* start = ts.startCounts.ptr() + depth*numEvents_;
+        long long* counts = ts.counters.ptr();
+        int papi_error = backend_->read(ts.eventSets[pass], counts);
+        if (papi_error != PW_OK){
+            printf("Thread %d: Could not read counters\n", tid);
+            papiPrintError(papi_error);
+            exit(-1);
+        }
+
+        for(unsigned i = 0; i < passIds_[pass].size(); i++)
+            counts[i] -= start[i];
+    }
+}
@@ -12,84 +12,399 @@
 #include <string.h>
 #include <string>
 #include <sys/time.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
 #ifdef _OPENMP
 	#include <omp.h>
 #endif
-#include <papi.h>
 
 #include "array_t.h"
+#include "counter_backend.h"
+#include "timer_source.h"
+#include "key_index.h"
+#include "derived_metric.h"
+#include "run_stats.h"
+#include "imbalance.h"
+#include "topology.h"
+#include "sample_profile.h"
+#include "timeline.h"
+#include "pass_schedule.h"
+#include "record_buffer.h"
+#include "trace_file.h"
 
+// Deepest nesting of regions on one thread
+#define PW_MAX_DEPTH 16
+
+// Per thread data written while recording is kept on separate lines of
+// this size, matching the 64 byte alignment Array_T allocates with
+#define PW_CACHE_LINE 64
+
+// Raised by the per thread snapshot timers
+#define PW_SNAPSHOT_SIGNAL (SIGRTMIN+4)
+
+// Counts and times for a record live in the PapiWrapper record arena,
+// indexed by record then thread, so a record itself is just its key, pass
+// and position in the region tree. Arena counts and times are inclusive
 class Record{
 public:
-	Record() {}
-	void Init(unsigned rID, unsigned nThreads, unsigned nEvents)
+	Record() { rID_ = 0; pass_ = 0; parent_ = -1; depth_ = 0; }
+	void Init(unsigned rID, unsigned pass, int parent, unsigned depth)
 	{
 		rID_ = rID;
-		recordedCounts_.resize(nThreads);
-		for(unsigned i = 0; i < nThreads; i++)
-			recordedCounts_[i].resize(nEvents);
-		time_.resize(nThreads);
+		pass_ = pass;
+		parent_ = parent;
+		depth_ = depth;
 	}
 	unsigned rID() const{ return rID_; }
-	Array_T<double>& time() { return time_; }
-	Array_T<double> const& time() const { return time_; }
-	Array_T< Array_T<long long> > const& recordedCounts_ref() const{ return recordedCounts_; }
+	unsigned pass() const{ return pass_; }
+	int parent() const{ return parent_; }
+	unsigned depth() const{ return depth_; }
 
-	Array_T< long long >& operator[] (unsigned loc) { return recordedCounts_[loc]; };
+private:
+	unsigned rID_;
+	unsigned pass_;
+	int parent_;
+	unsigned depth_;
+};
 
-	void operator= (Record const& input) {
-		rID_ = input.rID();
-		recordedCounts_ = input.recordedCounts_ref();
-		time_ = input.time();
+// Running statistics using Welford's online mean and variance, merged
+// across threads with Chan's parallel update
+struct RunningStat{
+	RunningStat() { n = 0; mean = 0; m2 = 0; min = 0; max = 0; }
+	void add(double x)
+	{
+		if(!n || x < min) min = x;
+		if(!n || x > max) max = x;
+		n++;
+		double delta = x - mean;
+		mean += delta/n;
+		m2 += delta*(x - mean);
 	}
-
-	void operator= (Record& input) {
-		rID_ = input.rID();
-		recordedCounts_ = input.recordedCounts_ref();
-		time_ = input.time();
+	void merge(RunningStat const& o)
+	{
+		if(!o.n) return;
+		if(!n) { *this = o; return; }
+		double delta = o.mean - mean;
+		unsigned long long total = n + o.n;
+		mean += delta*o.n/total;
+		m2 += o.m2 + delta*delta*((double)n*o.n/total);
+		if(o.min < min) min = o.min;
+		if(o.max > max) max = o.max;
+		n = total;
 	}
+	double variance() const { return n > 1 ? m2/(n-1) : 0; }
+	double stddev() const { return sqrt(variance()); }
+	unsigned long long n;
+	double mean;
+	double m2;
+	double min;
+	double max;
+};
 
-private:
-	unsigned rID_;
-	Array_T< Array_T<long long> > recordedCounts_;
-	Array_T<double> time_;
+// Per thread recording state, each thread only touches its own entry so
+// the in-region calls need no team synchronisation. Entries are padded to
+// whole cache lines so neighbouring threads do not false share
+struct __attribute__((aligned(PW_CACHE_LINE))) ThreadState{
+	ThreadState() { overheadTime = 0; depth = 0; nRecords = 0; pass = 0; runningPass = -1; streamActive = 0; streamUsed[0] = streamUsed[1] = 0; streamFull[0] = streamFull[1] = 0; streamDropped = 0; recordsDropped = 0; steps = 0; busy = 0; nRegions = 0; nSnapshots = 0; snapshotDue = 0; snapshotsDropped = 0; hasSnapshotTimer = false; }
+	// Records currently open on this thread, innermost last (key indices
+	// in aggregation mode)
+	Array_T<int> stack;
+	// Key index of each open region
+	Array_T<int> stackKeys;
+	Array_T<double> startTimes;
+	int depth;
+	unsigned nRecords;
+	// Signature of the records this thread opened, checked against thread
+	// 0's afterwards, and records dropped because the arena was full
+	unsigned long long steps;
+	unsigned long long recordsDropped;
+	// Pass chosen by the outermost open region, nested regions share it
+	int pass;
+	Array_T<unsigned> keys;
+	Array_T<unsigned> keyRuns;
+	KeyIndex keyIndex;
+	// This thread's event set for each pass, only runningPass is started
+	Array_T<int> eventSets;
+	int runningPass;
+	// Counter values at the start of each open region, PW_MAX_DEPTH x numEvents
+	Array_T<long long> startCounts;
+	// Counter deltas of the region being closed
+	Array_T<long long> counters;
+	// Aggregation mode statistics, per key then per event with time last
+	Array_T<RunningStat> keyStats;
+	// Calibrated empty region values, per event and for time
+	Array_T<long long> overheadCounts;
+	double overheadTime;
+	// Work set on each open region by this thread, and in aggregation mode
+	// the rates per key
+	Array_T<PwWork> work;
+	Array_T<PwWorkRates> keyWork;
+	// CPU the thread ran on at init()
+	PwCpuInfo cpu;
+	// Overflow samples, filled by this thread's handler and drained into
+	// samples when its outermost region closes
+	SampleRing sampleRing;
+	Array_T<PwSample> samples;
+	// Set while the thread is inside threadStart/StopRecording, where its
+	// region stack and counters are changing under the snapshot timer
+	volatile int busy;
+	// Serial number of each open region, counted per thread
+	Array_T<unsigned> serials;
+	unsigned nRegions;
+	// Snapshots of open regions, preallocated, with numEvents counts each
+	timer_t snapshotTimer;
+	bool hasSnapshotTimer;
+	Array_T<PwSnapshot> snapshots;
+	Array_T<long long> snapshotCounts;
+	Array_T<long long> snapshotRead;
+	volatile unsigned nSnapshots;
+	unsigned long long snapshotsDropped;
+	// Set by the timer when the backend cannot be read from a signal
+	// handler, the next region start or stop takes the snapshot
+	volatile int snapshotDue;
+	// Streaming mode, closed regions go into the active buffer while the
+	// writer thread drains the other one once it is marked full
+	Array_T<char> streamBuf[2];
+	unsigned streamUsed[2];
+	volatile int streamFull[2];
+	int streamActive;
+	unsigned long long streamDropped;
 };
 
 class PapiWrapper{
 public:
-	PapiWrapper() { setup_ = false; numEvents_ = 0; numThreads_ = 1; debug_ = false; verbose_debug_ = false; counting_=false; timeOnly_ = false; currentRecord_ = -1;}
-	~PapiWrapper() {}
+	PapiWrapper() { setup_ = false; numEvents_ = 0; numThreads_ = 1; debug_ = false; verbose_debug_ = false; depth_ = 0; timeOnly_ = false; numPasses_ = 1; aggregate_ = false; countStride_ = 0; timeStride_ = 0; traceFd_ = -1; traceName_ = NULL; trace_ = NULL; traceSize_ = 0; streaming_ = false; streamBufferSize_ = 0; streamStop_ = 0; traceUsed_ = 0; backend_ = NULL; backendName_ = NULL; subtractOverhead_ = false; forkOverhead_ = 0; outlierThreshold_ = 0; metricsSpec_ = NULL; sampleSpec_ = NULL; sampling_ = false; snapshotInterval_ = 0; snapshots_ = false; scheduleCache_ = NULL; scheduleCached_ = false;}
+	~PapiWrapper() { closeTrace(); releaseEventSets(); delete backend_; free(traceName_); free(backendName_); free(metricsSpec_); free(sampleSpec_); free(scheduleCache_); }
 
 	void init();
 	void setDebug(bool);
+	// Counter backend, "papi", "perf" or "mock" (see counter_backend.h),
+	// PAPI_BACKEND does the same. Call before init()
+	void setBackend(const char*);
 	void setVerboseDebug(bool);
-	void startRecording(unsigned);
+	// Keep running per key statistics instead of every record
+	void setAggregate(bool);
+	// Subtract the overhead calibrated in init() from every region,
+	// PAPI_SUBTRACT_OVERHEAD does the same
+	void setSubtractOverhead(bool);
+	// Reject runs whose modified z-score (distance from the median in MADs)
+	// is over threshold from the run statistics, 0 keeps every run.
+	// PAPI_OUTLIER_MAD does the same, set without a value it uses 3.5
+	void setOutlierRejection(double threshold);
+	// Derived metrics, "NAME=expression|NAME=expression" over event names
+	// and TIME (see derived_metric.h), PAPI_METRICS does the same. Call
+	// before init()
+	void setMetrics(const char*);
+	// Overflow sampling, "EVENT@threshold|EVENT@threshold" over events in
+	// PAPI_EVENTS: every threshold counts of the event the thread notes the
+	// instruction it was at and its innermost open region. PAPI_SAMPLE does
+	// the same, call before init()
+	void setSampling(const char*);
+	// Snapshot the counters of open regions every interval seconds, for a
+	// timeline of each long region. PAPI_SNAPSHOT does the same with the
+	// interval in milliseconds, call before init(). Only backends that can
+	// be read from a signal handler (perf, mock) snapshot inside a region, with
+	// PAPI the snapshot waits for the thread's next region start or stop
+	void setSnapshots(double interval);
+	// File caching the pass schedule probed for each machine and event
+	// list, "off" probes every run. PAPI_SCHEDULE_CACHE does the same, the
+	// default is ~/.papi_wrapper_passes. Call before init()
+	void setScheduleCache(const char*);
+	// Append every record to a binary trace file as it completes (see
+	// trace_file.h), PAPI_TRACE_FILE does the same. Call before init()
+	void setTraceFile(const char*);
+	// Write records to the trace file from a background thread instead of
+	// keeping them, PAPI_STREAM does the same. Needs a trace file, call
+	// before init()
+	void setStreaming(bool);
+	// Truncate the trace to the records written and close it, also done
+	// on destruction
+	void closeTrace();
+	// Keys are plain integers or PW_REGION("name") hashes, the optional
+	// name labels the key in reports (see PW_NAMED)
+	void startRecording(unsigned, const char* name = NULL);
 	void stopRecording();
+	// Called by every thread from inside an existing parallel region,
+	// no team is forked and no barrier is added. Every thread of the team
+	// opens the same regions in the same order, so not
+	// from omp single, sections or master, nor from nested parallel regions.
+	// Regions opened when the arena is full are not recorded
+	void threadStartRecording(unsigned, const char* name = NULL);
+	void threadStopRecording();
+	// Records dropped because the arena filled inside a parallel region
+	// (see reserveRecords()), reports warn about them too
+	unsigned long long droppedRecords() const;
+	// False if some thread opened regions out of step with thread 0, e.g.
+	// inside omp single or from teams of different sizes, so its counts
+	// are in the wrong records. Call outside of any recording
+	bool recordsInStep();
+	// Work done by the innermost open region over the whole team, for GB/s
+	// and GFLOP/s in the reports. Call between start and stop, from one
+	// thread of the team (e.g. under omp master) for in-region records
+	void setWork(double bytesRead, double bytesWritten, double flops);
 	void printRecord(unsigned);
 	void printAllRecords();
 	void multiRunPrintAverageRecords();
+	void printAggregates();
+	// Per key spread of time and counts over the threads: max/mean ratios,
+	// slowest and fastest threads, a histogram and the thread time lost
+	// waiting for the slowest thread
+	void printImbalance();
+	// Per key means summed per physical core, shared L2 and NUMA node, from
+	// the CPU each thread was on at init()
+	void printTopology();
+	// Per key histograms of the samples by function and by address
+	void printSamples();
+	// PAPI_SAMPLE or setSampling() asked for overflow samples
+	bool samplingEnabled() const { return sampling_; }
+	// Sample counts per key, event and address with the module and offset
+	// addr2line needs, for pw_symbolize.sh. NULL uses PAPI_SAMPLE_FILE
+	void writeSamples(const char* path = NULL);
+	// Per key team event rates and metrics against time since the region
+	// started, from the snapshots
+	void printTimeline();
+	// PAPI_SNAPSHOT or setSnapshots() asked for snapshots
+	bool snapshotsEnabled() const { return snapshots_; }
+	void reserveRecords(unsigned);
+	// Pack every record into one flat buffer of packedSize() bytes (see
+	// record_buffer.h) for copying off the device and decoding on the host
+	unsigned long long packedSize();
+	void packRecords(void*);
+	int numPasses() const { return numPasses_; }
+	// Snapshots are on but the backend is only read at region starts and
+	// stops (PAPI), so a timeline needs regions nested in each long region
+	bool snapshotsNeedRegions() const { return snapshots_ && !backend_->readsInSignals(); }
+	// Bytes held for records, keys and per thread recording state
+	unsigned long long memoryUsed() const;
 
 private:
-	void startCounters();
-	void stopCounters();
+	void buildPasses(int);
+	void setupRecording();
+	void calibrateOverhead();
+	double overheadMean(unsigned);
+	void printOverhead();
+	void recordThreadCpus();
+	void keyThreadMeans(PwThreadMeans&);
+	void compileMetrics();
+	void setupSampling();
+	void collectSamples(Array_T<PwSample>&, unsigned long long&);
+	static void sampleOverflow(int, void*, int);
+	void setupSnapshots();
+	void takeSnapshot(ThreadState&, int, double, const long long*);
+	static void snapshotSignal(int, siginfo_t*, void*);
+	void metricValues(const long long*, int, double, double*);
+	void openTrace();
+	char* traceAppend(unsigned, unsigned);
+	void growTrace(unsigned long long);
+	void appendTraceKey(ThreadState&, unsigned);
+	unsigned outOfStepThreads();
+	void printRecordWarnings();
+	void appendTraceRecord(unsigned);
+	void writeTraceHeader(char*, unsigned long long, unsigned long long);
+	void openStream();
+	char* streamReserve(ThreadState&, unsigned);
+	void streamRecord(int, int, double);
+	void drainStreams(bool);
+	static void* streamWriter(void*);
+	long long* recordCounts(unsigned rec, unsigned tid) { return counts_.ptr() + tid*countStride_ + (size_t)rec*numEvents_; }
+	double& recordTime(unsigned rec, unsigned tid) { return times_.ptr()[tid*timeStride_ + rec]; }
+	bool hasChildren(unsigned);
+	void exclusiveCounts(unsigned, unsigned, long long*, double&);
+	void runValues(unsigned, PwRunValues&);
+	void printRecordAt(unsigned);
+	void printKeyLabel(unsigned);
+	void printTimerInfo();
+	void addThreadKeyStats(ThreadState&);
+	void createThreadEventSets(int);
+	void releaseEventSets();
+	void switchThreadPass(int, int);
+	void startThreadCounters(int, int, int);
+	void stopThreadCounters(int, int, int);
 	void papiPrintError(int);
 
+	// Record arena, preallocated so recording does not allocate or copy.
+	// Counts and times are thread-major, one cache line padded slab per thread
 	Array_T<Record> records_;
+	Array_T<long long> counts_;
 	Array_T<double> times_;
+	size_t countStride_;
+	size_t timeStride_;
+	// Threads that have closed each record, the last of its team appends it
+	// to the trace
+	Array_T<int> closed_;
+	// Team size and thread 0's signature after each record, set by thread
+	// 0 when it opens the record
+	Array_T<int> teams_;
+	Array_T<unsigned long long> steps_;
+	// Work annotation of each record
+	Array_T<PwWork> work_;
+	// Trace file mapped while recording, bytesUsed in its header marks the end
+	char* traceName_;
+	int traceFd_;
+	char* trace_;
+	unsigned long long traceSize_;
+	// Streaming mode keeps no records, the trace is written with write()
+	// by streamThread_, woken through streamSem_ when a buffer fills
+	bool streaming_;
+	unsigned streamBufferSize_;
+	pthread_t streamThread_;
+	sem_t streamSem_;
+	volatile int streamStop_;
+	unsigned long long traceUsed_;
 	Array_T<char*> eventNames_;
 	Array_T<int> eventIds_;
-	Array_T< Array_T<long long> > counters_;
-    Array_T<double> sTime_;
     Array_T<unsigned> uniqueKeys_;
-	int currentRecord_;
+	Array_T<const char*> keyNames_;
+	KeyIndex keyIndex_;
+	Array_T<ThreadState> threads_;
+	// Events split into passes that fit the hardware counters together,
+	// one pass is counted per repeat of a key
+	Array_T< Array_T<int> > passEvents_;
+	Array_T< Array_T<int> > passIds_;
+	Array_T<int> eventPass_;
+	// Where the schedule is cached, and whether it was read from there
+	char* scheduleCache_;
+	bool scheduleCached_;
+	CounterBackend* backend_;
+	TimerSource timer_;
+	// Empty region statistics per thread, numEvents_ events then time
+	Array_T<RunningStat> overhead_;
+	double forkOverhead_;
+	bool subtractOverhead_;
+	double outlierThreshold_;
+	// Derived metrics compiled in init()
+	char* metricsSpec_;
+	Array_T<DerivedMetric> metrics_;
+	// Sampling threshold per event, 0 for events not sampled
+	char* sampleSpec_;
+	Array_T<long long> sampleThresholds_;
+	bool sampling_;
+	double snapshotInterval_;
+	bool snapshots_;
+	char* backendName_;
 	bool setup_;
 	bool debug_;
 	bool verbose_debug_;
-	bool counting_;
 	bool timeOnly_;
+	bool aggregate_;
 	int numThreads_;
 	int numEvents_;
-    int eventSet_;
+	int numPasses_;
+	int depth_;
+};
+
+// Scoped in-region recording, declare it at the top of a parallel region
+// body that holds an omp for and the record closes at the end of the block
+class ThreadRecording{
+public:
+	ThreadRecording(PapiWrapper& pw, unsigned key) : pw_(pw) { pw_.threadStartRecording(key); }
+	~ThreadRecording() { pw_.threadStopRecording(); }
+
+private:
+	PapiWrapper& pw_;
 };
 
 #endif
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_PASS_SCHEDULE_H
+#define MIC_PASS_SCHEDULE_H
+
+// Packs events into the fewest passes whose events can be counted
+// together. Which events fit together is only known by asking the backend
+// (some MIC events are tied to one counter), so the scheduler probes
+// scratch event sets:
+//   - every pair, giving a conflict graph
+//   - first fit with the most conflicted events first
+//   - for up to PW_EXACT_EVENTS events, when first fit is above the lower
+//     bound (largest clique of conflicts, or events over counters), a
+//     branch and bound search over assignments, remembering every set probed
+//
+// Schedules can be cached in a text file, one line per machine signature
+// and event list, so later runs skip the probing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array_t.h"
+#include "counter_backend.h"
+
+// Largest event list searched exactly, probe results are kept per subset
+#define PW_EXACT_EVENTS     12
+// Search steps before settling for the best schedule found
+#define PW_SCHEDULE_STEPS   100000
+#define PW_SIGNATURE_LEN    256
+
+class PassScheduler{
+public:
+	PassScheduler(CounterBackend* backend, const int* codes, unsigned numEvents, unsigned numCounters) {
+		backend_ = backend;
+		codes_ = codes;
+		n_ = numEvents;
+		numCounters_ = numCounters;
+		probes_ = 0;
+		error_ = PW_OK;
+	}
+
+	// Pass of every event, returns the number of passes. Returns -1 with
+	// failed set to the event when one cannot be counted even on its own
+	int schedule(Array_T<int>& eventPass, int& failed) {
+		eventPass.resize(n_);
+		failed = -1;
+		if(!n_)
+			return 0;
+
+		// Events that cannot be counted at all, then conflicting pairs
+		for(unsigned i = 0; i < n_; i++) {
+			int one[1] = { (int)i };
+			if(!probe(one, 1)) {
+				failed = i;
+				return -1;
+			}
+		}
+		conflict_.resize(n_*n_);
+		conflict_.fill(0);
+		Array_T<unsigned> degree;
+		degree.resize(n_);
+		degree.fill(0);
+		for(unsigned i = 0; i < n_; i++) {
+			for(unsigned j = i+1; j < n_; j++) {
+				int pair[2] = { (int)i, (int)j };
+				if(numCounters_ < 2 || !probe(pair, 2)) {
+					conflict_[i*n_ + j] = conflict_[j*n_ + i] = 1;
+					degree[i]++;
+					degree[j]++;
+				}
+			}
+		}
+
+		// Most conflicted first, ties in the order given
+		order_.resize(n_);
+		for(unsigned i = 0; i < n_; i++)
+			order_[i] = i;
+		for(unsigned i = 1; i < n_; i++) {
+			unsigned e = order_[i], k = i;
+			while(k > 0 && degree[order_[k-1]] < degree[e]) {
+				order_[k] = order_[k-1];
+				k--;
+			}
+			order_[k] = e;
+		}
+
+		unsigned passes = firstFit(eventPass);
+		unsigned bound = lowerBound();
+		if(passes > bound && n_ <= PW_EXACT_EVENTS) {
+			Array_T<int> best;
+			unsigned exact = exactSearch(passes, bound, best);
+			if(exact < passes) {
+				passes = exact;
+				eventPass = best;
+			}
+		}
+		renumber(eventPass, passes);
+		return passes;
+	}
+
+	// Event sets probed, and the backend's answer to the last one refused
+	unsigned probes() const { return probes_; }
+	int error() const { return error_; }
+	unsigned lowerBound() const {
+		unsigned bound = (n_ + numCounters_ - 1)/numCounters_;
+		unsigned clique = largestClique();
+		return clique > bound ? clique : bound;
+	}
+
+private:
+	// Whether the events can be counted together, on a scratch set
+	bool probe(const int* events, unsigned n) {
+		if(n > numCounters_)
+			return false;
+		probes_++;
+		int set = PW_NULL;
+		int err = backend_->createSet(&set);
+		if(err != PW_OK) {
+			error_ = err;
+			return false;
+		}
+		bool ok = true;
+		for(unsigned i = 0; i < n && ok; i++) {
+			err = backend_->addEvent(set, codes_[events[i]]);
+			if(err != PW_OK) {
+				error_ = err;
+				ok = false;
+			}
+		}
+		backend_->destroySet(&set);
+		return ok;
+	}
+
+	bool conflicts(unsigned e, const Array_T<int>& events) const {
+		for(unsigned i = 0; i < events.size(); i++)
+			if(conflict_[e*n_ + events[i]])
+				return true;
+		return false;
+	}
+
+	// Greedy clique in the conflict graph, its events need a pass each
+	unsigned largestClique() const {
+		Array_T<int> clique;
+		for(unsigned i = 0; i < order_.size(); i++) {
+			unsigned e = order_[i];
+			bool all = true;
+			for(unsigned j = 0; j < clique.size() && all; j++)
+				all = conflict_[e*n_ + clique[j]] != 0;
+			if(all)
+				clique.push_back(e);
+		}
+		return clique.size();
+	}
+
+	// Each event goes into the first pass it can join, one set per pass is
+	// kept open and grown, as adding to it is what is being asked
+	unsigned firstFit(Array_T<int>& eventPass) {
+		Array_T< Array_T<int> > passes;
+		Array_T<int> sets;
+		for(unsigned i = 0; i < n_; i++) {
+			int e = order_[i];
+			int pass = -1;
+			for(unsigned p = 0; p < passes.size() && pass < 0; p++) {
+				if(passes[p].size() >= numCounters_ || conflicts(e, passes[p]))
+					continue;
+				probes_++;
+				if(backend_->addEvent(sets[p], codes_[e]) == PW_OK)
+					pass = p;
+			}
+			if(pass < 0) {
+				int set = PW_NULL;
+				if(backend_->createSet(&set) != PW_OK || backend_->addEvent(set, codes_[e]) != PW_OK) {
+					// Counted alone in the probe, so only resources ran out
+					for(unsigned p = 0; p < sets.size(); p++)
+						backend_->destroySet(&sets[p]);
+					if(set != PW_NULL)
+						backend_->destroySet(&set);
+					return oneEach(eventPass);
+				}
+				pass = passes.size();
+				passes.push_back(Array_T<int>());
+				sets.push_back(set);
+			}
+			passes[pass].push_back(e);
+			eventPass[e] = pass;
+		}
+		for(unsigned p = 0; p < sets.size(); p++)
+			backend_->destroySet(&sets[p]);
+		return passes.size();
+	}
+
+	unsigned oneEach(Array_T<int>& eventPass) {
+		for(unsigned i = 0; i < n_; i++)
+			eventPass[i] = i;
+		return n_;
+	}
+
+	// Probe results by subset of events: 0 not probed, 1 fits, 2 does not
+	bool fits(unsigned mask) {
+		if(known_[mask])
+			return known_[mask] == 1;
+		int events[PW_EXACT_EVENTS];
+		unsigned n = 0;
+		for(unsigned e = 0; e < n_; e++)
+			if(mask & (1u << e))
+				events[n++] = e;
+		bool ok = probe(events, n);
+		known_[mask] = ok ? 1 : 2;
+		return ok;
+	}
+
+	unsigned exactSearch(unsigned upper, unsigned bound, Array_T<int>& best) {
+		known_.resize(1u << n_);
+		known_.fill(0);
+		masks_.resize(n_);
+		masks_.fill(0);
+		best_ = upper;
+		bound_ = bound;
+		steps_ = 0;
+		bestPass_.resize(0);
+		search(0, 0);
+		best = bestPass_;
+		return bestPass_.size() ? best_ : upper;
+	}
+
+	// Events order_[k..] still to place, passes 0..used-1 are open. A new
+	// pass is only ever the next one, which removes symmetric schedules
+	void search(unsigned k, unsigned used) {
+		if(used >= best_ || best_ == bound_ || ++steps_ > PW_SCHEDULE_STEPS)
+			return;
+		if(k == n_) {
+			best_ = used;
+			bestPass_.resize(n_);
+			for(unsigned p = 0; p < used; p++)
+				for(unsigned e = 0; e < n_; e++)
+					if(masks_[p] & (1u << e))
+						bestPass_[e] = p;
+			return;
+		}
+		unsigned e = order_[k];
+		for(unsigned p = 0; p < used; p++) {
+			unsigned mask = masks_[p] | (1u << e);
+			bool clash = false;
+			for(unsigned j = 0; j < n_ && !clash; j++)
+				clash = (masks_[p] & (1u << j)) && conflict_[e*n_ + j];
+			if(clash || !fits(mask))
+				continue;
+			masks_[p] = mask;
+			search(k+1, used);
+			masks_[p] &= ~(1u << e);
+		}
+		if(used+1 < best_) {
+			masks_[used] = 1u << e;
+			search(k+1, used+1);
+			masks_[used] = 0;
+		}
+	}
+
+	// Passes numbered by their first event, so a schedule reads in the
+	// order events were given
+	void renumber(Array_T<int>& eventPass, unsigned passes) {
+		Array_T<int> map;
+		map.resize(passes);
+		map.fill(-1);
+		int next = 0;
+		for(unsigned e = 0; e < n_; e++) {
+			if(map[eventPass[e]] < 0)
+				map[eventPass[e]] = next++;
+			eventPass[e] = map[eventPass[e]];
+		}
+	}
+
+	CounterBackend* backend_;
+	const int* codes_;
+	unsigned n_;
+	unsigned numCounters_;
+	unsigned probes_;
+	int error_;
+	Array_T<char> conflict_;
+	Array_T<unsigned> order_;
+	// Exact search state
+	Array_T<char> known_;
+	Array_T<unsigned> masks_;
+	Array_T<int> bestPass_;
+	unsigned best_;
+	unsigned bound_;
+	unsigned steps_;
+};
+
+// Identifies the machine and backend a schedule was probed on: backend
+// name, counters and the CPU from /proc/cpuinfo. Nodes of one model share
+// the signature, so a cache in a shared home directory serves them all
+inline void pwScheduleSignature(const char* backend, unsigned numCounters, char* out, size_t len)
+{
+	char vendor[64] = "", family[16] = "", model[16] = "", modelName[128] = "";
+	FILE* f = fopen("/proc/cpuinfo", "r");
+	if(f != NULL) {
+		char line[256];
+		while(fgets(line, sizeof(line), f) != NULL) {
+			char* colon = strchr(line, ':');
+			if(colon == NULL)
+				continue;
+			char* value = colon + 1;
+			while(*value == ' ')
+				value++;
+			value[strcspn(value, "\n")] = 0;
+			if(!vendor[0] && !strncmp(line, "vendor_id", 9))
+				snprintf(vendor, sizeof(vendor), "%s", value);
+			else if(!family[0] && !strncmp(line, "cpu family", 10))
+				snprintf(family, sizeof(family), "%s", value);
+			else if(!model[0] && !strncmp(line, "model\t", 6))
+				snprintf(model, sizeof(model), "%s", value);
+			else if(!modelName[0] && !strncmp(line, "model name", 10))
+				snprintf(modelName, sizeof(modelName), "%s", value);
+		}
+		fclose(f);
+	}
+	snprintf(out, len, "%s/%u/%s %s %s %s", backend, numCounters, vendor, family, model, modelName);
+	// Tabs separate the fields of the cache file
+	for(char* c = out; *c; c++)
+		if(*c == '\t')
+			*c = ' ';
+}
+
+// Cache lines are "signature<tab>EVENT|EVENT|...<tab>pass,pass,...". The
+// last matching line wins. Returns the number of passes, or -1 when there
+// is no usable entry
+inline int pwLoadSchedule(const char* path, const char* signature, const char* events, unsigned numEvents, Array_T<int>& eventPass)
+{
+	FILE* f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	int found = -1;
+	char* line = NULL;
+	size_t cap = 0;
+	while(getline(&line, &cap, f) > 0) {
+		line[strcspn(line, "\n")] = 0;
+		char* tab1 = strchr(line, '\t');
+		char* tab2 = tab1 ? strchr(tab1+1, '\t') : NULL;
+		if(tab2 == NULL)
+			continue;
+		*tab1 = *tab2 = 0;
+		if(strcmp(line, signature) || strcmp(tab1+1, events))
+			continue;
+
+		// Passes must be numbered 0 up without gaps
+		Array_T<int> passes;
+		int most = -1;
+		bool ok = true;
+		char* p = tab2+1;
+		while(*p && ok) {
+			char* end;
+			long pass = strtol(p, &end, 10);
+			ok = end != p && pass >= 0 && pass <= most+1;
+			if(pass > most)
+				most = pass;
+			passes.push_back(pass);
+			p = *end == ',' ? end+1 : end;
+			ok = ok && (*end == ',' || *end == 0);
+		}
+		if(ok && passes.size() == numEvents) {
+			eventPass = passes;
+			found = most+1;
+		}
+	}
+	free(line);
+	fclose(f);
+	return found;
+}
+
+inline bool pwSaveSchedule(const char* path, const char* signature, const char* events, const Array_T<int>& eventPass)
+{
+	FILE* f = fopen(path, "a");
+	if(f == NULL)
+		return false;
+	// Buffered until fclose, so the line goes out in one append and runs
+	// saving at once do not interleave within a line
+	setvbuf(f, NULL, _IOFBF, 1 << 16);
+	fprintf(f, "%s\t%s\t", signature, events);
+	for(unsigned i = 0; i < eventPass.size(); i++)
+		fprintf(f, i ? ",%d" : "%d", eventPass[i]);
+	fprintf(f, "\n");
+	return fclose(f) == 0;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_POOL_ALLOCATOR_H
+#define MIC_POOL_ALLOCATOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Every block is 64 byte aligned, its first 64 bytes hold the header
+#define PW_POOL_ALIGN       64
+// Block classes are 64 bytes << class, up to 1MB; bigger requests get a
+// mapping of their own
+#define PW_POOL_CLASSES     15
+// Huge page size on MIC and x86-64, mappings are made in multiples of it
+#define PW_POOL_HUGE_PAGE   (2ul << 20)
+// Small blocks are carved out of chunks of this size
+#define PW_POOL_CHUNK       (4ul << 20)
+
+#ifndef MPOL_BIND
+	#define MPOL_BIND 2
+#endif
+
+struct PoolBlockHeader{
+	// Mapping size for blocks with their own mapping, 0 for pooled blocks
+	size_t mapped;
+	int cls;
+	int huge;
+	char pad[PW_POOL_ALIGN - sizeof(size_t) - 2*sizeof(int)];
+};
+
+// Shared state of one PoolAllocator instantiation
+struct PoolState{
+	void* freeList[PW_POOL_CLASSES];
+	char* chunk;
+	size_t chunkLeft;
+	volatile int lock;
+	unsigned long long bytesMapped;
+	unsigned long long hugeMapped;
+	unsigned long long blocksReused;
+};
+
+// Pool allocator for Array_T (Array_T<T, PoolAllocator<> >) and large
+// buffers such as the STREAM arrays. Memory is mapped with MAP_HUGETLB,
+// falling back to transparent huge pages through madvise when no huge pages
+// are reserved, and is bound to NUMA node Node when Node >= 0 (or to the
+// node in PW_NUMA_NODE). Freed blocks of up to 1MB go back on a free list
+// for their size class and are handed out again, larger ones are unmapped
+template<int Node = -1, bool Huge = true>
+struct PoolAllocator{
+	static void* allocate(size_t bytes) {
+		size_t need = bytes + sizeof(PoolBlockHeader);
+		int cls = 0;
+		while(cls < PW_POOL_CLASSES && ((size_t)PW_POOL_ALIGN << cls) < need)
+			cls++;
+
+		PoolBlockHeader* h;
+		if(cls == PW_POOL_CLASSES) {
+			size_t mapped = (need + PW_POOL_HUGE_PAGE - 1)/PW_POOL_HUGE_PAGE*PW_POOL_HUGE_PAGE;
+			bool huge;
+			h = (PoolBlockHeader*)map(mapped, huge);
+			if(h == NULL)
+				return NULL;
+			h->mapped = mapped;
+			h->huge = huge;
+		}
+		else {
+			lock();
+			h = (PoolBlockHeader*)state_.freeList[cls];
+			if(h != NULL) {
+				state_.freeList[cls] = *(void**)h;
+				state_.blocksReused++;
+			}
+			else
+				h = (PoolBlockHeader*)carve((size_t)PW_POOL_ALIGN << cls);
+			unlock();
+			if(h == NULL)
+				return NULL;
+			h->mapped = 0;
+			h->huge = 0;
+		}
+		h->cls = cls;
+		return h + 1;
+	}
+
+	static void deallocate(void* ptr) {
+		if(ptr == NULL)
+			return;
+		PoolBlockHeader* h = (PoolBlockHeader*)ptr - 1;
+		if(h->mapped) {
+			account(-(long long)h->mapped, h->huge);
+			munmap(h, h->mapped);
+			return;
+		}
+		lock();
+		*(void**)h = state_.freeList[h->cls];
+		state_.freeList[h->cls] = h;
+		unlock();
+	}
+
+	static void printStats() {
+		printf("Pool allocator: %llu bytes mapped, %llu on huge pages, %llu blocks reused\n",
+			state_.bytesMapped, state_.hugeMapped, state_.blocksReused);
+		fflush(0);
+	}
+
+private:
+	static void lock() {
+		while(__sync_lock_test_and_set(&state_.lock, 1))
+			while(state_.lock)
+				;
+	}
+	static void unlock() { __sync_lock_release(&state_.lock); }
+
+	// Next block from the current chunk, called with the lock held. The rest
+	// of a chunk too small for the block is left unused
+	static void* carve(size_t block) {
+		if(state_.chunkLeft < block) {
+			size_t size = block > PW_POOL_CHUNK ? block : PW_POOL_CHUNK;
+			bool huge;
+			state_.chunk = (char*)map(size, huge);
+			if(state_.chunk == NULL) {
+				state_.chunkLeft = 0;
+				return NULL;
+			}
+			state_.chunkLeft = size;
+		}
+		void* p = state_.chunk;
+		state_.chunk += block;
+		state_.chunkLeft -= block;
+		return p;
+	}
+
+	// Multiple of PW_POOL_HUGE_PAGE bytes, huge page aligned
+	static void* map(size_t bytes, bool& huge) {
+		void* p = MAP_FAILED;
+		huge = false;
+#ifdef MAP_HUGETLB
+		if(Huge) {
+			p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			huge = (p != MAP_FAILED);
+		}
+#endif
+		if(p == MAP_FAILED) {
+			// Over map so the start can be moved to a huge page boundary, which
+			// transparent huge pages need
+			size_t over = Huge ? bytes + PW_POOL_HUGE_PAGE : bytes;
+			char* raw = (char*)mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(raw == (char*)MAP_FAILED) {
+				printf("Error: pool allocator could not map %lu bytes\n", (unsigned long)bytes);
+				fflush(0);
+				return NULL;
+			}
+			char* start = raw;
+			if(Huge) {
+				start = (char*)(((size_t)raw + PW_POOL_HUGE_PAGE - 1) & ~(PW_POOL_HUGE_PAGE - 1));
+				if(start > raw)
+					munmap(raw, start - raw);
+				if(raw + over > start + bytes)
+					munmap(start + bytes, raw + over - (start + bytes));
+#ifdef MADV_HUGEPAGE
+				huge = (madvise(start, bytes, MADV_HUGEPAGE) == 0);
+#endif
+			}
+			p = start;
+		}
+
+		bind(p, bytes);
+		account(bytes, huge);
+		return p;
+	}
+
+	// Mappings are made with or without the lock held, so the counters are
+	// only updated through atomics
+	static void account(long long bytes, bool huge) {
+		__sync_fetch_and_add(&state_.bytesMapped, (unsigned long long)bytes);
+		if(huge)
+			__sync_fetch_and_add(&state_.hugeMapped, (unsigned long long)bytes);
+	}
+
+	// Pages are placed on first touch, so binding before use is enough
+	static void bind(void* p, size_t bytes) {
+		int node = Node;
+		if(node < 0 && getenv("PW_NUMA_NODE") != NULL)
+			node = atoi(getenv("PW_NUMA_NODE"));
+#ifdef SYS_mbind
+		if(node >= 0 && node < (int)(8*sizeof(unsigned long))) {
+			unsigned long mask = 1ul << node;
+			if(syscall(SYS_mbind, p, bytes, MPOL_BIND, &mask, 8*sizeof(mask), 0) != 0) {
+				printf("Warning: pool allocator could not bind memory to NUMA node %d\n", node);
+				fflush(0);
+			}
+		}
+#endif
+	}
+
+	static PoolState state_;
+};
+
+template<int Node, bool Huge>
+PoolState PoolAllocator<Node, Huge>::state_ = PoolState();
+
+#endif
@@ -1,2 +1,3 @@
 #!/bin/bash
 export MIC_PAPI_EVENTS="VPU_INSTRUCTIONS_EXECUTED|VPU_ELEMENTS_ACTIVE"
+export MIC_PAPI_METRICS="VI=VPU_ELEMENTS_ACTIVE/VPU_INSTRUCTIONS_EXECUTED"
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//---------------------------------------------------------------
+// Offline converter for PapiWrapper binary trace files
+//
+// Usage: ./pw_convert <trace file> [csv|json]
+//
+// CSV has one row per record per thread, JSON one object per record with
+// per thread arrays (one object per record per thread for streamed traces).
+// Output goes to stdout.
+//---------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "array_t.h"
+#include "key_index.h"
+#include "trace_file.h"
+
+struct TraceKeys{
+	KeyIndex index;
+	Array_T<PwBufferKey const*> keys;
+};
+
+static const char* keyName(TraceKeys& k, unsigned key)
+{
+	int idx = k.index.find(key);
+	return idx >= 0 ? k.keys[idx]->name : "";
+}
+
+static void printJsonString(const char* s)
+{
+	putchar('"');
+	for(; *s; s++) {
+		if(*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 2) {
+		printf("Usage: %s <trace file> [csv|json]\n", argv[0]);
+		return 1;
+	}
+	bool json = (argc > 2 && !strcmp(argv[2], "json"));
+
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PwTraceHeader)) {
+		fprintf(stderr, "Cannot read trace file %s\n", argv[1]);
+		return 1;
+	}
+	char* file = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(file == MAP_FAILED) {
+		fprintf(stderr, "Cannot map trace file %s\n", argv[1]);
+		return 1;
+	}
+
+	PwTraceHeader const* h = (PwTraceHeader const*)file;
+	if(h->magic != PW_TRACE_MAGIC || h->version != PW_TRACE_VERSION) {
+		fprintf(stderr, "%s is not a version %d trace file\n", argv[1], PW_TRACE_VERSION);
+		return 1;
+	}
+	unsigned long long end = h->bytesUsed < (unsigned long long)st.st_size ? h->bytesUsed : st.st_size;
+	unsigned nT = h->numThreads, nE = h->numEvents;
+	PwBufferEvent const* events = (PwBufferEvent const*)(file + h->eventsOffset);
+
+	// Events of each pass in pass order, as the record columns are stored
+	Array_T<int> passStart;
+	Array_T<int> passEvents;
+	passStart.resize(h->numPasses+1);
+	passStart.fill(0);
+	passEvents.resize(nE);
+	for(unsigned e = 0; e < nE; e++)
+		passStart[events[e].pass+1]++;
+	for(unsigned p = 0; p < h->numPasses; p++)
+		passStart[p+1] += passStart[p];
+	Array_T<int> fillPos;
+	fillPos = passStart;
+	for(unsigned e = 0; e < nE; e++)
+		passEvents[fillPos[events[e].pass]++] = e;
+
+	TraceKeys keys;
+	Array_T<long long const*> columns;
+	columns.resize(nE);
+
+	if(json) {
+		printf("{\"threads\":%u,\"events\":[", nT);
+		for(unsigned e = 0; e < nE; e++) {
+			if(e) putchar(',');
+			printJsonString(events[e].name);
+		}
+		printf("],\"records\":[\n");
+	}
+	else {
+		printf("record,key,name,parent,depth,pass,thread,time");
+		for(unsigned e = 0; e < nE; e++)
+			printf(",%s", events[e].name);
+		printf("\n");
+	}
+
+	// Streamed traces interleave threads, so collect every key name first
+	for(unsigned long long off = h->dataOffset; off + sizeof(PwTraceBlock) <= end; ) {
+		PwTraceBlock const* b = (PwTraceBlock const*)(file + off);
+		if(b->bytes < sizeof(PwTraceBlock) || off + b->bytes > end)
+			break;
+		if(b->type == PW_TRACE_KEY) {
+			PwBufferKey const* k = (PwBufferKey const*)(b+1);
+			if(keys.index.find(k->key) < 0) {
+				keys.index.insert(k->key, keys.keys.size());
+				keys.keys.push_back(k);
+			}
+		}
+		off += b->bytes;
+	}
+
+	bool first = true;
+	for(unsigned long long off = h->dataOffset; off + sizeof(PwTraceBlock) <= end; ) {
+		PwTraceBlock const* b = (PwTraceBlock const*)(file + off);
+		if(b->bytes < sizeof(PwTraceBlock) || off + b->bytes > end)
+			break;
+
+		if(b->type == PW_TRACE_THREAD_RECORD) {
+			PwTraceThreadRecord const* r = (PwTraceThreadRecord const*)(b+1);
+			long long const* counts = (long long const*)(r+1);
+			for(unsigned e = 0; e < nE; e++)
+				columns[e] = NULL;
+			for(unsigned c = 0; c < r->nCounts && r->pass < h->numPasses; c++)
+				columns[passEvents[passStart[r->pass] + c]] = counts + c;
+
+			if(json) {
+				printf("%s{\"record\":%u,\"key\":%u,\"name\":", first ? "" : ",\n", r->index, r->rID);
+				printJsonString(keyName(keys, r->rID));
+				printf(",\"parent\":%d,\"depth\":%u,\"pass\":%u,\"thread\":%u,\"time\":%.9g,\"counts\":{", r->parent, r->depth, r->pass, r->thread, r->time);
+				bool firstEvent = true;
+				for(unsigned e = 0; e < nE; e++) {
+					if(!columns[e])
+						continue;
+					printf("%s", firstEvent ? "" : ",");
+					printJsonString(events[e].name);
+					printf(":%lld", *columns[e]);
+					firstEvent = false;
+				}
+				printf("}}");
+			}
+			else {
+				printf("%u,%u,%s,%d,%u,%u,%u,%.9g", r->index, r->rID, keyName(keys, r->rID), r->parent, r->depth, r->pass, r->thread, r->time);
+				for(unsigned e = 0; e < nE; e++) {
+					if(columns[e])
+						printf(",%lld", *columns[e]);
+					else
+						printf(",");
+				}
+				printf("\n");
+			}
+			first = false;
+		}
+		else if(b->type == PW_TRACE_RECORD) {
+			PwTraceRecord const* r = (PwTraceRecord const*)(b+1);
+			long long const* counts = (long long const*)(r+1);
+			double const* times = (double const*)(counts + (unsigned long long)r->nCounts*nT);
+			for(unsigned e = 0; e < nE; e++)
+				columns[e] = NULL;
+			for(unsigned c = 0; c < r->nCounts && r->pass < h->numPasses; c++)
+				columns[passEvents[passStart[r->pass] + c]] = counts + (unsigned long long)c*nT;
+
+			if(json) {
+				printf("%s{\"record\":%u,\"key\":%u,\"name\":", first ? "" : ",\n", r->index, r->rID);
+				printJsonString(keyName(keys, r->rID));
+				printf(",\"parent\":%d,\"depth\":%u,\"pass\":%u,\"time\":[", r->parent, r->depth, r->pass);
+				for(unsigned t = 0; t < nT; t++)
+					printf("%s%.9g", t ? "," : "", times[t]);
+				printf("],\"counts\":{");
+				bool firstEvent = true;
+				for(unsigned e = 0; e < nE; e++) {
+					if(!columns[e])
+						continue;
+					printf("%s", firstEvent ? "" : ",");
+					printJsonString(events[e].name);
+					printf(":[");
+					for(unsigned t = 0; t < nT; t++)
+						printf("%s%lld", t ? "," : "", columns[e][t]);
+					printf("]");
+					firstEvent = false;
+				}
+				printf("}}");
+			}
+			else {
+				for(unsigned t = 0; t < nT; t++) {
+					printf("%u,%u,%s,%d,%u,%u,%u,%.9g", r->index, r->rID, keyName(keys, r->rID), r->parent, r->depth, r->pass, t, times[t]);
+					for(unsigned e = 0; e < nE; e++) {
+						if(columns[e])
+							printf(",%lld", columns[e][t]);
+						else
+							printf(",");
+					}
+					printf("\n");
+				}
+			}
+			first = false;
+		}
+		off += b->bytes;
+	}
+
+	if(json)
+		printf("\n]}\n");
+
+	munmap(file, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Symbolize a PapiWrapper sample file (writeSamples() or PAPI_SAMPLE_FILE)
+# with addr2line, giving the function and source line of every sampled
+# address, then the samples per function for each key and event.
+#
+# Usage: ./pw_symbolize.sh samples.txt
+# For MIC binaries use the k1om binutils: ADDR2LINE=x86_64-k1om-linux-addr2line
+# Modules are looked up by the path they had on the device, set MODULE_DIR
+# to look for them by name in another directory instead.
+
+ADDR2LINE=${ADDR2LINE:-addr2line}
+
+if [ $# -ne 1 ] || [ ! -r "$1" ]; then
+    echo "Usage: $0 samples.txt"
+    exit 1
+fi
+
+declare -A EVENTS KEYS
+
+symbolize() {
+    local module=$1 offset=$2
+    if [ -n "$MODULE_DIR" ]; then
+        module=$MODULE_DIR/$(basename "$module")
+    fi
+    if [ ! -r "$module" ]; then
+        echo "?? ??:0"
+        return
+    fi
+    $ADDR2LINE -f -C -e "$module" "$offset" | paste -sd' '
+}
+
+LINES=$(mktemp)
+trap 'rm -f "$LINES"' EXIT
+
+while read -r type a b c d e f; do
+    case $type in
+        event) EVENTS[$a]=$b ;;
+        key) KEYS[$a]="KEY ID $b ($(echo $c $d $e $f))" ;;
+        sample)
+            region=${KEYS[$a]:-Outside regions}
+            read -r function location <<< "$(symbolize "$f" "$e")"
+            printf "%s\t%s\t%s\t%s\t%s\t%s\n" "$region" "${EVENTS[$b]}" "$c" "$function" "$location" "$d" >> "$LINES"
+            ;;
+    esac
+done < "$1"
+
+echo "-----------Samples by address-----------"
+sort -t$'\t' -k1,1 -k2,2 -k3,3nr "$LINES" | awk -F'\t' '
+    $1"\t"$2 != last { printf "%s, %s\n", $1, $2; last = $1"\t"$2 }
+    { printf "  %10d  %-18s %s  %s\n", $3, $6, $4, $5 }'
+
+echo "-----------Samples by function-----------"
+awk -F'\t' '{ n[$1"\t"$2"\t"$4] += $3 } END { for(k in n) print n[k]"\t"k }' "$LINES" |
+    sort -t$'\t' -k2,2 -k3,3 -k1,1nr | awk -F'\t' '
+    $2"\t"$3 != last { printf "%s, %s\n", $2, $3; last = $2"\t"$3 }
+    { printf "  %10d  %s\n", $1, $4 }'
@@ -0,0 +1,815 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_RECORD_BUFFER_H
+#define MIC_RECORD_BUFFER_H
+
+// Flat record buffer: every record of a run packed into one contiguous
+// block of plain data, so it can leave the device through a single offload
+// out() clause, memcpy or fwrite, and be decoded on the host without PAPI.
+//
+// Layout, every section 8 byte aligned:
+//   PwBufferHeader
+//   PwBufferEvent  [numEvents]
+//   PwBufferKey    [numKeys]
+//   PwBufferRecord [numRecords]
+//   long long      [numThreads][numRecords][numEvents]   counts, thread-major
+//   double         [numThreads][numRecords]              times, thread-major
+//   double         [numEvents+1]                         empty region overhead
+//                                                        per thread, time last
+//   PwBufferMetric [numMetrics]                          derived metric expressions
+//   PwWork         [numRecords]                          work annotations
+//   PwCpuInfo      [numThreads]                          where each thread ran
+
+#include <stdio.h>
+#include <string.h>
+
+#include "array_t.h"
+#include "key_index.h"
+#include "derived_metric.h"
+#include "run_stats.h"
+#include "imbalance.h"
+#include "topology.h"
+
+#define PW_BUFFER_MAGIC     0x42525750      // "PWRB"
+#define PW_BUFFER_VERSION   6
+#define PW_NAME_LEN         64
+
+struct PwBufferHeader{
+	unsigned magic;
+	unsigned version;
+	unsigned numThreads;
+	unsigned numEvents;
+	unsigned numRecords;
+	unsigned numKeys;
+	unsigned numPasses;
+	unsigned reserved;
+	unsigned long long totalBytes;
+	unsigned long long eventsOffset;
+	unsigned long long keysOffset;
+	unsigned long long recordsOffset;
+	unsigned long long countsOffset;
+	unsigned long long timesOffset;
+	// Timer the times were taken with (version 2)
+	double timerResolution;
+	char timerName[PW_NAME_LEN];
+	// Calibrated overhead (version 3), and whether it was subtracted
+	unsigned long long overheadOffset;
+	unsigned overheadSubtracted;
+	// Derived metrics (version 4), recompiled by the host report
+	unsigned numMetrics;
+	unsigned long long metricsOffset;
+	// Work annotations (version 5)
+	unsigned long long workOffset;
+	// Thread placement (version 6)
+	unsigned long long cpusOffset;
+};
+
+struct PwBufferEvent{
+	char name[PW_NAME_LEN];
+	int pass;
+	int reserved;
+};
+
+struct PwBufferKey{
+	unsigned key;
+	unsigned reserved;
+	char name[PW_NAME_LEN];
+};
+
+struct PwBufferMetric{
+	char name[PW_METRIC_NAME_LEN];
+	char expr[PW_METRIC_EXPR_LEN];
+};
+
+// Work a region did over the whole team, all zero when not annotated
+struct PwWork{
+	double bytesRead;
+	double bytesWritten;
+	double flops;
+};
+
+inline bool pwHasWork(const PwWork& w) { return w.bytesRead != 0 || w.bytesWritten != 0 || w.flops != 0; }
+
+// GB/s and GFLOP/s over the runs of a key, each run's rate from its work
+// and time
+struct PwWorkRates{
+	PwWorkRates() { n = 0; bwMin = bwMax = bwSum = 0; flopMin = flopMax = flopSum = 0; }
+	void add(const PwWork& w, double time) {
+		if(time <= 0)
+			return;
+		double bw = (w.bytesRead + w.bytesWritten)/time*1e-9;
+		double flop = w.flops/time*1e-9;
+		if(!n || bw < bwMin) bwMin = bw;
+		if(!n || bw > bwMax) bwMax = bw;
+		if(!n || flop < flopMin) flopMin = flop;
+		if(!n || flop > flopMax) flopMax = flop;
+		bwSum += bw;
+		flopSum += flop;
+		n++;
+	}
+	void merge(const PwWorkRates& o) {
+		if(!o.n)
+			return;
+		if(!n || o.bwMin < bwMin) bwMin = o.bwMin;
+		if(!n || o.bwMax > bwMax) bwMax = o.bwMax;
+		if(!n || o.flopMin < flopMin) flopMin = o.flopMin;
+		if(!n || o.flopMax > flopMax) flopMax = o.flopMax;
+		bwSum += o.bwSum;
+		flopSum += o.flopSum;
+		n += o.n;
+	}
+	unsigned long long n;
+	double bwMin, bwMax, bwSum;
+	double flopMin, flopMax, flopSum;
+};
+
+// One line per annotated key, the best rate (max) is what STREAM reports
+inline void pwPrintWorkHeader()
+{
+	printf("-----------Work rates-----------\n");
+	printf("%-24s %6s %10s %10s %10s %12s %12s %12s\n", "Key", "Runs", "GB/s min", "GB/s avg", "GB/s max", "GFLOP/s min", "GFLOP/s avg", "GFLOP/s max");
+}
+
+inline void pwPrintWorkRow(const char* name, unsigned key, const PwWorkRates& r)
+{
+	if(!r.n)
+		return;
+	if(name && name[0])
+		printf("%-24s ", name);
+	else
+		printf("%-24u ", key);
+	printf("%6llu %10.3f %10.3f %10.3f %12.3f %12.3f %12.3f\n", r.n, r.bwMin, r.bwSum/r.n, r.bwMax, r.flopMin, r.flopSum/r.n, r.flopMax);
+}
+
+struct PwBufferRecord{
+	unsigned rID;
+	unsigned pass;
+	int parent;
+	unsigned depth;
+};
+
+inline unsigned long long pwAlign8(unsigned long long n) { return (n + 7) & ~7ULL; }
+
+// Fill in the header and section offsets for the given sizes, returns the
+// total number of bytes the buffer needs
+inline unsigned long long pwBufferLayout(PwBufferHeader& h, unsigned numThreads, unsigned numEvents,
+                                         unsigned numRecords, unsigned numKeys, unsigned numPasses, unsigned numMetrics)
+{
+	memset(&h, 0, sizeof(h));
+	h.magic = PW_BUFFER_MAGIC;
+	h.version = PW_BUFFER_VERSION;
+	h.numThreads = numThreads;
+	h.numEvents = numEvents;
+	h.numRecords = numRecords;
+	h.numKeys = numKeys;
+	h.numPasses = numPasses;
+	h.numMetrics = numMetrics;
+	h.eventsOffset = pwAlign8(sizeof(PwBufferHeader));
+	h.keysOffset = pwAlign8(h.eventsOffset + numEvents*sizeof(PwBufferEvent));
+	h.recordsOffset = pwAlign8(h.keysOffset + numKeys*sizeof(PwBufferKey));
+	h.countsOffset = pwAlign8(h.recordsOffset + numRecords*sizeof(PwBufferRecord));
+	h.timesOffset = pwAlign8(h.countsOffset + (unsigned long long)numThreads*numRecords*numEvents*sizeof(long long));
+	h.overheadOffset = pwAlign8(h.timesOffset + (unsigned long long)numThreads*numRecords*sizeof(double));
+	h.metricsOffset = pwAlign8(h.overheadOffset + (numEvents+1)*sizeof(double));
+	h.workOffset = pwAlign8(h.metricsOffset + numMetrics*sizeof(PwBufferMetric));
+	h.cpusOffset = pwAlign8(h.workOffset + numRecords*sizeof(PwWork));
+	h.totalBytes = pwAlign8(h.cpusOffset + numThreads*sizeof(PwCpuInfo));
+	return h.totalBytes;
+}
+
+inline void pwCopyName(char* dst, const char* src)
+{
+	// Zero filled, so packed buffers hold no stale bytes
+	memset(dst, 0, PW_NAME_LEN);
+	if(src) {
+		size_t len = strnlen(src, PW_NAME_LEN-1);
+		memcpy(dst, src, len);
+		dst[len] = 0;
+	}
+}
+
+// Section accessors, buffer must start with a valid header
+inline PwBufferHeader* pwBufferHeader(void* buf) { return (PwBufferHeader*)buf; }
+inline PwBufferHeader const* pwBufferHeader(void const* buf) { return (PwBufferHeader const*)buf; }
+inline PwBufferEvent* pwBufferEvents(void* buf) { return (PwBufferEvent*)((char*)buf + pwBufferHeader(buf)->eventsOffset); }
+inline PwBufferEvent const* pwBufferEvents(void const* buf) { return (PwBufferEvent const*)((char const*)buf + pwBufferHeader(buf)->eventsOffset); }
+inline PwBufferKey* pwBufferKeys(void* buf) { return (PwBufferKey*)((char*)buf + pwBufferHeader(buf)->keysOffset); }
+inline PwBufferKey const* pwBufferKeys(void const* buf) { return (PwBufferKey const*)((char const*)buf + pwBufferHeader(buf)->keysOffset); }
+inline PwBufferRecord* pwBufferRecords(void* buf) { return (PwBufferRecord*)((char*)buf + pwBufferHeader(buf)->recordsOffset); }
+inline PwBufferRecord const* pwBufferRecords(void const* buf) { return (PwBufferRecord const*)((char const*)buf + pwBufferHeader(buf)->recordsOffset); }
+
+inline long long* pwBufferCounts(void* buf, unsigned tid)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	return (long long*)((char*)buf + h->countsOffset) + (unsigned long long)tid*h->numRecords*h->numEvents;
+}
+inline long long const* pwBufferCounts(void const* buf, unsigned tid)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	return (long long const*)((char const*)buf + h->countsOffset) + (unsigned long long)tid*h->numRecords*h->numEvents;
+}
+inline double* pwBufferTimes(void* buf, unsigned tid)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	return (double*)((char*)buf + h->timesOffset) + (unsigned long long)tid*h->numRecords;
+}
+inline double const* pwBufferTimes(void const* buf, unsigned tid)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	return (double const*)((char const*)buf + h->timesOffset) + (unsigned long long)tid*h->numRecords;
+}
+
+inline double* pwBufferOverhead(void* buf) { return (double*)((char*)buf + pwBufferHeader(buf)->overheadOffset); }
+inline double const* pwBufferOverhead(void const* buf) { return (double const*)((char const*)buf + pwBufferHeader(buf)->overheadOffset); }
+inline PwBufferMetric* pwBufferMetrics(void* buf) { return (PwBufferMetric*)((char*)buf + pwBufferHeader(buf)->metricsOffset); }
+inline PwBufferMetric const* pwBufferMetrics(void const* buf) { return (PwBufferMetric const*)((char const*)buf + pwBufferHeader(buf)->metricsOffset); }
+inline PwWork* pwBufferWork(void* buf) { return (PwWork*)((char*)buf + pwBufferHeader(buf)->workOffset); }
+inline PwWork const* pwBufferWork(void const* buf) { return (PwWork const*)((char const*)buf + pwBufferHeader(buf)->workOffset); }
+inline PwCpuInfo* pwBufferCpus(void* buf) { return (PwCpuInfo*)((char*)buf + pwBufferHeader(buf)->cpusOffset); }
+inline PwCpuInfo const* pwBufferCpus(void const* buf) { return (PwCpuInfo const*)((char const*)buf + pwBufferHeader(buf)->cpusOffset); }
+
+// Check a received buffer before decoding it, bytes is how much arrived
+inline bool pwBufferCheck(void const* buf, unsigned long long bytes)
+{
+	if(buf == NULL || bytes < sizeof(PwBufferHeader)) {
+		printf("Record buffer: too small for a header\n");
+		return false;
+	}
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	if(h->magic != PW_BUFFER_MAGIC) {
+		printf("Record buffer: bad magic 0x%X\n", h->magic);
+		return false;
+	}
+	if(h->version != PW_BUFFER_VERSION) {
+		printf("Record buffer: version %u, expected %u\n", h->version, PW_BUFFER_VERSION);
+		return false;
+	}
+	// Every section must sit where the header's sizes put it
+	PwBufferHeader expected;
+	pwBufferLayout(expected, h->numThreads, h->numEvents, h->numRecords, h->numKeys, h->numPasses, h->numMetrics);
+	struct { const char* name; unsigned long long expected, received; } fields[] = {
+		{"eventsOffset", expected.eventsOffset, h->eventsOffset},
+		{"keysOffset", expected.keysOffset, h->keysOffset},
+		{"recordsOffset", expected.recordsOffset, h->recordsOffset},
+		{"countsOffset", expected.countsOffset, h->countsOffset},
+		{"timesOffset", expected.timesOffset, h->timesOffset},
+		{"overheadOffset", expected.overheadOffset, h->overheadOffset},
+		{"metricsOffset", expected.metricsOffset, h->metricsOffset},
+		{"workOffset", expected.workOffset, h->workOffset},
+		{"cpusOffset", expected.cpusOffset, h->cpusOffset},
+		{"totalBytes", expected.totalBytes, h->totalBytes}
+	};
+	for(unsigned i = 0; i < sizeof(fields)/sizeof(fields[0]); i++)
+		if(fields[i].expected != fields[i].received) {
+			printf("Record buffer: %s is %llu, %llu expected for %u threads, %u events and %u records\n",
+			       fields[i].name, fields[i].received, fields[i].expected, h->numThreads, h->numEvents, h->numRecords);
+			return false;
+		}
+	if(h->totalBytes > bytes) {
+		printf("Record buffer: truncated (%llu bytes expected, %llu received)\n", h->totalBytes, bytes);
+		return false;
+	}
+	return true;
+}
+
+//---------------------------------------------------------------
+// Report sections shared by PapiWrapper on the device and the pwBuffer*
+// reports on the host. Each side gathers its records into the same per key
+// values, so both print exactly the same tables
+//---------------------------------------------------------------
+
+// Regions averaging less than this many times the calibrated overhead of
+// an empty region are flagged in reports
+#define PW_TRUST_FACTOR 10
+
+// "KEY ID n (name)", no name for plain integer keys
+inline void pwPrintKeyLabel(unsigned key, const char* name)
+{
+	printf("KEY ID %u", key);
+	if(name && name[0])
+		printf(" (%s)", name);
+}
+
+// One run of a key, that is one record, on every thread: times [thread]
+// and counts [thread][event], inclusive and exclusive, of which only the
+// events of the run's pass are read. Gathered from the arena on the device
+// or from a packed buffer on the host, so both reports add the same runs
+struct PwRunValues{
+	void init(unsigned numEvents, unsigned numThreads) {
+		nE = numEvents;
+		nT = numThreads;
+		times.resize(nT);
+		exclTimes.resize(nT);
+		counts.resize(nT*nE);
+		counts.fill(0);
+		exclCounts.resize(nT*nE);
+		exclCounts.fill(0);
+	}
+
+	unsigned nE, nT;
+	unsigned pass;
+	bool hasParent;
+	PwWork work;
+	Array_T<double> times, exclTimes;
+	Array_T<long long> counts, exclCounts;
+};
+
+// Per key averages over runs, times per thread and counts summed over the
+// team. Each event is averaged over the runs its pass was counted in
+struct PwKeyAverages{
+	void init(unsigned numKeys, unsigned numEvents, unsigned numThreads) {
+		nK = numKeys;
+		nE = numEvents;
+		nT = numThreads;
+		times.resize(nK);
+		times.fill(0.0);
+		exclTimes.resize(nK);
+		exclTimes.fill(0.0);
+		events.resize(nK*nE);
+		events.fill(0.0);
+		exclEvents.resize(nK*nE);
+		exclEvents.fill(0.0);
+		runs.resize(nK);
+		runs.fill(0);
+		eventRuns.resize(nK*nE);
+		eventRuns.fill(0);
+		timeSamples.resize(nK);
+		eventSamples.resize(nK*nE);
+		work.resize(nK);
+		nested = false;
+		anyWork = false;
+	}
+
+	// One run of key k, only the events of its pass (eventPass[e] ==
+	// run.pass) are read
+	void addRun(unsigned k, const int* eventPass, const PwRunValues& run) {
+		double time = 0, maxTime = 0;
+		for(unsigned t = 0; t < nT; t++) {
+			time += run.times[t];
+			exclTimes[k] += run.exclTimes[t];
+			if(run.times[t] > maxTime)
+				maxTime = run.times[t];
+		}
+		times[k] += time;
+		timeSamples[k].push_back(time/nT);
+		for(unsigned e = 0; e < nE; e++) {
+			if(eventPass[e] != (int)run.pass)
+				continue;
+			long long total = 0, exclTotal = 0;
+			for(unsigned t = 0; t < nT; t++) {
+				total += run.counts[t*nE + e];
+				exclTotal += run.exclCounts[t*nE + e];
+			}
+			events[k*nE + e] += total;
+			exclEvents[k*nE + e] += exclTotal;
+			eventSamples[k*nE + e].push_back((double)total);
+			eventRuns[k*nE + e]++;
+		}
+		runs[k]++;
+		if(run.hasParent)
+			nested = true;
+		// Work rates use the slowest thread's time, when the team finished
+		if(pwHasWork(run.work)) {
+			work[k].add(run.work, maxTime);
+			anyWork = true;
+		}
+	}
+
+	// Sums to averages, once every run is added
+	void finish() {
+		for(unsigned k = 0; k < nK; k++) {
+			for(unsigned e = 0; e < nE; e++) {
+				if(eventRuns[k*nE + e]) {
+					events[k*nE + e] /= eventRuns[k*nE + e];
+					exclEvents[k*nE + e] /= eventRuns[k*nE + e];
+				}
+			}
+			if(runs[k]) {
+				times[k] /= (double)nT*runs[k];
+				exclTimes[k] /= (double)nT*runs[k];
+			}
+		}
+	}
+
+	unsigned nK, nE, nT;
+	Array_T<double> times, exclTimes;
+	Array_T<double> events, exclEvents;
+	Array_T<int> runs, eventRuns;
+	// One sample per run for the run statistics: the team's average time,
+	// and each event's team total (by key, then event)
+	Array_T< Array_T<double> > timeSamples;
+	Array_T< Array_T<double> > eventSamples;
+	Array_T<PwWorkRates> work;
+	bool nested, anyWork;
+};
+
+// Per thread means over each key's runs, for the imbalance and topology
+// reports: times [key][thread], counts [key][thread][event] with NAN for
+// events never counted, and wasted, the slowest thread's time less each
+// thread's summed over the key's runs. estimated is set when only means
+// were kept and wasted had to be estimated from them
+struct PwThreadMeans{
+	void init(unsigned numKeys, unsigned numEvents, unsigned numThreads) {
+		nK = numKeys;
+		nE = numEvents;
+		nT = numThreads;
+		times.resize(nK*nT);
+		times.fill(0.0);
+		counts.resize(nK*nT*nE);
+		counts.fill(0.0);
+		wasted.resize(nK);
+		wasted.fill(0.0);
+		runs.resize(nK);
+		runs.fill(0);
+		eventRuns.resize(nK*nE);
+		eventRuns.fill(0);
+		estimated = false;
+	}
+
+	void addRun(unsigned k, const int* eventPass, const PwRunValues& run) {
+		double max = 0;
+		for(unsigned t = 0; t < nT; t++) {
+			times[k*nT + t] += run.times[t];
+			if(run.times[t] > max)
+				max = run.times[t];
+		}
+		for(unsigned t = 0; t < nT; t++)
+			wasted[k] += max - run.times[t];
+		runs[k]++;
+		for(unsigned e = 0; e < nE; e++) {
+			if(eventPass[e] != (int)run.pass)
+				continue;
+			for(unsigned t = 0; t < nT; t++)
+				counts[(k*nT + t)*nE + e] += run.counts[t*nE + e];
+			eventRuns[k*nE + e]++;
+		}
+	}
+
+	// Sums to means, once every run is added
+	void finish() {
+		for(unsigned k = 0; k < nK; k++) {
+			for(unsigned t = 0; t < nT; t++) {
+				if(runs[k])
+					times[k*nT + t] /= runs[k];
+				for(unsigned e = 0; e < nE; e++) {
+					double& c = counts[(k*nT + t)*nE + e];
+					c = eventRuns[k*nE + e] ? c/eventRuns[k*nE + e] : NAN;
+				}
+			}
+		}
+	}
+
+	unsigned nK, nE, nT;
+	Array_T<double> times, counts, wasted;
+	Array_T<unsigned> runs;
+	Array_T<int> eventRuns;
+	bool estimated;
+};
+
+// Time then one row per event, a column per key
+inline void pwPrintKeyTable(const PwKeyAverages& a, const Array_T<double>& times, const Array_T<double>& events)
+{
+	for(unsigned k = 0; k < a.nK; k++)
+		printf("%.9f\t", times[k]);
+	printf("\n");
+	for(unsigned e = 0; e < a.nE; e++) {
+		for(unsigned k = 0; k < a.nK; k++) {
+			if(a.eventRuns[k*a.nE + e])
+				printf("%.0f\t", events[k*a.nE + e]);
+			else
+				printf("n/a\t");
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
+// One row per metric over the per key averages, events from different
+// passes can be combined since each is averaged over its own runs
+inline void pwPrintMetricRows(const PwKeyAverages& a, const Array_T<double>& times, const Array_T<double>& events,
+                              const DerivedMetric* metrics, unsigned numMetrics)
+{
+	Array_T<double> values;
+	values.resize(a.nE+1);
+	for(unsigned m = 0; m < numMetrics; m++) {
+		printf("%s\t", metrics[m].name());
+		for(unsigned k = 0; k < a.nK; k++) {
+			for(unsigned e = 0; e < a.nE; e++)
+				values[e] = a.eventRuns[k*a.nE + e] ? events[k*a.nE + e] : NAN;
+			values[a.nE] = times[k];
+			double v = metrics[m].eval(values.ptr());
+			if(isnan(v))
+				printf("n/a\t");
+			else
+				printf("%g\t", v);
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
+// Everything multiRunPrintAverageRecords() prints between the timer line
+// and the overhead. Runs with a modified z-score over madThreshold are left
+// out of the run statistics (0 keeps them all)
+inline void pwPrintAverages(const PwKeyAverages& a, const unsigned* keys, const char* const* keyNames,
+                            const char* const* eventNames, const DerivedMetric* metrics, unsigned numMetrics,
+                            double madThreshold)
+{
+	printf("-----------Events-----------\nTime\n");
+	for(unsigned e = 0; e < a.nE; e++)
+		printf("%s\n", eventNames[e]);
+	printf("\n");
+
+	printf("-----------Keys-----------\n");
+	for(unsigned k = 0; k < a.nK; k++) {
+		if(keyNames[k] && keyNames[k][0])
+			printf("%s\t", keyNames[k]);
+		else
+			printf("%u\t", keys[k]);
+	}
+	printf("\n");
+
+	printf("-----------Counts-----------\n");
+	pwPrintKeyTable(a, a.times, a.events);
+
+	if(numMetrics) {
+		printf("-----------Metrics-----------\n");
+		pwPrintMetricRows(a, a.times, a.events, metrics, numMetrics);
+	}
+
+	if(a.anyWork) {
+		pwPrintWorkHeader();
+		for(unsigned k = 0; k < a.nK; k++)
+			pwPrintWorkRow(keyNames[k], keys[k], a.work[k]);
+		printf("\n");
+	}
+
+	// Spread over the runs, so differences between keys or builds can be
+	// told apart from run to run noise
+	printf("-----------Run statistics-----------\n");
+	if(madThreshold > 0)
+		printf("Runs with a modified z-score over %.1f are rejected as outliers\n", madThreshold);
+	for(unsigned k = 0; k < a.nK; k++) {
+		pwPrintKeyLabel(keys[k], keyNames[k]);
+		printf("\n");
+		pwPrintRunStatsHeader();
+		pwPrintRunStatsRow("Time", pwRunStats(a.timeSamples[k].ptr(), a.timeSamples[k].size(), madThreshold), true);
+		for(unsigned e = 0; e < a.nE; e++) {
+			Array_T<double> const& samples = a.eventSamples[k*a.nE + e];
+			pwPrintRunStatsRow(eventNames[e], pwRunStats(samples.ptr(), samples.size(), madThreshold), false);
+		}
+	}
+	printf("\n");
+
+	// Inclusive less direct children, equal to inclusive for leaf regions
+	if(a.nested) {
+		printf("-----------Exclusive counts-----------\n");
+		pwPrintKeyTable(a, a.exclTimes, a.exclEvents);
+		if(numMetrics) {
+			printf("-----------Exclusive metrics-----------\n");
+			pwPrintMetricRows(a, a.exclTimes, a.exclEvents, metrics, numMetrics);
+		}
+	}
+}
+
+// Regions not much longer than an empty one mostly measure the
+// instrumentation itself
+inline void pwPrintTrustWarnings(const PwKeyAverages& a, const unsigned* keys, const char* const* keyNames, double overheadTime)
+{
+	for(unsigned k = 0; k < a.nK; k++) {
+		if(a.times[k] < PW_TRUST_FACTOR*overheadTime) {
+			printf("Warning: ");
+			pwPrintKeyLabel(keys[k], keyNames[k]);
+			printf(" averages %.9f s, less than %dx the instrumentation overhead\n", a.times[k], PW_TRUST_FACTOR);
+		}
+	}
+}
+
+inline void pwPrintKeyBanner(unsigned key, const char* name)
+{
+	printf("------------------------\nFor ");
+	pwPrintKeyLabel(key, name);
+	printf("\n------------------------\n");
+}
+
+// Imbalance of every key from its per thread means
+inline void pwPrintImbalanceReport(const PwThreadMeans& m, const unsigned* keys, const char* const* keyNames,
+                                   const char* const* eventNames)
+{
+	printf("-----------Thread imbalance-----------\n");
+	for(unsigned k = 0; k < m.nK; k++) {
+		pwPrintKeyBanner(keys[k], keyNames[k]);
+		pwPrintImbalance(m.nT, m.times.ptr() + k*m.nT, m.wasted[k], m.runs[k], m.estimated,
+			m.nE, eventNames, m.counts.ptr() + k*m.nT*m.nE);
+	}
+	printf("\n");
+	fflush(0);
+}
+
+// Topology of every key from the same per thread means
+inline void pwPrintTopologyReport(const PwThreadMeans& m, const unsigned* keys, const char* const* keyNames,
+                                  const PwCpuInfo* cpus, const char* const* eventNames)
+{
+	printf("-----------Topology-----------\n");
+	for(unsigned k = 0; k < m.nK; k++) {
+		pwPrintKeyBanner(keys[k], keyNames[k]);
+		pwPrintTopology(m.nT, cpus, m.times.ptr() + k*m.nT, m.counts.ptr() + k*m.nT*m.nE, m.nE, eventNames);
+	}
+	printf("\n");
+	fflush(0);
+}
+
+//---------------------------------------------------------------
+// Host side reports from a packed buffer
+//---------------------------------------------------------------
+
+// Keys, key names (NULL when unnamed) and event names of a buffer, in the
+// form the shared reports take
+inline void pwBufferNames(void const* buf, Array_T<unsigned>& keys, Array_T<const char*>& keyNames, Array_T<const char*>& eventNames)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferKey const* k = pwBufferKeys(buf);
+	PwBufferEvent const* events = pwBufferEvents(buf);
+	keys.resize(h->numKeys);
+	keyNames.resize(h->numKeys);
+	for(unsigned i = 0; i < h->numKeys; i++) {
+		keys[i] = k[i].key;
+		keyNames[i] = k[i].name[0] ? k[i].name : NULL;
+	}
+	eventNames.resize(h->numEvents);
+	for(unsigned e = 0; e < h->numEvents; e++)
+		eventNames[e] = events[e].name;
+}
+
+// Inclusive values of record j on thread t less those of its direct
+// children, which follow it in the buffer as they do in the arena
+inline void pwBufferExclusive(void const* buf, unsigned j, unsigned t, long long* counts, double& time)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	unsigned nE = h->numEvents;
+	long long const* all = pwBufferCounts(buf, t);
+	double const* times = pwBufferTimes(buf, t);
+	memcpy(counts, all + (unsigned long long)j*nE, nE*sizeof(long long));
+	time = times[j];
+	for(unsigned i = j+1; i < h->numRecords && records[i].depth > records[j].depth; i++) {
+		if(records[i].parent != (int)j)
+			continue;
+		for(unsigned e = 0; e < nE; e++)
+			counts[e] -= all[(unsigned long long)i*nE + e];
+		time -= times[i];
+	}
+}
+
+// Record j of a buffer on every thread
+inline void pwBufferRunValues(void const* buf, unsigned j, PwRunValues& run)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	unsigned nE = h->numEvents;
+	for(unsigned t = 0; t < h->numThreads; t++) {
+		run.times[t] = pwBufferTimes(buf, t)[j];
+		if(nE)
+			memcpy(run.counts.ptr() + t*nE, pwBufferCounts(buf, t) + (unsigned long long)j*nE, nE*sizeof(long long));
+		pwBufferExclusive(buf, j, t, run.exclCounts.ptr() + t*nE, run.exclTimes[t]);
+	}
+	run.pass = records[j].pass;
+	run.hasParent = records[j].parent >= 0;
+	run.work = pwBufferWork(buf)[j];
+}
+
+// Keys of a buffer by value, for finding each record's key
+inline void pwBufferKeyIndex(void const* buf, KeyIndex& index)
+{
+	PwBufferKey const* keys = pwBufferKeys(buf);
+	for(unsigned i = 0; i < pwBufferHeader(buf)->numKeys; i++)
+		index.insert(keys[i].key, i);
+}
+
+// Pass of every event of a buffer
+inline void pwBufferEventPass(void const* buf, Array_T<int>& eventPass)
+{
+	PwBufferEvent const* events = pwBufferEvents(buf);
+	eventPass.resize(pwBufferHeader(buf)->numEvents);
+	for(unsigned e = 0; e < eventPass.size(); e++)
+		eventPass[e] = events[e].pass;
+}
+
+// Per key averages over runs in the same layout as
+// PapiWrapper::multiRunPrintAverageRecords(). Runs with a modified z-score
+// over madThreshold are left out of the run statistics (0 keeps them all)
+inline void pwBufferPrintAverages(void const* buf, double madThreshold = 0)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	unsigned nT = h->numThreads, nE = h->numEvents, nK = h->numKeys;
+
+	Array_T<unsigned> keys;
+	Array_T<const char*> keyNames, eventNames;
+	pwBufferNames(buf, keys, keyNames, eventNames);
+	KeyIndex index;
+	pwBufferKeyIndex(buf, index);
+	Array_T<int> eventPass;
+	pwBufferEventPass(buf, eventPass);
+
+	PwKeyAverages a;
+	a.init(nK, nE, nT);
+	PwRunValues run;
+	run.init(nE, nT);
+	for(unsigned j = 0; j < h->numRecords; j++) {
+		int k = index.find(records[j].rID);
+		if(k < 0)
+			continue;
+		pwBufferRunValues(buf, j, run);
+		a.addRun(k, eventPass.ptr(), run);
+	}
+	a.finish();
+
+	// Metrics are recompiled against this buffer's events
+	Array_T<DerivedMetric> metrics;
+	PwBufferMetric const* packed = pwBufferMetrics(buf);
+	for(unsigned m = 0; m < h->numMetrics; m++) {
+		DerivedMetric metric;
+		if(metric.compile(packed[m].name, packed[m].expr, eventNames.ptr(), nE))
+			metrics.push_back(metric);
+	}
+
+	printf("Timer: %s, resolution %.1f ns\n", h->timerName, 1e9*h->timerResolution);
+	pwPrintAverages(a, keys.ptr(), keyNames.ptr(), eventNames.ptr(), metrics.ptr(), metrics.size(), madThreshold);
+
+	double const* overhead = pwBufferOverhead(buf);
+	printf("-----------Overhead-----------\n");
+	printf("Empty region, time per thread and counts summed over %u threads (%s)\n", nT,
+		h->overheadSubtracted ? "subtracted from every region" : "not subtracted");
+	printf("%.9f\n", overhead[nE]);
+	for(unsigned e = 0; e < nE; e++)
+		printf("%.0f\n", overhead[e]*nT);
+	printf("\n");
+	pwPrintTrustWarnings(a, keys.ptr(), keyNames.ptr(), overhead[nE]);
+	fflush(0);
+}
+
+// Per thread means over each key's runs, as for the device reports
+inline void pwBufferThreadMeans(void const* buf, PwThreadMeans& m)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	KeyIndex index;
+	pwBufferKeyIndex(buf, index);
+	Array_T<int> eventPass;
+	pwBufferEventPass(buf, eventPass);
+
+	m.init(h->numKeys, h->numEvents, h->numThreads);
+	PwRunValues run;
+	run.init(h->numEvents, h->numThreads);
+	for(unsigned j = 0; j < h->numRecords; j++) {
+		int k = index.find(records[j].rID);
+		if(k < 0)
+			continue;
+		pwBufferRunValues(buf, j, run);
+		m.addRun(k, eventPass.ptr(), run);
+	}
+	m.finish();
+}
+
+// Imbalance report, as PapiWrapper::printImbalance()
+inline void pwBufferPrintImbalance(void const* buf)
+{
+	PwThreadMeans m;
+	pwBufferThreadMeans(buf, m);
+	Array_T<unsigned> keys;
+	Array_T<const char*> keyNames, eventNames;
+	pwBufferNames(buf, keys, keyNames, eventNames);
+	pwPrintImbalanceReport(m, keys.ptr(), keyNames.ptr(), eventNames.ptr());
+}
+
+// Topology report, as PapiWrapper::printTopology()
+inline void pwBufferPrintTopology(void const* buf)
+{
+	PwThreadMeans m;
+	pwBufferThreadMeans(buf, m);
+	Array_T<unsigned> keys;
+	Array_T<const char*> keyNames, eventNames;
+	pwBufferNames(buf, keys, keyNames, eventNames);
+	pwPrintTopologyReport(m, keys.ptr(), keyNames.ptr(), pwBufferCpus(buf), eventNames.ptr());
+}
+
+#endif
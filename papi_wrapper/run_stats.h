@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_RUN_STATS_H
+#define MIC_RUN_STATS_H
+
+// Statistics over the repeated runs of a key: one sample per run (team
+// total counts, or the team's average time). Runs can optionally be
+// rejected as outliers first, using the modified z-score
+// 0.6745*|x - median|/MAD, where MAD is the median absolute deviation.
+// Robust against one or two runs disturbed by something else on the node,
+// unlike rejection based on the standard deviation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "array_t.h"
+
+// Modified z-score above which runs are usually treated as outliers
+#define PW_MAD_THRESHOLD 3.5
+
+struct RunStats{
+	RunStats() { n = 0; rejected = 0; mean = median = min = max = stddev = cv = ci95 = 0; }
+	// Runs used, and runs rejected as outliers
+	unsigned n;
+	unsigned rejected;
+	double mean;
+	double median;
+	double min;
+	double max;
+	double stddev;
+	// Coefficient of variation, stddev/mean
+	double cv;
+	// Half width of the 95% confidence interval of the mean
+	double ci95;
+};
+
+inline int pwCompareDouble(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Median of n sorted values
+inline double pwSortedMedian(const double* v, unsigned n)
+{
+	if(!n)
+		return 0;
+	return (n & 1) ? v[n/2] : 0.5*(v[n/2-1] + v[n/2]);
+}
+
+// Two sided 95% critical value of Student's t distribution
+inline double pwStudentT95(unsigned dof)
+{
+	static const double table[30] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	if(dof == 0)
+		return 0;
+	if(dof <= 30)
+		return table[dof-1];
+	if(dof <= 40)
+		return 2.021;
+	if(dof <= 60)
+		return 2.000;
+	if(dof <= 120)
+		return 1.980;
+	return 1.960;
+}
+
+// Statistics of n samples, rejecting runs with a modified z-score above
+// madThreshold first (0 keeps every run)
+inline RunStats pwRunStats(const double* samples, unsigned n, double madThreshold)
+{
+	RunStats s;
+	if(!n)
+		return s;
+
+	Array_T<double> sorted;
+	sorted.resize(n);
+	for(unsigned i = 0; i < n; i++)
+		sorted[i] = samples[i];
+	qsort(sorted.ptr(), n, sizeof(double), pwCompareDouble);
+
+	// With half or more of the runs identical the MAD is zero and nothing
+	// can be called an outlier
+	unsigned first = 0, last = n;
+	if(madThreshold > 0 && n > 2) {
+		double median = pwSortedMedian(sorted.ptr(), n);
+		Array_T<double> dev;
+		dev.resize(n);
+		for(unsigned i = 0; i < n; i++)
+			dev[i] = fabs(sorted[i] - median);
+		qsort(dev.ptr(), n, sizeof(double), pwCompareDouble);
+		double mad = pwSortedMedian(dev.ptr(), n);
+		if(mad > 0) {
+			double limit = madThreshold*mad/0.6745;
+			while(first < last && median - sorted[first] > limit)
+				first++;
+			while(last > first && sorted[last-1] - median > limit)
+				last--;
+		}
+	}
+
+	const double* v = sorted.ptr() + first;
+	s.n = last - first;
+	s.rejected = n - s.n;
+	s.min = v[0];
+	s.max = v[s.n-1];
+	s.median = pwSortedMedian(v, s.n);
+	double sum = 0;
+	for(unsigned i = 0; i < s.n; i++)
+		sum += v[i];
+	s.mean = sum/s.n;
+	if(s.n > 1) {
+		double m2 = 0;
+		for(unsigned i = 0; i < s.n; i++)
+			m2 += (v[i] - s.mean)*(v[i] - s.mean);
+		s.stddev = sqrt(m2/(s.n-1));
+		s.ci95 = pwStudentT95(s.n-1)*s.stddev/sqrt((double)s.n);
+	}
+	s.cv = s.mean != 0 ? s.stddev/fabs(s.mean) : 0;
+	return s;
+}
+
+inline void pwPrintRunStatsHeader()
+{
+	printf("%-24s %5s %5s %16s %16s %16s %16s %16s %8s %16s\n", "", "Runs", "Out",
+		"Mean", "Median", "Min", "Max", "Std dev", "CV %", "95% CI +/-");
+}
+
+// Times are printed to the nanosecond, counts as whole numbers
+inline void pwPrintRunStatsRow(const char* label, const RunStats& s, bool isTime)
+{
+	if(!s.n) {
+		printf("%-24s %5s\n", label, "n/a");
+		return;
+	}
+	const char* fmt = isTime ? "%-24s %5u %5u %16.9f %16.9f %16.9f %16.9f %16.9f %8.2f %16.9f\n"
+	                         : "%-24s %5u %5u %16.0f %16.0f %16.0f %16.0f %16.0f %8.2f %16.0f\n";
+	printf(fmt, label, s.n, s.rejected, s.mean, s.median, s.min, s.max, s.stddev, 100*s.cv, s.ci95);
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef MIC_SAMPLE_PROFILE_H
+#define MIC_SAMPLE_PROFILE_H
+
+// Overflow sampling. A sampled event interrupts its thread every threshold
+// counts, and the handler notes the interrupted instruction and the
+// innermost region open on that thread in the thread's SampleRing.
+//
+// Addresses are symbolized with dladdr, which only sees the main program's
+// functions when it is linked with -rdynamic. pwSampleModule() gives the
+// module and load-relative offset addr2line needs to do it offline.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <cxxabi.h>
+
+#include "array_t.h"
+
+// Samples a thread's ring holds between drains, PAPI_SAMPLE_BUFFER
+#define PW_SAMPLE_RING      4096
+// Functions and addresses listed per region and event
+#define PW_SAMPLE_TOP       10
+// Key index of samples taken outside every region
+#define PW_SAMPLE_OUTSIDE   -1
+#define PW_SYMBOL_LEN       256
+
+struct PwSample{
+	unsigned long long address;
+	// Key index of the innermost open region, PW_SAMPLE_OUTSIDE if none
+	int key;
+	int event;
+};
+
+// Lock free single producer, single consumer ring. The producer is the
+// owning thread's overflow handler, which must never wait, so a full ring
+// drops the sample and counts it. The consumer is the same thread between
+// regions or any thread once recording is over
+class SampleRing{
+public:
+	SampleRing() { head_ = tail_ = 0; dropped_ = 0; }
+
+	void init(unsigned capacity) {
+		buf_.resize(capacity);
+		head_ = tail_ = 0;
+		dropped_ = 0;
+	}
+
+	void push(const PwSample& s) {
+		unsigned head = head_;
+		if(!buf_.size() || head - tail_ >= buf_.size()) {
+			dropped_++;
+			return;
+		}
+		buf_.ptr()[head % buf_.size()] = s;
+		// The sample must be in place before the consumer can see it
+		__sync_synchronize();
+		head_ = head + 1;
+	}
+
+	// Append everything pushed so far to out
+	void drain(Array_T<PwSample>& out) {
+		unsigned head = head_;
+		__sync_synchronize();
+		for(unsigned i = tail_; i != head; i++)
+			out.push_back(buf_.ptr()[i % buf_.size()]);
+		__sync_synchronize();
+		tail_ = head;
+	}
+
+	// Forget everything pushed so far
+	void discard() { tail_ = head_; }
+
+	unsigned long long dropped() const { return dropped_; }
+	unsigned long long bytes() const { return buf_.capacity()*sizeof(PwSample); }
+
+private:
+	Array_T<PwSample> buf_;
+	volatile unsigned head_;
+	volatile unsigned tail_;
+	volatile unsigned long long dropped_;
+};
+
+struct PwModuleSearch{
+	unsigned long long address;
+	const char* name;
+	unsigned long long base;
+	bool found;
+};
+
+inline int pwFindModule(struct dl_phdr_info* info, size_t, void* data)
+{
+	PwModuleSearch* s = (PwModuleSearch*)data;
+	for(int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+		if(ph.p_type != PT_LOAD)
+			continue;
+		unsigned long long start = info->dlpi_addr + ph.p_vaddr;
+		if(s->address >= start && s->address < start + ph.p_memsz) {
+			s->name = info->dlpi_name;
+			s->base = info->dlpi_addr;
+			s->found = true;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Module holding address and the address addr2line expects for it: the
+// address less the module's load base (zero for non-PIE programs)
+inline bool pwSampleModule(unsigned long long address, char* path, size_t len, unsigned long long& offset)
+{
+	PwModuleSearch s;
+	s.address = address;
+	s.name = NULL;
+	s.base = 0;
+	s.found = false;
+	dl_iterate_phdr(pwFindModule, &s);
+	offset = address - s.base;
+	if(!s.found) {
+		snprintf(path, len, "??");
+		return false;
+	}
+	// The main program has no name in the list
+	if(s.name == NULL || !s.name[0]) {
+		ssize_t n = readlink("/proc/self/exe", path, len-1);
+		path[n > 0 ? n : 0] = 0;
+		if(n <= 0)
+			snprintf(path, len, "??");
+	}
+	else
+		snprintf(path, len, "%s", s.name);
+	return true;
+}
+
+// Demangled function holding address, and the function's start so samples
+// can be grouped by function. Unknown functions start at the address itself
+inline void pwSampleSymbol(unsigned long long address, char* name, size_t len, unsigned long long& start)
+{
+	Dl_info info;
+	if(!dladdr((void*)address, &info) || info.dli_sname == NULL) {
+		snprintf(name, len, "??");
+		start = address;
+		return;
+	}
+	int status = -1;
+	char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+	snprintf(name, len, "%s", status == 0 ? demangled : info.dli_sname);
+	free(demangled);
+	start = (unsigned long long)info.dli_saddr;
+}
+
+// Orders samples by region, then event, then address
+inline int pwCompareSample(const void* a, const void* b)
+{
+	const PwSample& x = *(const PwSample*)a;
+	const PwSample& y = *(const PwSample*)b;
+	if(x.key != y.key)
+		return x.key < y.key ? -1 : 1;
+	if(x.event != y.event)
+		return x.event < y.event ? -1 : 1;
+	return (x.address > y.address) - (x.address < y.address);
+}
+
+struct PwSampleCount{
+	unsigned long long address;
+	unsigned long long count;
+};
+
+// Most samples first
+inline int pwCompareSampleCount(const void* a, const void* b)
+{
+	const PwSampleCount& x = *(const PwSampleCount*)a;
+	const PwSampleCount& y = *(const PwSampleCount*)b;
+	if(x.count != y.count)
+		return x.count > y.count ? -1 : 1;
+	return (x.address > y.address) - (x.address < y.address);
+}
+
+// Distinct addresses of n samples sorted by address, with their counts
+inline void pwCountAddresses(const PwSample* samples, unsigned n, Array_T<PwSampleCount>& counts)
+{
+	counts.resize(0);
+	for(unsigned i = 0; i < n; i++) {
+		if(counts.size() && counts[counts.size()-1].address == samples[i].address) {
+			counts[counts.size()-1].count++;
+			continue;
+		}
+		PwSampleCount c;
+		c.address = samples[i].address;
+		c.count = 1;
+		counts.push_back(c);
+	}
+}
+
+// Histograms by function and by address of the n samples of one region
+// and event, sorted by address. Each sample stands for threshold events
+inline void pwPrintSampleHistogram(const PwSample* samples, unsigned n, long long threshold)
+{
+	Array_T<PwSampleCount> addresses;
+	pwCountAddresses(samples, n, addresses);
+
+	// Addresses in one function share its start address
+	Array_T<PwSampleCount> functions;
+	for(unsigned i = 0; i < addresses.size(); i++) {
+		char name[PW_SYMBOL_LEN];
+		unsigned long long start;
+		pwSampleSymbol(addresses[i].address, name, sizeof(name), start);
+		unsigned f = 0;
+		while(f < functions.size() && functions[f].address != start)
+			f++;
+		if(f == functions.size()) {
+			PwSampleCount c;
+			c.address = start;
+			c.count = 0;
+			functions.push_back(c);
+		}
+		functions[f].count += addresses[i].count;
+	}
+	qsort(functions.ptr(), functions.size(), sizeof(PwSampleCount), pwCompareSampleCount);
+	qsort(addresses.ptr(), addresses.size(), sizeof(PwSampleCount), pwCompareSampleCount);
+
+	char name[PW_SYMBOL_LEN], module[PW_SYMBOL_LEN];
+	unsigned long long start, offset;
+	printf("    %10s %7s %16s  %s\n", "Samples", "%", "Est. events", "Function");
+	for(unsigned f = 0; f < functions.size() && f < PW_SAMPLE_TOP; f++) {
+		pwSampleSymbol(functions[f].address, name, sizeof(name), start);
+		if(!strcmp(name, "??"))
+			snprintf(name, sizeof(name), "?? at 0x%llx", functions[f].address);
+		printf("    %10llu %7.2f %16.0f  %s\n", functions[f].count, 100.0*functions[f].count/n,
+			(double)functions[f].count*threshold, name);
+	}
+	if(functions.size() > PW_SAMPLE_TOP)
+		printf("    ... %u more functions\n", functions.size() - PW_SAMPLE_TOP);
+
+	printf("    %10s %7s %18s  %s\n", "Samples", "%", "Address", "Symbol (module+offset)");
+	for(unsigned a = 0; a < addresses.size() && a < PW_SAMPLE_TOP; a++) {
+		pwSampleSymbol(addresses[a].address, name, sizeof(name), start);
+		pwSampleModule(addresses[a].address, module, sizeof(module), offset);
+		const char* base = strrchr(module, '/');
+		printf("    %10llu %7.2f 0x%016llx  %s+0x%llx (%s+0x%llx)\n", addresses[a].count, 100.0*addresses[a].count/n,
+			addresses[a].address, name, addresses[a].address - start, base ? base+1 : module, offset);
+	}
+	if(addresses.size() > PW_SAMPLE_TOP)
+		printf("    ... %u more addresses\n", addresses.size() - PW_SAMPLE_TOP);
+}
+
+#endif
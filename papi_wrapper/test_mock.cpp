@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//---------------------------------------------------------------
+// Mock backend counts, run by "make CXX=g++ check" on the host
+//
+// The mock advances a set by one tick per region start or stop read, event
+// code c counting (c+1)*1000 per tick, so a region with n regions nested
+// anywhere inside it counts (2n+1)*(c+1)*1000 on every thread. Checks that
+// nesting, pass rotation, the pass schedule and the multi-run report give
+// exactly that, and that snapshots and the init() calibration, which also
+// touch the counters, leave it unchanged, also when snapshots wait for
+// region starts and stops as with PAPI. Also checks that a full arena drops
+// records and that threads out of step are found.
+//---------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "papi_wrapper.h"
+
+#define THREADS 3
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+static long long mockCount(unsigned c, unsigned nested)
+{
+	return (2*nested+1)*(c+1)*1000LL;
+}
+
+static void setup(const char* events, const char* counters, const char* fixed)
+{
+	setenv("PAPI_EVENTS", events, 1);
+	setenv("PAPI_SCHEDULE_CACHE", "off", 1);
+	if(counters)
+		setenv("PW_MOCK_COUNTERS", counters, 1);
+	else
+		unsetenv("PW_MOCK_COUNTERS");
+	if(fixed)
+		setenv("PW_MOCK_FIXED", fixed, 1);
+	else
+		unsetenv("PW_MOCK_FIXED");
+	unsetenv("PW_MOCK_SIGNAL_READS");
+	unsetenv("PAPI_SNAPSHOT");
+	unsetenv("PAPI_SUBTRACT_OVERHEAD");
+	omp_set_num_threads(THREADS);
+}
+
+static void pack(PapiWrapper& pw, Array_T<char>& buffer)
+{
+	unsigned long long bytes = pw.packedSize();
+	buffer.resize(bytes);
+	pw.packRecords(buffer.ptr());
+	CHECK(pwBufferCheck(buffer.ptr(), bytes));
+}
+
+// Counts of record i's pass events on every thread, nested regions inside it
+static void checkRecord(const char* buf, unsigned i, unsigned nested)
+{
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferEvent const* events = pwBufferEvents(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	for(unsigned t = 0; t < h->numThreads; t++) {
+		long long const* counts = pwBufferCounts(buf, t) + (size_t)i*h->numEvents;
+		for(unsigned e = 0; e < h->numEvents; e++)
+			if((unsigned)events[e].pass == records[i].pass)
+				CHECK(counts[e] == mockCount(e, nested));
+	}
+}
+
+// Three levels, the outer region has four regions nested in it
+static void testNesting()
+{
+	setup("A|BB", NULL, NULL);
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.init();
+	CHECK(pw.numPasses() == 1);
+
+	pw.startRecording(1);
+	pw.startRecording(2);
+	pw.stopRecording();
+	pw.startRecording(3);
+	pw.startRecording(4);
+	pw.stopRecording();
+	pw.startRecording(4);
+	pw.stopRecording();
+	pw.stopRecording();
+	pw.stopRecording();
+
+	// In-region records nest the same way
+	#pragma omp parallel
+	{
+		pw.threadStartRecording(5);
+		pw.threadStartRecording(6);
+		pw.threadStopRecording();
+		pw.threadStopRecording();
+	}
+
+	Array_T<char> buffer;
+	pack(pw, buffer);
+	const char* buf = buffer.ptr();
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	CHECK(pwBufferHeader(buf)->numRecords == 7);
+	unsigned nested[7] = {4, 0, 2, 0, 0, 1, 0};
+	int parent[7] = {-1, 0, 0, 2, 2, -1, 5};
+	for(unsigned i = 0; i < 7; i++) {
+		CHECK(records[i].parent == parent[i]);
+		checkRecord(buf, i, nested[i]);
+	}
+}
+
+// One counter, one event per pass, each repeat of a key counts the next pass
+static void testPassRotation()
+{
+	setup("A|BB|CCC", "1", NULL);
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.init();
+	CHECK(pw.numPasses() == 3);
+
+	for(int r = 0; r < 6; r++) {
+		pw.startRecording(1);
+		pw.startRecording(2);
+		pw.stopRecording();
+		pw.stopRecording();
+	}
+
+	Array_T<char> buffer;
+	pack(pw, buffer);
+	const char* buf = buffer.ptr();
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	PwBufferEvent const* events = pwBufferEvents(buf);
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	unsigned inPass[3] = {0, 0, 0};
+	for(unsigned e = 0; e < h->numEvents; e++) {
+		CHECK(events[e].pass >= 0 && events[e].pass < 3);
+		if(events[e].pass >= 0 && events[e].pass < 3)
+			inPass[events[e].pass]++;
+	}
+	CHECK(inPass[0] == 1 && inPass[1] == 1 && inPass[2] == 1);
+
+	CHECK(h->numRecords == 12);
+	for(unsigned r = 0; r < 6; r++) {
+		CHECK(records[2*r].pass == r % 3);
+		CHECK(records[2*r+1].pass == r % 3);
+		checkRecord(buf, 2*r, 1);
+		checkRecord(buf, 2*r+1, 0);
+	}
+}
+
+// Fixed counter events never share a pass, the rest fill the passes up
+static void testFixedEvents()
+{
+	setup("A|BB|CCC|DDDD", "2", "A|BB");
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.init();
+	CHECK(pw.numPasses() == 2);
+
+	pw.startRecording(1);
+	pw.stopRecording();
+
+	Array_T<char> buffer;
+	pack(pw, buffer);
+	PwBufferEvent const* events = pwBufferEvents(buffer.ptr());
+	CHECK(events[0].pass != events[1].pass);
+	CHECK(events[2].pass != events[3].pass);
+	checkRecord(buffer.ptr(), 0, 0);
+}
+
+// Lines of one section of a report, e.g. "Counts", as numbers
+static unsigned reportSection(const char* report, const char* section, double* values, unsigned max)
+{
+	char title[64];
+	snprintf(title, sizeof(title), "-----------%s-----------\n", section);
+	const char* p = strstr(report, title);
+	unsigned n = 0;
+	if(p == NULL)
+		return 0;
+	p += strlen(title);
+	while(*p && *p != '\n' && n < max) {
+		char* end;
+		values[n] = strtod(p, &end);
+		if(end == p)
+			break;
+		n++;
+		p = end;
+		while(*p == '\t' || *p == '\n') {
+			if(*p == '\n' && p[1] == '\n')
+				return n;
+			p++;
+		}
+	}
+	return n;
+}
+
+// What one of the wrapper's reports prints
+static void capture(PapiWrapper& pw, void (PapiWrapper::*print)(), Array_T<char>& report)
+{
+	char path[] = "/tmp/pw_test_reportXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	fflush(stdout);
+	int saved = dup(1);
+	dup2(fd, 1);
+	(pw.*print)();
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+
+	off_t bytes = lseek(fd, 0, SEEK_END);
+	report.resize(bytes+1);
+	CHECK(pread(fd, report.ptr(), bytes, 0) == bytes);
+	report[bytes] = 0;
+	close(fd);
+	unlink(path);
+}
+
+// Per key means summed over the team, each event counted in half the runs
+static void testMultiRun()
+{
+	setup("A|BB|CCC", NULL, NULL);
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.init();
+	CHECK(pw.numPasses() == 2);
+
+	for(int r = 0; r < 4; r++) {
+		pw.startRecording(1);
+		pw.startRecording(2);
+		pw.stopRecording();
+		pw.startRecording(2);
+		pw.stopRecording();
+		pw.stopRecording();
+	}
+
+	Array_T<char> report;
+	capture(pw, &PapiWrapper::multiRunPrintAverageRecords, report);
+
+	// Time then one row per event, a column per key
+	double counts[8], exclusive[8];
+	CHECK(reportSection(report.ptr(), "Counts", counts, 8) == 8);
+	CHECK(reportSection(report.ptr(), "Exclusive counts", exclusive, 8) == 8);
+	for(unsigned e = 0; e < 3; e++) {
+		CHECK(counts[2 + 2*e] == THREADS*mockCount(e, 2));
+		CHECK(counts[3 + 2*e] == THREADS*mockCount(e, 0));
+		CHECK(exclusive[2 + 2*e] == THREADS*(mockCount(e, 2) - 2*mockCount(e, 0)));
+		CHECK(exclusive[3 + 2*e] == THREADS*mockCount(e, 0));
+	}
+	CHECK(counts[0] > counts[1] && counts[1] > 0);
+}
+
+// Snapshots peek between reads and the calibration starts its own sets, so
+// neither may move the counts of the regions recorded afterwards
+static void testSnapshots()
+{
+	setup("A|BB|CCC", NULL, NULL);
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.setSnapshots(0.0002);
+	pw.init();
+
+	for(int r = 0; r < 4; r++) {
+		pw.startRecording(1);
+		for(int i = 0; i < 3; i++) {
+			pw.startRecording(2);
+			#pragma omp parallel
+			{
+				double start = omp_get_wtime();
+				while(omp_get_wtime() - start < 0.002);
+			}
+			pw.stopRecording();
+		}
+		pw.stopRecording();
+	}
+
+	Array_T<char> buffer;
+	pack(pw, buffer);
+	CHECK(pwBufferHeader(buffer.ptr())->numRecords == 16);
+	for(unsigned r = 0; r < 4; r++) {
+		checkRecord(buffer.ptr(), 4*r, 3);
+		for(unsigned i = 1; i < 4; i++)
+			checkRecord(buffer.ptr(), 4*r+i, 0);
+	}
+}
+
+// With a backend that cannot be read in the signal handler, as with PAPI,
+// a long region only gets a timeline from the regions nested in it, as the
+// STREAM demo records each kernel in chunks
+static void testChunkedTimeline()
+{
+	setup("A|BB", NULL, NULL);
+	setenv("PW_MOCK_SIGNAL_READS", "0", 1);
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.setSnapshots(0.0005);
+	pw.init();
+	CHECK(pw.snapshotsNeedRegions());
+
+	#pragma omp parallel
+	{
+		pw.threadStartRecording(1);
+		for(int c = 0; c < 8; c++) {
+			pw.threadStartRecording(2);
+			double start = omp_get_wtime();
+			while(omp_get_wtime() - start < 0.001);
+			pw.threadStopRecording();
+		}
+		pw.threadStopRecording();
+	}
+
+	Array_T<char> report;
+	capture(pw, &PapiWrapper::printTimeline, report);
+	CHECK(strstr(report.ptr(), "For KEY ID 1 (3 threads") != NULL);
+	CHECK(strstr(report.ptr(), " 0 taken") == NULL);
+
+	// Due snapshots come from the counters the chunks read anyway
+	Array_T<char> buffer;
+	pack(pw, buffer);
+	CHECK(pwBufferHeader(buffer.ptr())->numRecords == 9);
+	checkRecord(buffer.ptr(), 0, 8);
+	for(unsigned i = 1; i < 9; i++)
+		checkRecord(buffer.ptr(), i, 0);
+	unsetenv("PW_MOCK_SIGNAL_READS");
+}
+
+// Regions past a full arena are dropped by the whole team, and threads are
+// checked against thread 0's sequence of records afterwards
+static void testInStep()
+{
+	setup("A|BB", NULL, NULL);
+	setenv("PAPI_RECORDS", "4", 1);
+	PapiWrapper full;
+	full.setBackend("mock");
+	full.init();
+	unsetenv("PAPI_RECORDS");
+	#pragma omp parallel
+	{
+		for(int i = 0; i < 6; i++) {
+			full.threadStartRecording(1);
+			full.threadStopRecording();
+		}
+	}
+	CHECK(full.droppedRecords() == 2);
+	CHECK(full.recordsInStep());
+	Array_T<char> buffer;
+	pack(full, buffer);
+	CHECK(pwBufferHeader(buffer.ptr())->numRecords == 4);
+	for(unsigned i = 0; i < 4; i++)
+		checkRecord(buffer.ptr(), i, 0);
+
+	// A smaller team after the full one, threads left out just have fewer
+	PapiWrapper smaller;
+	smaller.setBackend("mock");
+	smaller.init();
+	smaller.startRecording(1);
+	smaller.stopRecording();
+	#pragma omp parallel num_threads(THREADS-1)
+	{
+		smaller.threadStartRecording(2);
+		smaller.threadStopRecording();
+	}
+	CHECK(smaller.recordsInStep());
+	CHECK(smaller.droppedRecords() == 0);
+
+	// One thread alone puts the team out of step for every later record
+	PapiWrapper single;
+	single.setBackend("mock");
+	single.init();
+	#pragma omp parallel
+	{
+		#pragma omp single
+		{
+			single.threadStartRecording(1);
+			single.threadStopRecording();
+		}
+		single.threadStartRecording(2);
+		single.threadStopRecording();
+	}
+	CHECK(!single.recordsInStep());
+}
+
+int main()
+{
+	testNesting();
+	testPassRotation();
+	testFixedEvents();
+	testMultiRun();
+	testSnapshots();
+	testChunkedTimeline();
+	testInStep();
+
+	printf("test_mock: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//---------------------------------------------------------------
+// Record buffer round trip, run by "make CXX=g++ check" on the host
+//
+// Records nested regions with the mock backend, packs them with
+// packRecords() and decodes the buffer with the record_buffer.h helpers.
+// The mock counts exactly (code+1)*1000 per read of a set, and the wrapper
+// reads once at each region start and stop, so a region with k child
+// regions counts (2k+1)*(code+1)*1000 on every thread. Times are compared
+// with the trace file, which is written independently of the buffer.
+// Damaged headers must be refused by pwBufferCheck().
+//---------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <omp.h>
+#include "papi_wrapper.h"
+
+#define THREADS 4
+#define RUNS 4
+
+static int failures = 0;
+
+#define CHECK(cond) do { if(!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+// Mock count of one thread for event code c in a region with k children
+static long long mockCount(unsigned c, unsigned k)
+{
+	return (2*k+1)*(c+1)*1000LL;
+}
+
+// Trace records by index, for comparing times with the buffer
+static void readTrace(const char* path, Array_T<char>& file)
+{
+	FILE* f = fopen(path, "rb");
+	CHECK(f != NULL);
+	if(f == NULL)
+		return;
+	fseek(f, 0, SEEK_END);
+	long bytes = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	file.resize(bytes);
+	CHECK(fread(file.ptr(), 1, bytes, f) == (size_t)bytes);
+	fclose(f);
+}
+
+static void checkDamaged(const char* buf, unsigned long long bytes)
+{
+	Array_T<char> copy;
+	copy.resize(bytes);
+
+	memcpy(copy.ptr(), buf, bytes);
+	CHECK(pwBufferCheck(copy.ptr(), bytes));
+
+	pwBufferHeader(copy.ptr())->version = PW_BUFFER_VERSION-1;
+	CHECK(!pwBufferCheck(copy.ptr(), bytes));
+
+	memcpy(copy.ptr(), buf, bytes);
+	pwBufferHeader(copy.ptr())->magic = 0;
+	CHECK(!pwBufferCheck(copy.ptr(), bytes));
+
+	memcpy(copy.ptr(), buf, bytes);
+	pwBufferHeader(copy.ptr())->numRecords++;
+	CHECK(!pwBufferCheck(copy.ptr(), bytes));
+
+	// Each section offset and the total on its own
+	size_t offsets[] = {
+		offsetof(PwBufferHeader, eventsOffset), offsetof(PwBufferHeader, keysOffset),
+		offsetof(PwBufferHeader, recordsOffset), offsetof(PwBufferHeader, countsOffset),
+		offsetof(PwBufferHeader, timesOffset), offsetof(PwBufferHeader, overheadOffset),
+		offsetof(PwBufferHeader, metricsOffset), offsetof(PwBufferHeader, workOffset),
+		offsetof(PwBufferHeader, cpusOffset), offsetof(PwBufferHeader, totalBytes)
+	};
+	for(unsigned i = 0; i < sizeof(offsets)/sizeof(offsets[0]); i++) {
+		memcpy(copy.ptr(), buf, bytes);
+		*(unsigned long long*)(copy.ptr() + offsets[i]) += 8;
+		CHECK(!pwBufferCheck(copy.ptr(), bytes));
+	}
+
+	memcpy(copy.ptr(), buf, bytes);
+	CHECK(!pwBufferCheck(copy.ptr(), bytes-8));
+	CHECK(!pwBufferCheck(copy.ptr(), sizeof(PwBufferHeader)-1));
+	CHECK(!pwBufferCheck(NULL, bytes));
+}
+
+int main()
+{
+	char tracePath[] = "/tmp/pw_test_traceXXXXXX";
+	int fd = mkstemp(tracePath);
+	CHECK(fd >= 0);
+	close(fd);
+
+	// Three events on two mock counters, two passes
+	setenv("PAPI_EVENTS", "A|BB|CCC", 1);
+	setenv("PAPI_SCHEDULE_CACHE", "off", 1);
+	unsetenv("PW_MOCK_COUNTERS");
+	unsetenv("PW_MOCK_FIXED");
+	omp_set_num_threads(THREADS);
+
+	PapiWrapper pw;
+	pw.setBackend("mock");
+	pw.setTraceFile(tracePath);
+	pw.init();
+	CHECK(pw.numPasses() == 2);
+
+	// Each run: outer with two inner children, then an in-region record
+	for(int r = 0; r < RUNS; r++) {
+		pw.startRecording(PW_NAMED("outer"));
+		pw.startRecording(PW_NAMED("inner"));
+		pw.stopRecording();
+		pw.startRecording(PW_NAMED("inner"));
+		pw.stopRecording();
+		pw.stopRecording();
+		#pragma omp parallel
+		{
+			ThreadRecording region(pw, 7);
+		}
+	}
+
+	unsigned long long bytes = pw.packedSize();
+	Array_T<char> buffer;
+	buffer.resize(bytes);
+	pw.packRecords(buffer.ptr());
+	pw.closeTrace();
+
+	const char* buf = buffer.ptr();
+	CHECK(pwBufferCheck(buf, bytes));
+	PwBufferHeader const* h = pwBufferHeader(buf);
+	CHECK(h->numThreads == THREADS);
+	CHECK(h->numEvents == 3);
+	CHECK(h->numPasses == 2);
+	CHECK(h->numKeys == 3);
+	CHECK(h->numRecords == RUNS*4);
+
+	PwBufferEvent const* events = pwBufferEvents(buf);
+	CHECK(!strcmp(events[0].name, "A"));
+	CHECK(!strcmp(events[1].name, "BB"));
+	CHECK(!strcmp(events[2].name, "CCC"));
+
+	PwBufferKey const* keys = pwBufferKeys(buf);
+	CHECK(keys[0].key == PW_REGION("outer") && !strcmp(keys[0].name, "outer"));
+	CHECK(keys[1].key == PW_REGION("inner") && !strcmp(keys[1].name, "inner"));
+	CHECK(keys[2].key == 7 && keys[2].name[0] == 0);
+
+	// Records in the order they were opened, passes rotating per repeat
+	PwBufferRecord const* records = pwBufferRecords(buf);
+	for(int r = 0; r < RUNS; r++) {
+		PwBufferRecord const* rec = records + 4*r;
+		unsigned pass = r % 2;
+		CHECK(rec[0].rID == PW_REGION("outer") && rec[0].depth == 0 && rec[0].parent == -1 && rec[0].pass == pass);
+		CHECK(rec[1].rID == PW_REGION("inner") && rec[1].depth == 1 && rec[1].parent == 4*r && rec[1].pass == pass);
+		CHECK(rec[2].rID == PW_REGION("inner") && rec[2].depth == 1 && rec[2].parent == 4*r && rec[2].pass == pass);
+		CHECK(rec[3].rID == 7 && rec[3].depth == 0 && rec[3].parent == -1 && rec[3].pass == pass);
+	}
+
+	// Counts of the events in each record's pass are exact
+	for(unsigned t = 0; t < THREADS; t++) {
+		long long const* counts = pwBufferCounts(buf, t);
+		double const* times = pwBufferTimes(buf, t);
+		for(unsigned i = 0; i < h->numRecords; i++) {
+			unsigned children = (i % 4 == 0) ? 2 : 0;
+			for(unsigned e = 0; e < h->numEvents; e++)
+				if((unsigned)events[e].pass == records[i].pass)
+					CHECK(counts[i*h->numEvents + e] == mockCount(e, children));
+			CHECK(times[i] > 0);
+		}
+	}
+
+	// The trace holds the same records, with the same counts and times
+	Array_T<char> trace;
+	readTrace(tracePath, trace);
+	unlink(tracePath);
+	unsigned traced = 0;
+	if(trace.size() >= sizeof(PwTraceHeader)) {
+		PwTraceHeader const* th = (PwTraceHeader const*)trace.ptr();
+		CHECK(th->magic == PW_TRACE_MAGIC && th->bytesUsed == trace.size());
+		unsigned long long pos = th->dataOffset;
+		while(pos + sizeof(PwTraceBlock) <= th->bytesUsed) {
+			PwTraceBlock const* b = (PwTraceBlock const*)(trace.ptr() + pos);
+			if(b->type == PW_TRACE_RECORD) {
+				PwTraceRecord const* tr = (PwTraceRecord const*)(b+1);
+				CHECK(tr->index < h->numRecords);
+				if(tr->index < h->numRecords) {
+					PwBufferRecord const& rec = records[tr->index];
+					CHECK(tr->rID == rec.rID && tr->pass == rec.pass && tr->parent == rec.parent && tr->depth == rec.depth);
+					long long const* counts = (long long const*)(tr+1);
+					double const* times = (double const*)(counts + tr->nCounts*THREADS);
+					unsigned col = 0;
+					for(unsigned e = 0; e < h->numEvents; e++) {
+						if((unsigned)events[e].pass != rec.pass)
+							continue;
+						for(unsigned t = 0; t < THREADS; t++)
+							CHECK(counts[col*THREADS + t] == pwBufferCounts(buf, t)[tr->index*h->numEvents + e]);
+						col++;
+					}
+					CHECK(col == tr->nCounts);
+					for(unsigned t = 0; t < THREADS; t++)
+						CHECK(times[t] == pwBufferTimes(buf, t)[tr->index]);
+					traced++;
+				}
+			}
+			CHECK(b->bytes > 0);
+			if(!b->bytes)
+				break;
+			pos += b->bytes;
+		}
+	}
+	CHECK(traced == h->numRecords);
+
+	checkDamaged(buf, bytes);
+
+	printf("test_record_buffer: %s\n", failures ? "FAILED" : "passed");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#ifndef MIC_TIMELINE_H
+#define MIC_TIMELINE_H
+
+// Counter time series inside long regions. A timer interrupts every thread
+// at a fixed interval, and a thread with a region open stores a snapshot:
+// the time since its innermost region started and the counts so far. One
+// more is taken when a region at least one interval long closes.
+//
+// Consecutive snapshots of one region on one thread make an interval, put
+// in the bin holding its midpoint. A bin's rate for an event is the team's:
+// the counts per second of thread time, times the threads taking part.
+
+#include <stdio.h>
+#include <math.h>
+
+#include "array_t.h"
+#include "derived_metric.h"
+
+// Snapshots each thread keeps, PAPI_SNAPSHOT_BUFFER
+#define PW_SNAPSHOT_BUFFER  4096
+// Most bins printed, wider bins are used for longer regions
+#define PW_TIMELINE_ROWS    40
+#define PW_TIMELINE_WIDTH   40
+
+struct PwSnapshot{
+	// Seconds since the region started
+	double time;
+	// Key index of the region, and its serial number on the thread
+	int key;
+	unsigned serial;
+	int pass;
+	// Filled in when snapshots from every thread are put together
+	unsigned thread;
+	// Counts of the snapshot start at index*numEvents
+	unsigned index;
+};
+
+// Orders snapshots by key, thread, region and time
+inline int pwCompareSnapshot(const void* a, const void* b)
+{
+	const PwSnapshot& x = *(const PwSnapshot*)a;
+	const PwSnapshot& y = *(const PwSnapshot*)b;
+	if(x.key != y.key)
+		return x.key < y.key ? -1 : 1;
+	if(x.thread != y.thread)
+		return x.thread < y.thread ? -1 : 1;
+	if(x.serial != y.serial)
+		return x.serial < y.serial ? -1 : 1;
+	return (x.time > y.time) - (x.time < y.time);
+}
+
+// Sums counts and thread time per bin and event for n sorted snapshots of
+// one key. counts[index*numEvents + event] are counts since the region
+// started, only events in the snapshot's pass are used
+inline void pwTimelineBins(const PwSnapshot* snaps, unsigned n, const long long* counts, unsigned numEvents,
+                           const int* eventPass, double binWidth, unsigned nBins,
+                           Array_T<double>& delta, Array_T<double>& dt, Array_T<unsigned>& snapshots)
+{
+	delta.resize(nBins*numEvents);
+	dt.resize(nBins*numEvents);
+	snapshots.resize(nBins);
+	delta.fill(0);
+	dt.fill(0);
+	snapshots.fill(0);
+
+	for(unsigned i = 0; i < n; i++) {
+		const PwSnapshot& s = snaps[i];
+		bool first = !i || snaps[i-1].thread != s.thread || snaps[i-1].serial != s.serial;
+		double start = first ? 0 : snaps[i-1].time;
+		double width = s.time - start;
+		if(width <= 0)
+			continue;
+		unsigned b = (unsigned)(0.5*(start + s.time)/binWidth);
+		if(b >= nBins)
+			b = nBins-1;
+		snapshots[b]++;
+		const long long* c = counts + (size_t)s.index*numEvents;
+		const long long* prev = first ? NULL : counts + (size_t)snaps[i-1].index*numEvents;
+		for(unsigned e = 0; e < numEvents; e++) {
+			if(eventPass[e] != s.pass)
+				continue;
+			delta[b*numEvents + e] += c[e] - (prev ? prev[e] : 0);
+			dt[b*numEvents + e] += width;
+		}
+	}
+}
+
+// One row per bin with the team's rate of every event and the metrics of
+// those rates (TIME is 1, so a metric over TIME is per second). The bar
+// plots the first metric, or the first event when there are no metrics
+inline void pwPrintTimeline(unsigned nBins, double binWidth, unsigned nThreads, unsigned numEvents, const char* const* eventNames,
+                            const double* delta, const double* dt, const unsigned* snapshots,
+                            const DerivedMetric* metrics, unsigned numMetrics)
+{
+	Array_T<double> values, plotted;
+	values.resize(nBins*(numEvents+1));
+	plotted.resize(nBins);
+	double most = 0;
+	for(unsigned b = 0; b < nBins; b++) {
+		double* v = values.ptr() + b*(numEvents+1);
+		for(unsigned e = 0; e < numEvents; e++) {
+			double t = dt[b*numEvents + e];
+			v[e] = t > 0 ? nThreads*delta[b*numEvents + e]/t : NAN;
+		}
+		v[numEvents] = 1;
+		plotted[b] = numMetrics ? metrics[0].eval(v) : v[0];
+		if(!isnan(plotted[b]) && plotted[b] > most)
+			most = plotted[b];
+	}
+
+	printf("%12s %12s %8s", "From (s)", "To (s)", "Snaps");
+	for(unsigned e = 0; e < numEvents; e++)
+		printf(" %14.14s/s", eventNames[e]);
+	for(unsigned m = 0; m < numMetrics; m++)
+		printf(" %16.16s", metrics[m].name());
+	printf("  %s\n", numMetrics ? metrics[0].name() : eventNames[0]);
+
+	for(unsigned b = 0; b < nBins; b++) {
+		const double* v = values.ptr() + b*(numEvents+1);
+		printf("%12.6f %12.6f %8u", b*binWidth, (b+1)*binWidth, snapshots[b]);
+		for(unsigned e = 0; e < numEvents; e++) {
+			if(isnan(v[e]))
+				printf(" %16s", "n/a");
+			else
+				printf(" %16.4g", v[e]);
+		}
+		for(unsigned m = 0; m < numMetrics; m++) {
+			double x = metrics[m].eval(v);
+			if(isnan(x))
+				printf(" %16s", "n/a");
+			else
+				printf(" %16.4g", x);
+		}
+		printf("  ");
+		unsigned bar = (most > 0 && !isnan(plotted[b]) && plotted[b] > 0) ? (unsigned)(plotted[b]/most*PW_TIMELINE_WIDTH + 0.5) : 0;
+		for(unsigned i = 0; i < bar; i++)
+			printf("#");
+		printf("\n");
+	}
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_TIMER_SOURCE_H
+#define MIC_TIMER_SOURCE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__MIC__)
+	#define PW_HAVE_TSC
+#endif
+
+#ifdef CLOCK_MONOTONIC_RAW
+	#define PW_CALIBRATION_CLOCK CLOCK_MONOTONIC_RAW
+#else
+	#define PW_CALIBRATION_CLOCK CLOCK_MONOTONIC
+#endif
+
+// How long init() spends measuring the TSC frequency
+#define PW_TSC_CALIBRATION_NS 20000000LL
+
+// Wall clock used for region times. The TSC is read directly (rdtscp where
+// the CPU has it, else rdtsc) when it is invariant, with its frequency
+// calibrated against CLOCK_MONOTONIC_RAW, otherwise clock_gettime is used.
+// PW_TIMER=tsc or PW_TIMER=clock overrides the choice, e.g. on MIC where
+// the TSC is constant but cpuid does not say so
+class TimerSource{
+public:
+	TimerSource() { tsc_ = false; rdtscp_ = false; secondsPerTick_ = 0; base_ = 0; resolution_ = 0; name_[0] = 0; }
+
+	void init() {
+		tsc_ = false;
+#ifdef PW_HAVE_TSC
+		unsigned a, b, c, d;
+		cpuid(0x80000000, a, b, c, d);
+		unsigned maxExt = a;
+		if(maxExt >= 0x80000001) {
+			cpuid(0x80000001, a, b, c, d);
+			rdtscp_ = (d >> 27) & 1;
+		}
+		if(maxExt >= 0x80000007) {
+			cpuid(0x80000007, a, b, c, d);
+			tsc_ = (d >> 8) & 1;
+		}
+#endif
+		char* choice = getenv("PW_TIMER");
+		if(choice != NULL && !strcmp(choice, "clock"))
+			tsc_ = false;
+#ifdef PW_HAVE_TSC
+		if(choice != NULL && !strcmp(choice, "tsc"))
+			tsc_ = true;
+#endif
+
+		if(tsc_)
+			calibrate();
+		else {
+			struct timespec t;
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			base_ = t.tv_sec;
+		}
+		measureResolution();
+
+		if(tsc_)
+			snprintf(name_, sizeof(name_), "%s %.3f GHz", rdtscp_ ? "rdtscp" : "rdtsc", 1e-9/secondsPerTick_);
+		else
+			snprintf(name_, sizeof(name_), "clock_gettime(CLOCK_MONOTONIC)");
+	}
+
+	// Seconds since init()
+	double now() const {
+#ifdef PW_HAVE_TSC
+		if(tsc_)
+			return (double)(ticks() - base_)*secondsPerTick_;
+#endif
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (double)(t.tv_sec - (time_t)base_) + 1e-9*t.tv_nsec;
+	}
+
+	// Smallest step between two successive non-equal readings, in seconds
+	double resolution() const { return resolution_; }
+	const char* name() const { return name_; }
+	bool usesTsc() const { return tsc_; }
+
+private:
+#ifdef PW_HAVE_TSC
+	static void cpuid(unsigned leaf, unsigned& a, unsigned& b, unsigned& c, unsigned& d) {
+		__asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(0));
+	}
+
+	unsigned long long ticks() const {
+		unsigned lo, hi;
+		if(rdtscp_) {
+			unsigned aux;
+			__asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+		}
+		else
+			__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+		return ((unsigned long long)hi << 32) | lo;
+	}
+#else
+	unsigned long long ticks() const { return 0; }
+#endif
+
+	static long long clockNs() {
+		struct timespec t;
+		clock_gettime(PW_CALIBRATION_CLOCK, &t);
+		return t.tv_sec*1000000000LL + t.tv_nsec;
+	}
+
+	// Ticks against CLOCK_MONOTONIC_RAW over PW_TSC_CALIBRATION_NS, each
+	// end taken as the midpoint of two clock reads around the TSC read
+	void calibrate() {
+		long long before = clockNs();
+		unsigned long long c0 = ticks();
+		long long after = clockNs();
+		long long t0 = before + (after - before)/2;
+
+		long long t1;
+		unsigned long long c1;
+		do {
+			before = clockNs();
+			c1 = ticks();
+			after = clockNs();
+			t1 = before + (after - before)/2;
+		} while(t1 - t0 < PW_TSC_CALIBRATION_NS);
+
+		if(c1 <= c0) {
+			tsc_ = false;
+			return;
+		}
+		secondsPerTick_ = 1e-9*(t1 - t0)/(double)(c1 - c0);
+		base_ = ticks();
+	}
+
+	void measureResolution() {
+		resolution_ = 0;
+		double last = now();
+		for(int i = 0; i < 1000; i++) {
+			double t = now();
+			if(t > last && (resolution_ == 0 || t - last < resolution_))
+				resolution_ = t - last;
+			last = t;
+		}
+		if(resolution_ == 0) {
+			struct timespec res;
+			clock_getres(tsc_ ? PW_CALIBRATION_CLOCK : CLOCK_MONOTONIC, &res);
+			resolution_ = res.tv_sec + 1e-9*res.tv_nsec;
+		}
+	}
+
+	bool tsc_;
+	bool rdtscp_;
+	double secondsPerTick_;
+	unsigned long long base_;
+	double resolution_;
+	char name_[64];
+};
+
+#endif
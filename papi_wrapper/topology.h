@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_TOPOLOGY_H
+#define MIC_TOPOLOGY_H
+
+// Where each thread runs: its CPU, and the physical core, L2 and NUMA node
+// that CPU belongs to, read from /sys/devices/system/cpu. Cores and caches
+// are identified by the lowest CPU sharing them, so ids are unique across
+// packages. On the MIC four hardware threads share a core and its L2, so
+// per thread L2 events only make sense summed per core.
+//
+// pwPrintTopologyLevel() groups per thread means by core, L2 or node.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "array_t.h"
+
+enum PwTopologyLevel{
+	PW_TOPO_CORE,
+	PW_TOPO_CACHE,
+	PW_TOPO_NODE
+};
+
+// Plain data, also copied into the record buffer
+struct PwCpuInfo{
+	// -1 where unknown
+	int cpu;
+	int core;
+	int cache;
+	int node;
+};
+
+// First CPU of a sysfs cpu list such as "0-3,8", -1 if it cannot be read
+inline int pwReadFirstCpu(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	int cpu = -1;
+	if(fscanf(f, "%d", &cpu) != 1)
+		cpu = -1;
+	fclose(f);
+	return cpu;
+}
+
+inline void pwCpuTopology(int cpu, PwCpuInfo& info)
+{
+	info.cpu = cpu;
+	info.core = info.cache = info.node = -1;
+	if(cpu < 0)
+		return;
+
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	info.core = pwReadFirstCpu(path);
+
+	// The unified or data L2
+	for(int i = 0; i < 16; i++) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+		FILE* f = fopen(path, "r");
+		if(f == NULL)
+			break;
+		int level = 0;
+		if(fscanf(f, "%d", &level) != 1)
+			level = 0;
+		fclose(f);
+		if(level != 2)
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, i);
+		f = fopen(path, "r");
+		char type[32] = "";
+		if(f != NULL) {
+			if(fscanf(f, "%31s", type) != 1)
+				type[0] = 0;
+			fclose(f);
+		}
+		if(!strcmp(type, "Instruction"))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+		info.cache = pwReadFirstCpu(path);
+		break;
+	}
+
+	// The cpu directory has a nodeN link on NUMA kernels
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if(dir != NULL) {
+		struct dirent* ent;
+		while((ent = readdir(dir)) != NULL) {
+			if(!strncmp(ent->d_name, "node", 4) && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+				info.node = atoi(ent->d_name + 4);
+				break;
+			}
+		}
+		closedir(dir);
+	}
+	// Without NUMA everything is on one node
+	if(info.node < 0)
+		info.node = 0;
+}
+
+inline int pwTopologyId(const PwCpuInfo& info, int level)
+{
+	switch(level) {
+		case PW_TOPO_CORE: return info.core;
+		case PW_TOPO_CACHE: return info.cache;
+		default: return info.node;
+	}
+}
+
+inline const char* pwTopologyName(int level)
+{
+	switch(level) {
+		case PW_TOPO_CORE: return "Core";
+		case PW_TOPO_CACHE: return "L2";
+		default: return "Node";
+	}
+}
+
+// True when two levels group the threads identically, e.g. the L2 is per core
+inline bool pwSameGrouping(unsigned numThreads, const PwCpuInfo* cpus, int a, int b)
+{
+	for(unsigned s = 0; s < numThreads; s++)
+		for(unsigned t = s+1; t < numThreads; t++)
+			if((pwTopologyId(cpus[s], a) == pwTopologyId(cpus[t], a)) != (pwTopologyId(cpus[s], b) == pwTopologyId(cpus[t], b)))
+				return false;
+	return true;
+}
+
+// One line per group at this level: threads in it, their mean and max time
+// and each event summed over them. times[thread], counts[thread*numEvents +
+// event] are per thread means, NAN for events not counted
+inline void pwPrintTopologyLevel(int level, unsigned numThreads, const PwCpuInfo* cpus, const double* times,
+                                 const double* counts, unsigned numEvents, const char* const* eventNames)
+{
+	// Groups in order of id, threads with an unknown id go in group -1
+	Array_T<int> ids;
+	for(unsigned t = 0; t < numThreads; t++) {
+		int id = pwTopologyId(cpus[t], level);
+		unsigned i = 0;
+		while(i < ids.size() && ids[i] < id)
+			i++;
+		if(i < ids.size() && ids[i] == id)
+			continue;
+		ids.push_back(id);
+		for(unsigned j = ids.size()-1; j > i; j--)
+			ids[j] = ids[j-1];
+		ids[i] = id;
+	}
+
+	unsigned minThreads = numThreads, maxThreads = 0;
+	printf("%-6s %8s %16s %16s", pwTopologyName(level), "Threads", "Time mean", "Time max");
+	for(unsigned e = 0; e < numEvents; e++)
+		printf(" %16.16s", eventNames[e]);
+	printf("  Thread IDs\n");
+	for(unsigned g = 0; g < ids.size(); g++) {
+		unsigned n = 0;
+		double sum = 0, max = 0;
+		for(unsigned t = 0; t < numThreads; t++) {
+			if(pwTopologyId(cpus[t], level) != ids[g])
+				continue;
+			sum += times[t];
+			if(times[t] > max)
+				max = times[t];
+			n++;
+		}
+		if(n < minThreads) minThreads = n;
+		if(n > maxThreads) maxThreads = n;
+
+		printf("%-6d %8u %16.9f %16.9f", ids[g], n, sum/n, max);
+		for(unsigned e = 0; e < numEvents; e++) {
+			double total = 0;
+			bool counted = false;
+			for(unsigned t = 0; t < numThreads; t++) {
+				double c = counts[t*numEvents + e];
+				if(pwTopologyId(cpus[t], level) == ids[g] && !isnan(c)) {
+					total += c;
+					counted = true;
+				}
+			}
+			if(counted)
+				printf(" %16.0f", total);
+			else
+				printf(" %16s", "n/a");
+		}
+		printf(" ");
+		for(unsigned t = 0; t < numThreads; t++)
+			if(pwTopologyId(cpus[t], level) == ids[g])
+				printf(" %u", t);
+		printf("\n");
+	}
+	printf("%u %s groups used, %u to %u threads each\n", ids.size(), pwTopologyName(level), minThreads, maxThreads);
+}
+
+// Every level, skipping L2 when it is shared exactly like the cores are
+inline void pwPrintTopology(unsigned numThreads, const PwCpuInfo* cpus, const double* times,
+                            const double* counts, unsigned numEvents, const char* const* eventNames)
+{
+	for(int level = PW_TOPO_CORE; level <= PW_TOPO_NODE; level++) {
+		if(level == PW_TOPO_CACHE && pwSameGrouping(numThreads, cpus, PW_TOPO_CORE, PW_TOPO_CACHE)) {
+			printf("L2 shared per core, as above\n");
+			continue;
+		}
+		pwPrintTopologyLevel(level, numThreads, cpus, times, counts, numEvents, eventNames);
+	}
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2004-2014
+ *              Tim Dykes University of Portsmouth
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef MIC_TRACE_FILE_H
+#define MIC_TRACE_FILE_H
+
+// Binary trace file written through mmap while recording, decoded offline
+// by pw_convert. Layout, every part 8 byte aligned:
+//   PwTraceHeader
+//   PwBufferEvent [numEvents]
+//   blocks from dataOffset up to bytesUsed, each a PwTraceBlock followed by
+//     PW_TRACE_KEY:    PwBufferKey, written the first time a key is seen
+//     PW_TRACE_RECORD: PwTraceRecord
+//                      long long counts[nCounts][numThreads] (one column per
+//                                 event of the record's pass, in pass order)
+//                      double    times[numThreads]
+//     PW_TRACE_THREAD_RECORD: PwTraceThreadRecord
+//                      long long counts[nCounts]
+// Records are appended as soon as the last thread of their team stops, so
+// a file cut short by a killed job is still readable up to bytesUsed.
+// Values are columnar within a record only: whole-run columns would need
+// every record to be complete before any of it could be written. In streaming
+// mode each thread writes its own PW_TRACE_THREAD_RECORD blocks instead,
+// and blocks of different threads (including key blocks) may interleave.
+
+#include "record_buffer.h"
+
+#define PW_TRACE_MAGIC      0x46545750      // "PWTF"
+#define PW_TRACE_VERSION    1
+#define PW_TRACE_KEY        1
+#define PW_TRACE_RECORD     2
+#define PW_TRACE_THREAD_RECORD  3
+
+struct PwTraceHeader{
+	unsigned magic;
+	unsigned version;
+	unsigned numThreads;
+	unsigned numEvents;
+	unsigned numPasses;
+	unsigned reserved;
+	unsigned long long bytesUsed;
+	unsigned long long eventsOffset;
+	unsigned long long dataOffset;
+};
+
+struct PwTraceBlock{
+	unsigned type;
+	unsigned bytes;     // Including this block header
+};
+
+struct PwTraceRecord{
+	unsigned index;
+	unsigned rID;
+	unsigned pass;
+	int parent;
+	unsigned depth;
+	unsigned nCounts;
+};
+
+// One thread's values of a record
+struct PwTraceThreadRecord{
+	unsigned index;
+	unsigned rID;
+	unsigned pass;
+	int parent;
+	unsigned depth;
+	unsigned nCounts;
+	unsigned thread;
+	unsigned reserved;
+	double time;
+};
+
+inline unsigned pwTraceThreadRecordBytes(unsigned nCounts)
+{
+	return sizeof(PwTraceBlock) + sizeof(PwTraceThreadRecord) + nCounts*sizeof(long long);
+}
+
+inline unsigned long long pwTraceRecordBytes(unsigned nCounts, unsigned numThreads)
+{
+	return sizeof(PwTraceBlock) + sizeof(PwTraceRecord) + (unsigned long long)nCounts*numThreads*sizeof(long long) + numThreads*sizeof(double);
+}
+
+#endif